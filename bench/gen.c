@@ -0,0 +1,145 @@
+/**
+ * Generator of synthetic tables for benchmarks of sps
+ * The same arguments always give the same table, on any machine.
+ *
+ * Usage: gen ROWS COLS [-s SEED] [-l LENGTH] [-n NUMERIC] [-q QUOTED]
+ *            [-e ESCAPED] [-d DELIMS] [-m MIXED]
+ *   -s SEED     seed of the generator (1)
+ *   -l LENGTH   average length of text cells (6)
+ *   -n NUMERIC  ratio of numeric cells (0.5)
+ *   -q QUOTED   ratio of text cells in quotes with a delimiter inside (0)
+ *   -e ESCAPED  ratio of text cells with an escaped delimiter inside (0)
+ *   -d DELIMS   delimiters, the first one is the main one (" ")
+ *   -m MIXED    ratio of cells separated by the other delimiters (0)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+typedef struct {
+    unsigned long rows, cols;
+    uint64_t seed;
+    unsigned length;
+    double numeric;
+    double quoted;
+    double escaped;
+    char *delims;
+    double mixed;
+} Options;
+
+// xorshift64*, rand() differs between the C libraries
+uint64_t nextRandom(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+// random number from [0, 1)
+double randomRatio(uint64_t *state) {
+    return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// random number from [0, n)
+unsigned long randomBelow(uint64_t *state, unsigned long n) {
+    return nextRandom(state) % n;
+}
+
+void printCell(Options *opt, uint64_t *state) {
+    if (randomRatio(state) < opt->numeric) {
+        // integers and numbers with decimal places
+        long value = randomBelow(state, 100000) - 10000;
+        if (randomBelow(state, 4) == 0)
+            printf("%ld.%lu", value, randomBelow(state, 1000));
+        else
+            printf("%ld", value);
+        return;
+    }
+
+    // lengths are uniform from 1 to 2 * length - 1
+    unsigned len = 1 + randomBelow(state, 2 * opt->length - 1);
+    char text[2 * len + 3];
+    for (unsigned i=0; i < len; i++)
+        text[i] = 'a' + randomBelow(state, 26);
+    text[len] = '\0';
+
+    double special = randomRatio(state);
+    if (special < opt->quoted) {
+        text[randomBelow(state, len)] = opt->delims[0];
+        printf("\"%s\"", text);
+    } else if (special < opt->quoted + opt->escaped) {
+        unsigned i = randomBelow(state, len);
+        printf("%.*s\\%c%s", i, text, opt->delims[0], &text[i + 1]);
+    } else {
+        printf("%s", text);
+    }
+}
+
+void printTable(Options *opt) {
+    uint64_t state = opt->seed * 0x9E3779B97F4A7C15ULL + 1;
+    size_t numDelims = strlen(opt->delims);
+
+    for (unsigned long i=0; i < opt->rows; i++) {
+        for (unsigned long j=0; j < opt->cols; j++) {
+            if (j > 0) {
+                char delim = opt->delims[0];
+                if (numDelims > 1 && randomRatio(&state) < opt->mixed)
+                    delim = opt->delims[1 + randomBelow(&state, numDelims - 1)];
+                putchar(delim);
+            }
+            printCell(opt, &state);
+        }
+        putchar('\n');
+    }
+}
+
+int parseOptions(int argc, char **argv, Options *opt) {
+    if (argc < 3)
+        return 1;
+
+    opt->rows = strtoul(argv[1], NULL, 10);
+    opt->cols = strtoul(argv[2], NULL, 10);
+    opt->seed = 1;
+    opt->length = 6;
+    opt->numeric = 0.5;
+    opt->quoted = 0;
+    opt->escaped = 0;
+    opt->delims = " ";
+    opt->mixed = 0;
+    if (opt->rows == 0 || opt->cols == 0)
+        return 1;
+
+    for (int i=3; i < argc; i += 2) {
+        if (i + 1 >= argc || argv[i][0] != '-' || strlen(argv[i]) != 2)
+            return 1;
+        char *value = argv[i + 1];
+
+        switch (argv[i][1]) {
+            case 's': opt->seed = strtoull(value, NULL, 10); break;
+            case 'l': opt->length = strtoul(value, NULL, 10); break;
+            case 'n': opt->numeric = strtod(value, NULL); break;
+            case 'q': opt->quoted = strtod(value, NULL); break;
+            case 'e': opt->escaped = strtod(value, NULL); break;
+            case 'd': opt->delims = value; break;
+            case 'm': opt->mixed = strtod(value, NULL); break;
+            default: return 1;
+        }
+    }
+    // the delimiter in quotes or after '\' must not be '"' or '\'
+    if (opt->length == 0 || opt->delims[0] == '\0' || strpbrk(opt->delims, "\"\\\n"))
+        return 1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (parseOptions(argc, argv, &opt) != 0) {
+        fprintf(stderr, "Usage: gen ROWS COLS [-s SEED] [-l LENGTH] [-n NUMERIC]"
+            " [-q QUOTED] [-e ESCAPED] [-d DELIMS] [-m MIXED]\n");
+        return 1;
+    }
+    printTable(&opt);
+    return 0;
+}
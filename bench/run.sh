@@ -0,0 +1,81 @@
+#!/bin/sh
+# Benchmarks of sps on generated tables
+# Every script from bench/scripts runs on every table several times and the
+# fastest run is reported. The result is a table separated by tabs:
+#   commit bench table rows cols load_ms execute_ms save_ms rss_kb
+#
+# Usage: sh bench/run.sh [REPEAT]
+
+REPEAT=${1:-3}
+DIR=$(dirname "$0")
+BIN=${BIN:-$DIR/../sps}
+GEN=$DIR/gen
+OUT=$DIR/out
+
+die() {
+    echo "$*" >&2
+    exit 1
+}
+
+[ -x "$BIN" ] || die "$BIN not found, run make first"
+[ -x "$GEN" ] || die "$GEN not found, run make bench/gen first"
+mkdir -p "$OUT" || die "cannot create $OUT"
+
+COMMIT=$(git -C "$DIR" rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+# $1 table name
+# $2 delimiters
+# rest = arguments of the generator
+table() {
+    local name="$1"
+    local delims="$2"
+    shift 2
+    # the tables are the same every time, generate only the missing ones
+    if [ ! -f "$OUT/$name.txt" ]; then
+        "$GEN" "$@" -d "$delims" >"$OUT/$name.txt" || die "cannot generate $name"
+    fi
+    echo "$delims" >"$OUT/$name.delims"
+    TABLES="$TABLES $name"
+}
+
+# $1 script name
+# $2 table name
+bench() {
+    local script="$1"
+    local name="$2"
+    local delims=$(cat "$OUT/$name.delims")
+    # the scripts have one command per line
+    tr '\n' ';' <"$DIR/scripts/$script.txt" | sed 's/;$//' >"$OUT/$script.cmd"
+
+    local best=""
+    local bestTotal=""
+    for i in $(seq "$REPEAT"); do
+        cp "$OUT/$name.txt" "$OUT/work.txt"
+        "$BIN" --time -d "$delims" -c "$OUT/$script.cmd" "$OUT/work.txt" 2>"$OUT/time.txt" ||
+            die "$script on $name failed: $(cat "$OUT/time.txt")"
+        local times=$(head -n 1 "$OUT/time.txt")
+        local total=$(echo "$times" | awk '{ print $1 + $2 + $3 }')
+        if [ -z "$best" ] || awk "BEGIN { exit !($total < $bestTotal) }"; then
+            best="$times"
+            bestTotal="$total"
+        fi
+    done
+
+    local rows=$(wc -l <"$OUT/$name.txt")
+    local cols=$(head -n 1 "$OUT/$name.txt" | tr -cd "$delims" | wc -c)
+    printf "%s\t%s\t%s\t%d\t%d\t%s\n" "$COMMIT" "$script" "$name" \
+        "$rows" "$((cols + 1))" "$best"
+}
+
+TABLES=""
+table long " " 100000 8 -s 1 -l 5 -n 0.8
+table wide " " 1000 400 -s 2 -l 4 -n 0.5
+table messy " ,;" 30000 10 -s 3 -l 8 -n 0.3 -q 0.05 -e 0.02 -m 0.1
+
+printf "commit\tbench\ttable\trows\tcols\tload_ms\texecute_ms\tsave_ms\trss_kb\n"
+for script in bulk_set aggregates find rows_cols loop sort; do
+    for name in $TABLES; do
+        bench "$script" "$name"
+    done
+done
+rm -f "$OUT/work.txt" "$OUT/time.txt"
@@ -4,20 +4,66 @@
  * E-mail: ondrej.mach@seznam.cz
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <malloc.h>
 
 #define MAX_CELL_LENGTH 1001
 #define MAX_COMMAND_LENGTH 1001
 #define INF_CYCLE_LIMIT 10000
+// sorts of fewer rows than this are not worth starting threads for
+#define PARALLEL_SORT_THRESHOLD 65536
+// unchanged parts of the input at least this long are copied by the kernel
+#define COPY_RANGE_THRESHOLD (1 << 20)
+// the server saves the table after this many seconds without commands
+#define IDLE_FLUSH_SECONDS 5
+// maximum number of clients connected to the server at once
+#define MAX_CLIENTS 16
+// snapshots of tables are saved next to them with this suffix
+#define SNAPSHOT_SUFFIX ".spsc"
+
+// what the memory is used for, allocations are counted for each of these
+typedef enum {
+    ALLOC_CELLS,
+    ALLOC_ROWS,
+    ALLOC_PROGRAM,
+    ALLOC_VARIABLES,
+    ALLOC_IO,
+    ALLOC_INDEXES,
+    NUM_ALLOC_CATEGORIES,
+} AllocCategory;
 
 // struct for each cell
 // might not be necessary, but makes the program more extensible
 typedef struct {
     char *str;
+    // str points into memory, that the cell doesn't own (e.g. a snapshot)
+    // such string is never freed or changed
+    bool borrowed;
+    // what the string is counted as (AllocCategory)
+    unsigned char category;
+    // number of the formula of the cell in table->formulas, 0 if there is none
+    unsigned formula;
 } Cell;
 
 // selection is always a rectangle
@@ -30,22 +76,227 @@ typedef struct {
     unsigned endCol;
 } Selection;
 
+// one slot of the hash map
+typedef struct {
+    size_t hash;
+    // 0 means, that the slot is empty
+    unsigned value;
+} HashSlot;
+
+// open addressing hash map from hashes to numbers (usually row numbers)
+// keys are not stored, they are compared through the value by the user
+typedef struct {
+    // number of slots, always a power of two
+    size_t cap;
+    // number of used slots
+    size_t len;
+    HashSlot *slots;
+} HashMap;
+
+// segment tree over the numbers in a block of cells, used by [min] and [max]
+typedef struct {
+    // the indexed block, user coordinates
+    unsigned startRow, endRow, startCol, endCol;
+    // number of cells in the block
+    unsigned len;
+    // number of leaves, power of two
+    unsigned size;
+    // values of the cells in row-major order, NAN if it's not a number
+    double *values;
+    // for every node the position of the lowest and the highest value + 1
+    // 0 means, that there is no number under the node
+    unsigned *minPos;
+    unsigned *maxPos;
+} MinMaxIndex;
+
+// kinds of the nodes of a formula
+typedef enum {
+    NODE_NUMBER,
+    // value of one cell
+    NODE_CELL,
+    // sum, avg, count, min or max of a block of cells
+    NODE_AGGREGATE,
+    NODE_NEGATE,
+    NODE_ADD,
+    NODE_SUB,
+    NODE_MUL,
+    NODE_DIV,
+} NodeType;
+
+// one node of the expression tree of a formula
+typedef struct {
+    NodeType type;
+    // what NODE_AGGREGATE computes (Aggregate)
+    unsigned char agg;
+    double num;
+    // the cells the node refers to, user coordinates
+    unsigned startRow, startCol, endRow, endCol;
+} ExprNode;
+
+// parsed formula, all the cells set by one command share it
+typedef struct {
+    // the tree in postfix order, children come before their parent,
+    // so it is evaluated by one pass with a stack
+    ExprNode *nodes;
+    unsigned len;
+    // number of formulas using the expression
+    unsigned users;
+} Expression;
+
+// formula of one cell
+typedef struct {
+    // NULL if the formula was removed
+    Expression *expr;
+    // where the cell is, user coordinates
+    unsigned row, col;
+    // the value must be computed again
+    bool dirty;
+    // used only by recalcFormulas: number of dirty formulas it waits for
+    // and the first edge to the formulas waiting for it
+    unsigned waitsFor;
+    unsigned firstEdge;
+} Formula;
+
+// a node of a formula refers to a cell in the bucket
+typedef struct {
+    unsigned formula;
+    unsigned node;
+    // bucket is a block of FORMULA_BUCKET_ROWS rows in the column
+    unsigned bucket;
+    unsigned col;
+    // next dependency in the same bucket, 0 at the end
+    unsigned next;
+} Dependency;
+
+// edge between two dirty formulas, the second one waits for the first one
+typedef struct {
+    unsigned to;
+    unsigned next;
+} FormulaEdge;
+
+// formulas of a table and the cells they depend on
+typedef struct {
+    // formulas are numbered from 1, cells keep their numbers
+    Formula *items;
+    unsigned len, cap;
+    // number of removed formulas, their numbers are free after reindexFormulas
+    unsigned removed;
+    // dependencies are numbered from 1
+    Dependency *deps;
+    unsigned depsLen, depsCap;
+    // maps a bucket and a column to the first dependency in it
+    HashMap buckets;
+    // dependencies on blocks too big for buckets, they are checked on every change
+    unsigned *wide;
+    unsigned wideLen, wideCap;
+    // formulas waiting for recalculation
+    unsigned *dirty;
+    unsigned dirtyLen, dirtyCap;
+    // edges are numbered from 1
+    FormulaEdge *edges;
+    unsigned edgesLen, edgesCap;
+    // stack for evaluation, enough for the longest expression
+    double *stack;
+    unsigned stackCap;
+    // cells were moved, positions of the formulas are not known
+    // and every formula must be recalculated
+    bool moved;
+    // values of the formulas are being written, they are not changes of inputs
+    bool recalculating;
+} Formulas;
+
+// where a row of the table came from
+typedef struct {
+    // position and length of the row in the input, including '\n'
+    size_t offset;
+    size_t length;
+    // number of cells in the input row
+    unsigned cells;
+    // the row must be printed again, because it was changed,
+    // it is not in the input, or its input form is not the one we print
+    bool dirty;
+} RowInfo;
+
+// the input file, it is kept until the table is saved,
+// so that unchanged rows can be copied as they are
+typedef struct {
+    // contents of the file terminated by '\0'
+    char *data;
+    size_t len;
+    // length of the memory mapping, 0 if the data are allocated
+    size_t mapLen;
+    // file descriptor of the input, -1 if it's not open
+    int fd;
+    // big files are read by a thread in the background, see startReader
+    bool reading;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    // signals, that more data were read
+    pthread_cond_t moved;
+    // the rest is guarded by the lock
+    // how many bytes at the beginning of data are already read
+    size_t filled;
+    bool done;
+    bool failed;
+    // the reader should stop as soon as possible
+    bool stop;
+} Source;
+
 // struct for table
 typedef struct {
     // number of rows and columns
     unsigned rows, cols;
     // the actual data, dynamically allocated
     Cell **cells;
+    // information about every row, it moves together with the row pointers
+    RowInfo *rowInfo;
+    // how many rows fit into cells and rowInfo
+    unsigned rowCap;
+    // cells deleted since the last compaction, their memory may still be held
+    unsigned long long deadCells;
+    // strings of the cells packed together by compactTable, cells borrow them
+    char *strings;
+    size_t stringsLen;
+    // cells of the rows packed together by compactTable, see freeRow
+    Cell *packedRows;
+    size_t packedRowsLen;
+    // every row must be printed again (columns were moved around)
+    bool allRowsDirty;
+    // the file the table was read from
+    Source source;
+    // delimiters of the source, rows that are NULL are read from it later
+    char *delimiters;
+    // mapped snapshot, cells can borrow strings from it (NULL if there is none)
+    char *snapshot;
+    size_t snapshotLen;
     // selection is an attribute of the table
     Selection sel;
     // the main delimiter
     char delim;
+    // indexes for [find], one for each column, NULL until they are needed
+    // every index maps cell contents to the first row, where it occurs
+    HashMap **findIndex;
+    // length of the findIndex array
+    unsigned findIndexLen;
+    // index of the last block searched by [min] or [max], NULL if there is none
+    MinMaxIndex *minMaxIndex;
+    // formulas of the cells, NULL until a formula is set
+    Formulas *formulas;
 } Table;
 
+// one of the variables _0 to _9
+// numbers stay numbers, they are turned into text only when they are used
+typedef struct {
+    // true if the value is in num, otherwise it is the text in cell
+    bool isNumber;
+    double num;
+    Cell cell;
+} Variable;
+
 // struct for table
 typedef struct {
     // variables _0 to _9
-    Cell cellVars[10];
+    Variable values[10];
     // Selection variable _
     Selection selVar;
 } Variables;
@@ -62,6 +313,7 @@ typedef enum {
     ERR_FILE_ACCESS,
     ERR_MEMORY,
     ERR_INF_CYCLE,
+    ERR_FORMULA_CYCLE,
 } State;
 
 // Everything, that commands might have access to
@@ -91,15 +343,50 @@ typedef struct {
     Command *cmds;
 } Program;
 
+typedef enum {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON,
+} StatsFormat;
+
 typedef struct {
     char *delimiters;
-    char *filename;
+    // tables to run the program on
+    char **filenames;
+    unsigned numFiles;
     char *commandString;
+    // number of files processed at the same time
+    unsigned jobs;
+    // the table is kept loaded and commands come through this socket,
+    // "-" means stdin, NULL if the server is not running
+    char *serveSocket;
+    // tables are loaded from binary snapshots, if they are up to date
+    bool cache;
+    // times of the phases are printed at the end
+    bool time;
+    // how the statistics are printed at the end
+    StatsFormat stats;
+    // rows are read only when the program touches them
+    bool lazy;
+    // the table is processed again, whenever its file changes
+    bool watch;
 } Arguments;
 
+// phases of the run, times of table phases are summed over all the tables
+typedef enum {
+    PHASE_ARGS,
+    PHASE_COMMANDS,
+    PHASE_LOAD,
+    PHASE_EXECUTE,
+    PHASE_TRIM,
+    PHASE_SAVE,
+    NUM_PHASES,
+} Phase;
+
 // ---------- FUNCTION PROTOTYPES ------------
 
 void printTable(Table *table, FILE *f);
+size_t printCell(Table *table, Cell *cell, FILE *f);
 
 unsigned selUpperBound(Table *table);
 unsigned selLowerBound(Table *table);
@@ -108,6 +395,189 @@ unsigned selRightBound(Table *table);
 
 State assureTableSize(Table *table, unsigned rows, unsigned cols);
 
+void cellWillChange(Table *table, unsigned row, unsigned col);
+void cellDidChange(Table *table, unsigned row, unsigned col);
+void rowsRearranged(Table *table);
+void colsSwapped(Table *table, unsigned c1, unsigned c2);
+void colsShifted(Table *table);
+void dropFindIndex(Table *table, unsigned col);
+void dropMinMaxIndex(Table *table);
+void formulaCellWillChange(Table *table, unsigned row, unsigned col);
+void formulaCellDidChange(Table *table, unsigned row, unsigned col);
+void formulasMoved(Table *table);
+void dropFormulas(Table *table);
+void closeSource(Source *source);
+State openSource(Source *source, char *filename, bool background);
+State stopReader(Source *source);
+State readTable(Table *table, char *fileBuffer, char *delimiters, bool lazy);
+State materializeRow(Table *table, unsigned row);
+State materializeRows(Table *table, unsigned first, unsigned last);
+
+// ---------- STATISTICS FUNCTIONS ------------
+// the counters are always updated, so they must be cheap
+// more threads can update them at once
+
+typedef struct {
+    unsigned long long mallocs, reallocs, frees;
+    // usable sizes of the allocated and the freed blocks
+    unsigned long long allocated, freed;
+} AllocStats;
+
+typedef struct {
+    AllocStats alloc[NUM_ALLOC_CATEGORIES];
+    // cells created by growing the table
+    unsigned long long cellsMaterialized;
+    unsigned peakRows, peakCols;
+    // resident memory in kB right after the program, the highest of all the tables
+    unsigned rssAfterProgram;
+    unsigned long long bytesRead, bytesWritten;
+    // nanoseconds spent in each phase
+    unsigned long long phaseTimes[NUM_PHASES];
+} Stats;
+
+Stats stats;
+
+const char *ALLOC_CATEGORY_NAMES[] = {
+    "cells", "rows", "program", "variables", "io", "indexes",
+};
+
+const char *PHASE_NAMES[] = {
+    "args", "commands", "load", "execute", "trim", "save",
+};
+
+void statAdd(unsigned long long *counter, unsigned long long value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+// raises the peak to the value
+void statMax(unsigned *peak, unsigned value) {
+    unsigned old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (value > old && !__atomic_compare_exchange_n(peak, &old, value, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void *statMalloc(AllocCategory category, size_t size) {
+    void *p = malloc(size);
+    if (p != NULL) {
+        statAdd(&stats.alloc[category].mallocs, 1);
+        statAdd(&stats.alloc[category].allocated, malloc_usable_size(p));
+    }
+    return p;
+}
+
+void *statCalloc(AllocCategory category, size_t num, size_t size) {
+    void *p = calloc(num, size);
+    if (p != NULL) {
+        statAdd(&stats.alloc[category].mallocs, 1);
+        statAdd(&stats.alloc[category].allocated, malloc_usable_size(p));
+    }
+    return p;
+}
+
+void *statRealloc(AllocCategory category, void *ptr, size_t size) {
+    size_t oldSize = malloc_usable_size(ptr);
+    void *p = realloc(ptr, size);
+    if (p != NULL) {
+        statAdd(&stats.alloc[category].reallocs, 1);
+        statAdd(&stats.alloc[category].freed, oldSize);
+        statAdd(&stats.alloc[category].allocated, malloc_usable_size(p));
+    }
+    return p;
+}
+
+void statFree(AllocCategory category, void *ptr) {
+    if (ptr == NULL)
+        return;
+    statAdd(&stats.alloc[category].frees, 1);
+    statAdd(&stats.alloc[category].freed, malloc_usable_size(ptr));
+    free(ptr);
+}
+
+// resident memory of the process in kB, 0 if it is not known
+unsigned currentRss() {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    unsigned long size, resident;
+    bool ok = fscanf(f, "%lu %lu", &size, &resident) == 2;
+    fclose(f);
+    return ok ? resident * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+}
+
+// monotonic time in nanoseconds
+long long nanoTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// adds the time since start to the phase, returns the current time
+long long addPhaseTime(Phase phase, long long start) {
+    long long now = nanoTime();
+    statAdd(&stats.phaseTimes[phase], now - start);
+    return now;
+}
+
+double phaseMillis(Phase phase) {
+    return stats.phaseTimes[phase] / 1e6;
+}
+
+// prints times of the phases in milliseconds and peak memory in kB
+// all on one line separated by tabs: load execute save rss
+void printTimes(FILE *f) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(f, "%.3f\t%.3f\t%.3f\t%ld\n", phaseMillis(PHASE_LOAD),
+        phaseMillis(PHASE_EXECUTE) + phaseMillis(PHASE_TRIM),
+        phaseMillis(PHASE_SAVE), usage.ru_maxrss);
+}
+
+void printStatsText(FILE *f) {
+    fprintf(f, "%-12s %12s\n", "phase", "ms");
+    for (int i=0; i < NUM_PHASES; i++)
+        fprintf(f, "%-12s %12.3f\n", PHASE_NAMES[i], phaseMillis(i));
+
+    fprintf(f, "\n%-12s %12s %12s %12s %14s %14s\n",
+        "allocations", "mallocs", "reallocs", "frees", "bytes", "freed");
+    for (int i=0; i < NUM_ALLOC_CATEGORIES; i++) {
+        AllocStats *a = &stats.alloc[i];
+        fprintf(f, "%-12s %12llu %12llu %12llu %14llu %14llu\n", ALLOC_CATEGORY_NAMES[i],
+            a->mallocs, a->reallocs, a->frees, a->allocated, a->freed);
+    }
+
+    fprintf(f, "\npeak rows: %u\npeak cols: %u\n", stats.peakRows, stats.peakCols);
+    fprintf(f, "rss after program: %u kB\n", stats.rssAfterProgram);
+    fprintf(f, "cells materialized: %llu\n", stats.cellsMaterialized);
+    fprintf(f, "bytes read: %llu\nbytes written: %llu\n", stats.bytesRead, stats.bytesWritten);
+}
+
+void printStatsJson(FILE *f) {
+    fprintf(f, "{\"phases_ms\": {");
+    for (int i=0; i < NUM_PHASES; i++)
+        fprintf(f, "%s\"%s\": %.3f", i ? ", " : "", PHASE_NAMES[i], phaseMillis(i));
+
+    fprintf(f, "}, \"allocations\": {");
+    for (int i=0; i < NUM_ALLOC_CATEGORIES; i++) {
+        AllocStats *a = &stats.alloc[i];
+        fprintf(f, "%s\"%s\": {\"mallocs\": %llu, \"reallocs\": %llu, \"frees\": %llu, "
+            "\"bytes\": %llu, \"freed\": %llu}", i ? ", " : "", ALLOC_CATEGORY_NAMES[i],
+            a->mallocs, a->reallocs, a->frees, a->allocated, a->freed);
+    }
+
+    fprintf(f, "}, \"peak_rows\": %u, \"peak_cols\": %u, \"rss_after_program_kb\": %u, "
+        "\"cells_materialized\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu}\n",
+        stats.peakRows, stats.peakCols, stats.rssAfterProgram,
+        stats.cellsMaterialized, stats.bytesRead, stats.bytesWritten);
+}
+
+// prints all the statistics in the format
+void printStats(FILE *f, StatsFormat format) {
+    if (format == STATS_TEXT)
+        printStatsText(f);
+    if (format == STATS_JSON)
+        printStatsJson(f);
+}
+
 // ---------- STRING FUNCTIONS ------------
 
 // gets rid of all the escape characters
@@ -165,12 +635,12 @@ size_t parseString(char *dst, char *src, char *delims) {
 
 char *fileToBuffer(FILE *f) {
     // get the file into a buffer
-    char *buffer = malloc(sizeof(char));;
+    char *buffer = statMalloc(ALLOC_IO, sizeof(char));
     int i = 0;
 
     while ((buffer[i] = fgetc(f)) != EOF) {
         i++;
-        buffer = realloc(buffer, (i+1) * sizeof(char));
+        buffer = statRealloc(ALLOC_IO, buffer, (i+1) * sizeof(char));
     }
     buffer[i] = '\0';
     return buffer;
@@ -179,7 +649,7 @@ char *fileToBuffer(FILE *f) {
 // checks if the first string begins with the second
 int strbgn(const char *str, const char *substr) {
     size_t len = strlen(substr);
-    return memcmp(str, substr, len);
+    return strncmp(str, substr, len);
 }
 
 // inserts a character into a string
@@ -188,6 +658,194 @@ void strins(char *dst, char *src) {
     memcpy(dst, src, strlen(src));
 }
 
+// ---------- NUMBER FORMATTING FUNCTIONS ------------
+// replacements for sprintf with "%g" and "%lu", which are way too slow
+// when a command writes many numbers into the table
+// all of them return the length of the written string
+
+// more than enough for any number these functions can produce
+#define MAX_NUMBER_LENGTH 32
+// number of significant digits "%g" prints
+#define G_PRECISION 6
+
+// all the powers of ten, that can be represented exactly as double
+static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// writes an unsigned number, same as "%lu"
+size_t formatUnsigned(char *dst, unsigned long long value) {
+    char digits[MAX_NUMBER_LENGTH];
+    size_t len = 0;
+    // digits come out in reverse order
+    do {
+        digits[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+
+    for (size_t i=0; i < len; i++)
+        dst[i] = digits[len - 1 - i];
+    dst[len] = '\0';
+    return len;
+}
+
+// writes G_PRECISION significant digits of a number in the format of "%g"
+// digits is a number from 10^5 to 10^6 - 1, exp is the decimal exponent
+size_t formatDigits(char *dst, unsigned long digits, int exp) {
+    char d[G_PRECISION];
+    for (int i=G_PRECISION-1; i >= 0; i--) {
+        d[i] = '0' + digits % 10;
+        digits /= 10;
+    }
+    // trailing zeros are never printed
+    int numDigits = G_PRECISION;
+    while (d[numDigits - 1] == '0')
+        numDigits--;
+
+    size_t len = 0;
+    // scientific notation
+    if (exp < -4 || exp >= G_PRECISION) {
+        dst[len++] = d[0];
+        if (numDigits > 1) {
+            dst[len++] = '.';
+            for (int i=1; i < numDigits; i++)
+                dst[len++] = d[i];
+        }
+        dst[len++] = 'e';
+        dst[len++] = (exp < 0) ? '-' : '+';
+        unsigned absExp = (exp < 0) ? -exp : exp;
+        // exponent always has at least two digits
+        if (absExp < 10)
+            dst[len++] = '0';
+        len += formatUnsigned(&dst[len], absExp);
+        return len;
+    }
+    // fixed notation, the number is less than one
+    if (exp < 0) {
+        dst[len++] = '0';
+        dst[len++] = '.';
+        for (int i=-1; i > exp; i--)
+            dst[len++] = '0';
+        for (int i=0; i < numDigits; i++)
+            dst[len++] = d[i];
+        dst[len] = '\0';
+        return len;
+    }
+    // fixed notation with integer part
+    for (int i=0; i <= exp; i++)
+        dst[len++] = d[i];
+    if (numDigits > exp + 1) {
+        dst[len++] = '.';
+        for (int i=exp+1; i < numDigits; i++)
+            dst[len++] = d[i];
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+// writes an integer value, that doesn't fit into G_PRECISION digits
+// the value is rounded exactly like printf does it (half to even)
+size_t formatBigInteger(char *dst, unsigned long long value) {
+    int exp = 0;
+    unsigned long long divisor = 1;
+    while (value / divisor >= 10) {
+        divisor *= 10;
+        exp++;
+    }
+    // leave only the significant digits
+    for (int i=0; i < G_PRECISION-1; i++)
+        divisor /= 10;
+
+    unsigned long long digits = value / divisor;
+    unsigned long long remainder = value % divisor;
+    unsigned long long half = divisor / 2;
+    if ((remainder > half) || ((remainder == half) && (digits & 1)))
+        digits++;
+    // rounding might have added a digit (999999.5 -> 1000000)
+    if (digits == POW10[G_PRECISION]) {
+        digits /= 10;
+        exp++;
+    }
+    return formatDigits(dst, digits, exp);
+}
+
+// writes a number, the output is the same as "%g"
+size_t formatDouble(char *dst, double value) {
+    // inf and nan are rare, they are handled by the library
+    if (!isfinite(value))
+        return sprintf(dst, "%g", value);
+
+    size_t len = 0;
+    if (signbit(value)) {
+        dst[len++] = '-';
+        value = -value;
+    }
+
+    // fast path for integers, they are the most common in tables
+    if (value < 9e18 && value == (double)(unsigned long long)value) {
+        unsigned long long integer = value;
+        if (integer < POW10[G_PRECISION])
+            return len + formatUnsigned(&dst[len], integer);
+        return len + formatBigInteger(&dst[len], integer);
+    }
+
+    // decimal exponent of the value
+    // very small and very big numbers are left to the library
+    const int MAX_EXP = sizeof(POW10) / sizeof(POW10[0]) - 1;
+    int exp = 0;
+    if (value >= 1) {
+        if (value >= POW10[MAX_EXP])
+            return len + sprintf(&dst[len], "%g", value);
+        while (POW10[exp + 1] <= value)
+            exp++;
+    } else {
+        const int MIN_EXP = -17;
+        while (exp > MIN_EXP && value * POW10[-exp] < 1)
+            exp--;
+        if (value * POW10[-exp] < 1)
+            return len + sprintf(&dst[len], "%g", value);
+    }
+
+    // scale the value, so that the significant digits are in the integer part
+    // this is only one rounding, so the error is way under 1e-9
+    int shift = G_PRECISION - 1 - exp;
+    double scaled;
+    if (shift >= 0)
+        scaled = value * POW10[shift];
+    else
+        scaled = value / POW10[-shift];
+
+    unsigned long digits = (unsigned long)scaled;
+    double fraction = scaled - digits;
+    // the fraction is too close to the half to be sure, how to round it
+    const double TIE_MARGIN = 1e-7;
+    if ((fraction > 0.5 - TIE_MARGIN) && (fraction < 0.5 + TIE_MARGIN))
+        return len + sprintf(&dst[len], "%g", value);
+
+    if (fraction > 0.5)
+        digits++;
+    // rounding might have added a digit
+    if (digits == POW10[G_PRECISION]) {
+        digits /= 10;
+        exp++;
+    }
+    // the exponent was guessed wrong, let the library handle it
+    if ((digits < POW10[G_PRECISION-1]) || (digits >= POW10[G_PRECISION]))
+        return len + sprintf(&dst[len], "%g", value);
+
+    return len + formatDigits(&dst[len], digits, exp);
+}
+
+// parses a whole string as a number
+State parseNumber(char *str, double *value) {
+    char *endPtr;
+    *value = strtod(str, &endPtr);
+    if ((endPtr == str) || (*endPtr != '\0'))
+        return ERR_BAD_SYNTAX;
+    return SUCCESS;
+}
+
 // parse any selection with coordinates
 State parseSelection(Selection *sel, char *str) {
     if (str[0] != '[')
@@ -267,6 +925,110 @@ State parseCoords(char *str, unsigned *a, unsigned *b) {
     return SUCCESS;
 }
 
+// ---------- HASH MAP FUNCTIONS ------------
+
+// FNV-1a hash of a string
+size_t hashString(const char *str) {
+    size_t hash = 14695981039346656037ULL;
+    for (; *str != '\0'; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// constructs an empty hash map with space for expected number of items
+State hashmap_ctor(HashMap *map, size_t expected) {
+    map->cap = 16;
+    // the map is kept at most half full
+    while (map->cap < 2 * expected)
+        map->cap *= 2;
+    map->len = 0;
+    map->slots = statCalloc(ALLOC_INDEXES, map->cap, sizeof(HashSlot));
+    if (map->slots == NULL)
+        return ERR_MEMORY;
+    return SUCCESS;
+}
+
+void hashmap_dtor(HashMap *map) {
+    statFree(ALLOC_INDEXES, map->slots);
+    map->slots = NULL;
+    map->cap = 0;
+    map->len = 0;
+}
+
+// finds the slot, where the key belongs
+// equals is called for every candidate value with the same hash
+// returns an empty slot, if the key is not in the map
+HashSlot *hashmapFind(HashMap *map, size_t hash,
+    bool (*equals)(void *ctx, unsigned value), void *ctx) {
+
+    size_t mask = map->cap - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        HashSlot *slot = &map->slots[i];
+        if (slot->value == 0)
+            return slot;
+        if ((slot->hash == hash) && equals(ctx, slot->value))
+            return slot;
+    }
+}
+
+// puts a value into the slot returned by hashmapFind
+// the slot must not be used before calling this function
+State hashmapInsert(HashMap *map, HashSlot *slot, size_t hash, unsigned value) {
+    slot->hash = hash;
+    slot->value = value;
+    map->len++;
+
+    if (2 * map->len <= map->cap)
+        return SUCCESS;
+
+    // the map is too full, move everything into a bigger one
+    HashMap bigger;
+    State s = hashmap_ctor(&bigger, map->len);
+    if (s != SUCCESS)
+        return s;
+
+    size_t mask = bigger.cap - 1;
+    for (size_t i=0; i < map->cap; i++) {
+        HashSlot *old = &map->slots[i];
+        if (old->value == 0)
+            continue;
+        size_t j = old->hash & mask;
+        while (bigger.slots[j].value != 0)
+            j = (j + 1) & mask;
+        bigger.slots[j] = *old;
+    }
+    bigger.len = map->len;
+    hashmap_dtor(map);
+    *map = bigger;
+    return SUCCESS;
+}
+
+// removes an item from the map
+// following items are shifted back, so no tombstones are needed
+void hashmapRemove(HashMap *map, HashSlot *slot) {
+    size_t mask = map->cap - 1;
+    size_t hole = slot - map->slots;
+    size_t i = hole;
+    while (true) {
+        i = (i + 1) & mask;
+        if (map->slots[i].value == 0)
+            break;
+        // the place, where the item would like to be
+        size_t home = map->slots[i].hash & mask;
+        // the item can move to the hole only if its home isn't after the hole
+        bool canMove = (hole <= i) ? (home <= hole || home > i)
+                                   : (home <= hole && home > i);
+        if (canMove) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+    map->slots[hole].value = 0;
+    map->len--;
+}
+
 // ---------- OTHER FUNCTIONS ------------
 
 // initializes the selection to default values
@@ -279,25 +1041,33 @@ void selection_init(Selection *sel) {
 
 // ---------- CELL FUNCTIONS -----------
 
+// all empty cells share this string, they don't need any memory
+char emptyCellString[] = "";
+
 // constructs a new empty cell
 State cell_ctor(Cell *cell) {
-    // only the termination character
-    cell->str = calloc(1, sizeof(char));
-    if (cell->str == NULL)
-        return ERR_MEMORY;
+    cell->str = emptyCellString;
+    cell->borrowed = true;
+    cell->category = ALLOC_CELLS;
+    cell->formula = 0;
     return SUCCESS;
 }
 
 // destructs a cell
 void cell_dtor(Cell *cell) {
-    free(cell->str);
+    if (!cell->borrowed)
+        statFree(cell->category, cell->str);
     cell->str = NULL;
+    cell->borrowed = false;
+    cell->formula = 0;
 }
 
 // writes chars from buffer into a cell
 State writeCell(Cell *cell, char *src) {
-    free(cell->str);
-    cell->str = malloc((strlen(src) + 1) * sizeof(char));
+    if (!cell->borrowed)
+        statFree(cell->category, cell->str);
+    cell->borrowed = false;
+    cell->str = statMalloc(cell->category, (strlen(src) + 1) * sizeof(char));
     if (cell->str == NULL)
         return ERR_MEMORY;
 
@@ -305,6 +1075,43 @@ State writeCell(Cell *cell, char *src) {
     return SUCCESS;
 }
 
+// makes space for a string of the length in the cell
+State resizeCell(Cell *cell, size_t len) {
+    // realloc can usually reuse the old string's memory
+    char *p;
+    if (cell->borrowed)
+        p = statMalloc(cell->category, (len + 1) * sizeof(char));
+    else
+        p = statRealloc(cell->category, cell->str, (len + 1) * sizeof(char));
+    if (p == NULL)
+        return ERR_MEMORY;
+    cell->str = p;
+    cell->borrowed = false;
+    return SUCCESS;
+}
+
+// writes a number into a cell, same format as "%g"
+State writeCellDouble(Cell *cell, double value) {
+    char buffer[MAX_NUMBER_LENGTH];
+    size_t len = formatDouble(buffer, value);
+    State s = resizeCell(cell, len);
+    if (s != SUCCESS)
+        return s;
+    memcpy(cell->str, buffer, len + 1);
+    return SUCCESS;
+}
+
+// writes an unsigned number into a cell
+State writeCellUnsigned(Cell *cell, unsigned long value) {
+    char buffer[MAX_NUMBER_LENGTH];
+    size_t len = formatUnsigned(buffer, value);
+    State s = resizeCell(cell, len);
+    if (s != SUCCESS)
+        return s;
+    memcpy(cell->str, buffer, len + 1);
+    return SUCCESS;
+}
+
 // writes chars from buffer into a cell
 State deepCopyCell(Cell *dst, Cell *src) {
     return writeCell(dst, src->str);
@@ -322,7 +1129,8 @@ State swapCell(Cell *c1, Cell *c2) {
 }
 
 // prints contents of one cell into a file
-void printCell(Table *table, Cell *cell, FILE *f) {
+// returns number of printed characters
+size_t printCell(Table *table, Cell *cell, FILE *f) {
     // just to be safe for cases, where there are tons of backslashes
     char buffer[2*strlen(cell->str) + 5];
     strcpy(buffer, cell->str);
@@ -345,7 +1153,8 @@ void printCell(Table *table, Cell *cell, FILE *f) {
         strins(buffer, "\"");
         strins(&buffer[strlen(buffer)], "\"");
     }
-    fprintf(f, "%s", buffer);
+    fputs(buffer, f);
+    return strlen(buffer);
 }
 
 // gets cell pointer from its coordinates
@@ -359,12 +1168,22 @@ double cellToDouble(Cell *cell) {
     return val;
 }
 
+// reads the cell as a number, only if the whole cell is a decimal number
+// "12abc", "0x10" or "inf" are texts
+bool cellNumber(Cell *cell, double *value) {
+    if (cell->str[strspn(cell->str, "0123456789+-.eE")] != '\0')
+        return false;
+    return parseNumber(cell->str, value) == SUCCESS;
+}
+
 // gets cell pointer from its coordinates
 Cell *getCellPtr(Table *table, unsigned row, unsigned col) {
     if ((row == 0) || (col == 0))
         return NULL;
 
     assureTableSize(table, row, col);
+    if (materializeRow(table, row) != SUCCESS)
+        return NULL;
     return &table->cells[row-1][col-1];
 }
 
@@ -394,9 +1213,9 @@ State program_ctor(Program *prog) {
 // deallocates the program structure
 void program_dtor(Program *prog) {
     for (size_t i=0; i < prog->len; i++) {
-        free(prog->cmds[i].argStr);
+        statFree(ALLOC_PROGRAM, prog->cmds[i].argStr);
     }
-    free(prog->cmds);
+    statFree(ALLOC_PROGRAM, prog->cmds);
     prog->len = 0;
 }
 
@@ -404,7 +1223,7 @@ void program_dtor(Program *prog) {
 State addCommand(Program *prog, const Command *cmd) {
     prog->len++;
 
-    Command *p = realloc(prog->cmds, sizeof(Command) * prog->len);
+    Command *p = statRealloc(ALLOC_PROGRAM, prog->cmds, sizeof(Command) * prog->len);
     if (p == NULL)
         return ERR_MEMORY;
     prog->cmds = p;
@@ -424,1163 +1243,5983 @@ State variables_ctor(Variables *v) {
     State s = SUCCESS;
     selection_init(&v->selVar);
 
-    const int num = sizeof(v->cellVars) / sizeof(Cell);
+    const int num = sizeof(v->values) / sizeof(Variable);
     for (int i=0; i<num; i++) {
-        s = cell_ctor(&v->cellVars[i]);
+        v->values[i].isNumber = false;
+        s = cell_ctor(&v->values[i].cell);
         if (s != SUCCESS)
             break;
+        v->values[i].cell.category = ALLOC_VARIABLES;
     }
     return s;
 }
 
 void variables_dtor(Variables *v) {
-    const int num = sizeof(v->cellVars) / sizeof(Cell);
+    const int num = sizeof(v->values) / sizeof(Variable);
     for (int i=0; i<num; i++) {
-        cell_dtor(&v->cellVars[i]);
+        cell_dtor(&v->values[i].cell);
     }
 }
 
-// ---------- SIMPLE TABLE FUNCTIONS -----------
+// stores text in the variable
+State setVariableString(Variable *var, char *str) {
+    var->isNumber = false;
+    return writeCell(&var->cell, str);
+}
 
-// constructs a new empty table
-void table_ctor(Table *table) {
-    table->rows = 0;
-    table->cols = 0;
-    table->cells = NULL;
-    selection_init(&table->sel);
+// stores a number in the variable
+// it is rounded the same way as its text, so nothing can tell the difference
+void setVariableNumber(Variable *var, double value) {
+    var->isNumber = true;
+    // small integers are printed exactly, they are the usual loop counters
+    if (value > -POW10[G_PRECISION] && value < POW10[G_PRECISION]
+        && value == (double)(long)value) {
+        var->num = value;
+        return;
+    }
+    char buffer[MAX_NUMBER_LENGTH];
+    formatDouble(buffer, value);
+    var->num = strtod(buffer, NULL);
 }
 
-// deallocates all the pointers in the table structure
-void table_dtor(Table *table) {
-    for (unsigned i=0; i < table->rows; i++) {
-        for (unsigned j=0; j < table->cols; j++) {
-            cell_dtor(&table->cells[i][j]);
-        }
-        free(table->cells[i]);
+// gets the text of the variable
+// buffer is used for numbers, it needs MAX_NUMBER_LENGTH chars
+char *variableString(Variable *var, char *buffer) {
+    if (!var->isNumber)
+        return var->cell.str;
+    formatDouble(buffer, var->num);
+    return buffer;
+}
+
+// gets the variable as an operand of sub
+// text, that does not start with a number, is 0, text after a number is an error
+State variableOperand(Variable *var, double *value) {
+    if (var->isNumber) {
+        *value = var->num;
+        return SUCCESS;
     }
+    char *endPtr;
+    *value = strtod(var->cell.str, &endPtr);
+    if ((*endPtr != '\0') && (endPtr != var->cell.str))
+        return ERR_GENERIC;
+    return SUCCESS;
+}
 
-    free(table->cells);
-    table->cells = NULL;
+// ---------- FIND INDEX FUNCTIONS -----------
+// indexes make repeated [find] on whole columns O(1)
+// they are kept up to date by the hooks below,
+// or dropped when that would be too expensive
 
-    table->rows = 0;
-    table->cols = 0;
+// what hashmapFind needs to compare a key with a cell in the column
+typedef struct {
+    Table *table;
+    unsigned col;
+    const char *key;
+} FindKey;
+
+bool findKeyEquals(void *ctx, unsigned row) {
+    FindKey *key = ctx;
+    return strcmp(key->table->cells[row-1][key->col-1].str, key->key) == 0;
 }
 
-// adds an empty row to the end of the table
-State addRow(Table *table) {
-    // allocate one more row pointer in the array
-    Cell **p = realloc(table->cells, (table->rows + 1) * sizeof(Cell *));
-    if (p)
-        table->cells = p;
-    else
-        return ERR_MEMORY;
+// returns the index of a column, or NULL if it wasn't built
+HashMap *getFindIndex(Table *table, unsigned col) {
+    if (col > table->findIndexLen)
+        return NULL;
+    return table->findIndex[col-1];
+}
 
-    // allocate new cell array for the new row
-    table->cells[table->rows] = malloc(table->cols * sizeof(Cell));
-    if (table->cells[table->rows] == NULL)
-        return ERR_MEMORY;
+// deallocates index of the column, it will be built again when needed
+void dropFindIndex(Table *table, unsigned col) {
+    HashMap *index = getFindIndex(table, col);
+    if (index == NULL)
+        return;
+    hashmap_dtor(index);
+    statFree(ALLOC_INDEXES, index);
+    table->findIndex[col-1] = NULL;
+}
 
-    // initialize all the cells in the new row
-    for (unsigned i=0; i < table->cols; i++) {
-        cell_ctor(&table->cells[table->rows][i]);
-    }
-    table->rows++;
-    return SUCCESS;
+// deallocates indexes of all columns
+void dropAllFindIndexes(Table *table) {
+    for (unsigned i=1; i <= table->findIndexLen; i++)
+        dropFindIndex(table, i);
 }
 
-// deletes the last row from the table
-void deleteRow(Table *table) {
-    // go through all the cells in the last row
-    // and destruct them
-    for (unsigned i=0; i < table->cols; i++) {
-        cell_dtor(&table->cells[table->rows - 1][i]);
-    }
-    table->rows--;
+// records the cell into the index, if it is the first occurrence of its value
+State findIndexInsert(Table *table, HashMap *index, unsigned row, unsigned col) {
+    FindKey key = {.table=table, .col=col, .key=table->cells[row-1][col-1].str};
+    size_t hash = hashString(key.key);
+    HashSlot *slot = hashmapFind(index, hash, findKeyEquals, &key);
+
+    if (slot->value == 0)
+        return hashmapInsert(index, slot, hash, row);
+    if (slot->value > row)
+        slot->value = row;
+    return SUCCESS;
 }
 
-// adds a column to the end of the table
-State addCol(Table *table) {
-    for (unsigned i=0; i < table->rows; i++) {
-        table->cells[i] = realloc(table->cells[i], (table->cols + 1) * sizeof(Cell));
-        cell_ctor(&table->cells[i][table->cols]);
-    }
-    table->cols++;
+// makes sure, that there is a place for the index of the column
+State growFindIndexArray(Table *table, unsigned col) {
+    if (col <= table->findIndexLen)
+        return SUCCESS;
+
+    HashMap **p = statRealloc(ALLOC_INDEXES, table->findIndex, col * sizeof(HashMap *));
+    if (p == NULL)
+        return ERR_MEMORY;
+    table->findIndex = p;
+    for (unsigned i=table->findIndexLen; i < col; i++)
+        table->findIndex[i] = NULL;
+    table->findIndexLen = col;
     return SUCCESS;
 }
 
-// deletes the last column of the table
-void deleteCol(Table *table) {
-    for (unsigned i=0; i < table->rows; i++) {
-        cell_dtor(&table->cells[i][table->cols - 1]);
+// builds the index of a column, all rows of the table must exist
+HashMap *buildFindIndex(Table *table, unsigned col) {
+    if (growFindIndexArray(table, col) != SUCCESS)
+        return NULL;
+    if (materializeRows(table, 1, table->rows) != SUCCESS)
+        return NULL;
+
+    HashMap *index = statMalloc(ALLOC_INDEXES, sizeof(HashMap));
+    if (index == NULL)
+        return NULL;
+    if (hashmap_ctor(index, table->rows) != SUCCESS) {
+        statFree(ALLOC_INDEXES, index);
+        return NULL;
     }
-    table->cols--;
+    table->findIndex[col-1] = index;
+
+    // going from the bottom, so the first occurrence is written last
+    for (unsigned row=table->rows; row >= 1; row--) {
+        if (findIndexInsert(table, index, row, col) != SUCCESS) {
+            dropFindIndex(table, col);
+            return NULL;
+        }
+    }
+    return index;
 }
 
-// deletes columns of the table from the right, that are empty
-State deleteExcessCols(Table *table) {
-    for (unsigned i=table->cols; i >= 1; i--) {
-        bool empty = true;
-        for (unsigned j=1; j <= table->rows; j++) {
-            if (strcmp(getCellPtr(table, j, i)->str, "") != 0) {
-                empty = false;
-                break;
-            }
+// returns the first row in the column, where the cell matches the string
+// 0 if there is no such row, the index is built if necessary
+unsigned findIndexLookup(Table *table, unsigned col, const char *str) {
+    HashMap *index = getFindIndex(table, col);
+    if (index == NULL)
+        index = buildFindIndex(table, col);
+    // not enough memory, search without the index
+    if (index == NULL) {
+        for (unsigned row=1; row <= table->rows; row++) {
+            Cell *cell = getCellPtr(table, row, col);
+            if (cell != NULL && strcmp(cell->str, str) == 0)
+                return row;
         }
-        if (empty)
-            deleteCol(table);
+        return 0;
     }
-    return SUCCESS;
+
+    FindKey key = {.table=table, .col=col, .key=str};
+    HashSlot *slot = hashmapFind(index, hashString(str), findKeyEquals, &key);
+    return slot->value;
 }
 
+// ---------- MIN MAX INDEX FUNCTIONS -----------
+// repeated [min] and [max] on the same block of cells
+// take O(1) and every change of a cell O(log N)
 
-// ---------- SELECTION FUNCTIONS -----------
-// functions don't have to access the data directly
-// program is more extensible this way
+// blocks smaller than this are just scanned
+#define MINMAX_INDEX_THRESHOLD 1024
 
-unsigned selUpperBound(Table *table) {
-    if (table->sel.startRow == 0) {
-        return 1;
-    }
-    return table->sel.startRow;
+// deallocates the index
+void dropMinMaxIndex(Table *table) {
+    MinMaxIndex *index = table->minMaxIndex;
+    if (index == NULL)
+        return;
+    statFree(ALLOC_INDEXES, index->values);
+    statFree(ALLOC_INDEXES, index->minPos);
+    statFree(ALLOC_INDEXES, index->maxPos);
+    statFree(ALLOC_INDEXES, index);
+    table->minMaxIndex = NULL;
 }
 
-unsigned selLowerBound(Table *table) {
-    if (table->sel.endRow == 0) {
-        if (table->rows == 0)
-            return 1;
-        return table->rows;
-    }
-    return table->sel.endRow;
+// picks the better of two positions from the subtrees
+// left positions come first in the row-major order, so they win ties
+unsigned minMaxBetter(MinMaxIndex *index, unsigned left, unsigned right, bool max) {
+    if (left == 0)
+        return right;
+    if (right == 0)
+        return left;
+
+    double l = index->values[left-1];
+    double r = index->values[right-1];
+    if (max)
+        return (r > l) ? right : left;
+    return (r < l) ? right : left;
 }
 
-unsigned selLeftBound(Table *table) {
-    if (table->sel.startCol == 0) {
-        return 1;
+// recalculates all the nodes above the leaf
+void minMaxUpdatePath(MinMaxIndex *index, unsigned leaf) {
+    unsigned node = (index->size + leaf) / 2;
+    for (; node >= 1; node /= 2) {
+        index->minPos[node] = minMaxBetter(index,
+            index->minPos[2*node], index->minPos[2*node + 1], false);
+        index->maxPos[node] = minMaxBetter(index,
+            index->maxPos[2*node], index->maxPos[2*node + 1], true);
     }
-    return table->sel.startCol;
 }
 
-unsigned selRightBound(Table *table) {
-    if (table->sel.endCol == 0) {
-        if (table->cols == 0)
-            return 1;
-        return table->cols;
-    }
-    return table->sel.endCol;
+// sets the leaf according to the value of its cell
+void minMaxSetLeaf(MinMaxIndex *index, unsigned leaf, double value) {
+    index->values[leaf] = value;
+    // the scan starts at infinity, so it never selects an infinite value
+    bool isNumber = !isnan(value);
+    index->minPos[index->size + leaf] = (isNumber && value != INFINITY) ? leaf + 1 : 0;
+    index->maxPos[index->size + leaf] = (isNumber && value != -INFINITY) ? leaf + 1 : 0;
 }
 
-// select one cell
-State selectCell(Table *table, unsigned row, unsigned col) {
-    table->sel.startRow = row;
-    table->sel.endRow = row;
-    table->sel.startCol = col;
-    table->sel.endCol = col;
-    assureTableSize(table, row, col);
-    return SUCCESS;
+// builds the index for the block, all the cells must exist
+MinMaxIndex *buildMinMaxIndex(Table *table,
+    unsigned startRow, unsigned endRow, unsigned startCol, unsigned endCol) {
+
+    dropMinMaxIndex(table);
+    if (materializeRows(table, startRow, endRow) != SUCCESS)
+        return NULL;
+
+    MinMaxIndex *index = statMalloc(ALLOC_INDEXES, sizeof(MinMaxIndex));
+    if (index == NULL)
+        return NULL;
+
+    index->startRow = startRow;
+    index->endRow = endRow;
+    index->startCol = startCol;
+    index->endCol = endCol;
+    index->len = (endRow - startRow + 1) * (endCol - startCol + 1);
+    index->size = 1;
+    while (index->size < index->len)
+        index->size *= 2;
+
+    index->values = statMalloc(ALLOC_INDEXES, index->len * sizeof(double));
+    index->minPos = statCalloc(ALLOC_INDEXES, 2 * index->size, sizeof(unsigned));
+    index->maxPos = statCalloc(ALLOC_INDEXES, 2 * index->size, sizeof(unsigned));
+    table->minMaxIndex = index;
+    if (!index->values || !index->minPos || !index->maxPos) {
+        dropMinMaxIndex(table);
+        return NULL;
+    }
+
+    unsigned leaf = 0;
+    for (unsigned i=startRow; i <= endRow; i++) {
+        for (unsigned j=startCol; j <= endCol; j++) {
+            minMaxSetLeaf(index, leaf, cellToDouble(&table->cells[i-1][j-1]));
+            leaf++;
+        }
+    }
+    // fill all the inner nodes from the bottom
+    for (unsigned node=index->size - 1; node >= 1; node--) {
+        index->minPos[node] = minMaxBetter(index,
+            index->minPos[2*node], index->minPos[2*node + 1], false);
+        index->maxPos[node] = minMaxBetter(index,
+            index->maxPos[2*node], index->maxPos[2*node + 1], true);
+    }
+    return index;
 }
 
-// select multiple cells
-State selectRectangle(Table *table,
-    unsigned startRow, unsigned startCol,
-    unsigned endRow, unsigned endCol) {
+// finds the lowest or the highest number in the block using the index
+// returns false if the index can't be used
+// row and col are set to 0, if there are no numbers in the block
+bool minMaxIndexLookup(Table *table,
+    unsigned startRow, unsigned endRow, unsigned startCol, unsigned endCol,
+    bool max, unsigned *row, unsigned *col) {
+
+    MinMaxIndex *index = table->minMaxIndex;
+    bool sameBlock = (index != NULL)
+        && (index->startRow == startRow) && (index->endRow == endRow)
+        && (index->startCol == startCol) && (index->endCol == endCol);
+
+    if (!sameBlock) {
+        unsigned long cells = (unsigned long)(endRow - startRow + 1)
+            * (endCol - startCol + 1);
+        if (cells < MINMAX_INDEX_THRESHOLD)
+            return false;
+        index = buildMinMaxIndex(table, startRow, endRow, startCol, endCol);
+        if (index == NULL)
+            return false;
+    }
 
-    if ((startRow == 0) || (startCol == 0))
-        return ERR_BAD_SELECTION;
+    unsigned pos = max ? index->maxPos[1] : index->minPos[1];
+    if (pos == 0) {
+        *row = 0;
+        *col = 0;
+        return true;
+    }
+    unsigned width = endCol - startCol + 1;
+    *row = startRow + (pos - 1) / width;
+    *col = startCol + (pos - 1) % width;
+    return true;
+}
 
-    if ((startRow > endRow) && (endCol == 0))
-        return ERR_BAD_SELECTION;
+// ---------- TABLE HOOKS -----------
+// everything, that changes contents of the table,
+// has to call these, so that the indexes stay correct
 
-    if ((startRow > endRow) && (endRow == 0))
-        return ERR_BAD_SELECTION;
+// called right before the contents of the cell are changed
+void cellWillChange(Table *table, unsigned row, unsigned col) {
+    formulaCellWillChange(table, row, col);
 
-    table->sel.startRow = startRow;
-    table->sel.endRow = endRow;
-    table->sel.startCol = startCol;
-    table->sel.endCol = endCol;
+    HashMap *index = getFindIndex(table, col);
+    if (index == NULL)
+        return;
 
-    assureTableSize(table, endRow, endCol);
-    return SUCCESS;
+    FindKey key = {.table=table, .col=col, .key=table->cells[row-1][col-1].str};
+    HashSlot *slot = hashmapFind(index, hashString(key.key), findKeyEquals, &key);
+    // the next occurrence of this value is unknown, the whole index has to go
+    if (slot->value == row)
+        dropFindIndex(table, col);
 }
 
-State selectMinMax(Table *table, bool max) {
-    double extreme = max ? -INFINITY : INFINITY;
-    unsigned extremeRow = 0;
-    unsigned extremeCol = 0;
-    // go through every selected cell
-    for (unsigned i=selUpperBound(table); i <= selLowerBound(table); i++) {
-        for (unsigned j=selLeftBound(table); j <= selRightBound(table); j++) {
-            Cell *cellPtr = getCellPtr(table, i, j);
-            double value = cellToDouble(cellPtr);
-            if (isnan(value))
-                continue;
+// called right after the contents of the cell are changed
+void cellDidChange(Table *table, unsigned row, unsigned col) {
+    table->rowInfo[row-1].dirty = true;
+    formulaCellDidChange(table, row, col);
 
-            bool found = max ? (value > extreme) : (value < extreme);
+    MinMaxIndex *minMax = table->minMaxIndex;
+    if ((minMax != NULL)
+        && (row >= minMax->startRow) && (row <= minMax->endRow)
+        && (col >= minMax->startCol) && (col <= minMax->endCol)) {
 
-            if (found) {
-                extreme = value;
-                extremeRow = i;
-                extremeCol = j;
-            }
-        }
+        unsigned width = minMax->endCol - minMax->startCol + 1;
+        unsigned leaf = (row - minMax->startRow) * width + col - minMax->startCol;
+        minMaxSetLeaf(minMax, leaf, cellToDouble(&table->cells[row-1][col-1]));
+        minMaxUpdatePath(minMax, leaf);
     }
-    // if an extreme is found, set the selection on it
-    if (extremeRow != 0)
-        selectCell(table, extremeRow, extremeCol);
-    // otherwise leave the selection as is
-    return SUCCESS;
+
+    HashMap *index = getFindIndex(table, col);
+    if (index == NULL)
+        return;
+
+    if (findIndexInsert(table, index, row, col) != SUCCESS)
+        dropFindIndex(table, col);
 }
 
-// ---------- INTERFACE FUNCTIONS -----------
-// these functions are interface between raw data and command functions
-// all addresses use user addressing for cells
+// called when rows change their order
+void rowsRearranged(Table *table) {
+    dropAllFindIndexes(table);
+    dropMinMaxIndex(table);
+    formulasMoved(table);
+}
 
-// make sure, that the coordinates up to these can be accessed
-State assureTableSize(Table *table, unsigned rows, unsigned cols) {
-    State s = SUCCESS;
-    // Add columns to table, until they at least match
-    while (cols > table->cols) {
-        s = addCol(table);
-        if (s != SUCCESS)
-            return s;
-    }
-    // Do the same for rows
-    while (rows > table->rows) {
-        s = addRow(table);
-        if (s != SUCCESS)
-            return s;
+// called when two whole columns are swapped
+void colsSwapped(Table *table, unsigned c1, unsigned c2) {
+    table->allRowsDirty = true;
+    dropMinMaxIndex(table);
+    formulasMoved(table);
+
+    HashMap *i1 = getFindIndex(table, c1);
+    HashMap *i2 = getFindIndex(table, c2);
+    if (i1 == NULL && i2 == NULL)
+        return;
+
+    // indexes only hold row numbers, so they can be swapped as well
+    unsigned maxCol = (c1 > c2) ? c1 : c2;
+    if (growFindIndexArray(table, maxCol) != SUCCESS) {
+        dropFindIndex(table, c1);
+        dropFindIndex(table, c2);
+        return;
     }
-    return SUCCESS;
+    table->findIndex[c1-1] = i2;
+    table->findIndex[c2-1] = i1;
 }
 
-// swap rows of table, user coordinates
-State swapRows(Table *table, unsigned r1, unsigned r2) {
-    // convert to real addressing
-    r1--;
-    r2--;
+// called when columns are inserted or deleted in front of other columns
+void colsShifted(Table *table) {
+    table->allRowsDirty = true;
+    dropAllFindIndexes(table);
+    dropMinMaxIndex(table);
+    formulasMoved(table);
+}
 
-    // swap around the pointers
-    Cell *tmp;
-    tmp = table->cells[r2];
-    table->cells[r2] = table->cells[r1];
-    table->cells[r1] = tmp;
-    return SUCCESS;
+// ---------- SIMPLE TABLE FUNCTIONS -----------
+
+// constructs a new empty table
+void table_ctor(Table *table) {
+    table->rows = 0;
+    table->cols = 0;
+    table->cells = NULL;
+    table->rowInfo = NULL;
+    table->rowCap = 0;
+    table->deadCells = 0;
+    table->strings = NULL;
+    table->stringsLen = 0;
+    table->packedRows = NULL;
+    table->packedRowsLen = 0;
+    table->allRowsDirty = false;
+    table->source.data = NULL;
+    table->source.len = 0;
+    table->source.mapLen = 0;
+    table->source.fd = -1;
+    table->source.reading = false;
+    table->delimiters = NULL;
+    table->snapshot = NULL;
+    table->snapshotLen = 0;
+    selection_init(&table->sel);
+    table->findIndex = NULL;
+    table->findIndexLen = 0;
+    table->minMaxIndex = NULL;
+    table->formulas = NULL;
 }
 
-// moves row while shifting the others
-State moveRow(Table *table, unsigned start, unsigned end) {
-    // convert to real addressing
-    start--;
-    end--;
+// checks if the row is in the block packed by compactTable
+bool isPackedRow(Table *table, Cell *cells) {
+    return (table->packedRows != NULL) && (cells >= table->packedRows)
+        && (cells < table->packedRows + table->packedRowsLen);
+}
 
-    unsigned i = start;
+// frees the cells of a row, a packed row is freed together with its block
+void freeRow(Table *table, Cell *cells) {
+    if (!isPackedRow(table, cells))
+        statFree(ALLOC_ROWS, cells);
+}
 
-    int direction;
-    if (i < end)
-        direction = 1;
-    else
-        direction = -1;
+// reallocates the cells of a row for cols columns, NULL if there is no memory
+// the row must have at least table->cols cells
+Cell *resizeRow(Table *table, Cell *cells, unsigned cols) {
+    if (!isPackedRow(table, cells))
+        return statRealloc(ALLOC_ROWS, cells, cols * sizeof(Cell));
+
+    // a packed row can't grow in its block, it gets its own memory
+    Cell *p = statMalloc(ALLOC_ROWS, cols * sizeof(Cell));
+    if (p != NULL)
+        memcpy(p, cells, ((cols < table->cols) ? cols : table->cols) * sizeof(Cell));
+    return p;
+}
 
-    Cell *tmp = table->cells[start];
+// deallocates all the pointers in the table structure
+void table_dtor(Table *table) {
+    for (unsigned i=0; i < table->rows; i++) {
+        // rows, that were never read, have no cells
+        for (unsigned j=0; j < table->cols && table->cells[i] != NULL; j++) {
+            cell_dtor(&table->cells[i][j]);
+        }
+        freeRow(table, table->cells[i]);
+    }
 
-    while (i != end) {
-        table->cells[i] = table->cells[i + direction];
-        i += direction;
+    statFree(ALLOC_ROWS, table->cells);
+    table->cells = NULL;
+    statFree(ALLOC_ROWS, table->rowInfo);
+    table->rowInfo = NULL;
+    table->rowCap = 0;
+    table->deadCells = 0;
+    // no cell borrows the packed strings anymore
+    statFree(ALLOC_CELLS, table->strings);
+    table->strings = NULL;
+    table->stringsLen = 0;
+    statFree(ALLOC_ROWS, table->packedRows);
+    table->packedRows = NULL;
+    table->packedRowsLen = 0;
+    closeSource(&table->source);
+    // cells don't point into the snapshot anymore
+    if (table->snapshot != NULL)
+        munmap(table->snapshot, table->snapshotLen);
+    table->snapshot = NULL;
+    table->snapshotLen = 0;
+
+    for (unsigned i=0; i < table->findIndexLen; i++)
+        dropFindIndex(table, i + 1);
+    statFree(ALLOC_INDEXES, table->findIndex);
+    table->findIndex = NULL;
+    table->findIndexLen = 0;
+    dropMinMaxIndex(table);
+    dropFormulas(table);
+
+    table->rows = 0;
+    table->cols = 0;
+}
+
+// reallocates the row pointers and row informations for cap rows
+State setRowCap(Table *table, unsigned cap) {
+    if (cap == 0) {
+        statFree(ALLOC_ROWS, table->cells);
+        statFree(ALLOC_ROWS, table->rowInfo);
+        table->cells = NULL;
+        table->rowInfo = NULL;
+        table->rowCap = 0;
+        return SUCCESS;
     }
 
-    table->cells[end] = tmp;
+    Cell **p = statRealloc(ALLOC_ROWS, table->cells, cap * sizeof(Cell *));
+    if (p == NULL)
+        return ERR_MEMORY;
+    table->cells = p;
+
+    RowInfo *info = statRealloc(ALLOC_ROWS, table->rowInfo, cap * sizeof(RowInfo));
+    if (info == NULL)
+        return ERR_MEMORY;
+    table->rowInfo = info;
+    table->rowCap = cap;
     return SUCCESS;
 }
 
-// swap rows of table, user coordinates
-State swapCols(Table *table, unsigned c1, unsigned c2) {
-    // convert to real addressing
-    c1--;
-    c2--;
-    // for each line of the table
-    for (unsigned i=0; i<table->rows; i++) {
-        swapCell(&table->cells[i][c1], &table->cells[i][c2]);
+// makes space for one more row, the capacity grows twice, so adding rows is linear
+State reserveRow(Table *table) {
+    if (table->rows < table->rowCap)
+        return SUCCESS;
+    unsigned cap = (table->rowCap == 0) ? 16 : table->rowCap;
+    cap = (cap > UINT_MAX / 2) ? UINT_MAX : 2 * cap;
+    return setRowCap(table, cap);
+}
+
+// adds an empty row to the end of the table
+State addRow(Table *table) {
+    // make space for one more row pointer in the array
+    State s = reserveRow(table);
+    if (s != SUCCESS)
+        return s;
+    // the row is not in the input
+    table->rowInfo[table->rows] = (RowInfo){.dirty=true};
+
+    // allocate new cell array for the new row
+    table->cells[table->rows] = statMalloc(ALLOC_ROWS, table->cols * sizeof(Cell));
+    if (table->cells[table->rows] == NULL)
+        return ERR_MEMORY;
+
+    // initialize all the cells in the new row
+    for (unsigned i=0; i < table->cols; i++) {
+        cell_ctor(&table->cells[table->rows][i]);
     }
+    table->rows++;
+    statAdd(&stats.cellsMaterialized, table->cols);
+    statMax(&stats.peakRows, table->rows);
+
+    for (unsigned i=1; i <= table->cols; i++)
+        cellDidChange(table, table->rows, i);
     return SUCCESS;
 }
 
-// moves a column while shifting the others
-State moveCol(Table *table, unsigned start, unsigned end) {
-    unsigned i = start;
+// adds a row, that is read from the source only when it is touched
+State addLazyRow(Table *table, RowInfo *info) {
+    State s = assureTableSize(table, table->rows, info->cells);
+    if (s != SUCCESS)
+        return s;
 
-    int direction;
-    if (i < end)
-        direction = 1;
-    else
-        direction = -1;
+    s = reserveRow(table);
+    if (s != SUCCESS)
+        return s;
 
-    while (i != end) {
-        swapCols(table, i, i + direction);
-        i += direction;
-    }
+    table->cells[table->rows] = NULL;
+    table->rowInfo[table->rows] = *info;
+    table->rows++;
+    statMax(&stats.peakRows, table->rows);
     return SUCCESS;
 }
 
-State sumCountSelected(Table *table, double *sum, unsigned *count) {
-    *sum = 0;
-    *count = 0;
-    // go through every selected cell
-    for (unsigned i=selUpperBound(table); i <= selLowerBound(table); i++) {
-        for (unsigned j=selLeftBound(table); j <= selRightBound(table); j++) {
-            Cell *cellPtr = getCellPtr(table, i, j);
-            double value = cellToDouble(cellPtr);
-            if (isnan(value))
-                continue;
+// reads the cells of the row from the source, if it wasn't read yet
+State materializeRow(Table *table, unsigned row) {
+    if (table->cells[row-1] != NULL)
+        return SUCCESS;
 
-            *sum += value;
-            (*count)++;
+    Cell *cells = statMalloc(ALLOC_ROWS, table->cols * sizeof(Cell));
+    if (cells == NULL)
+        return ERR_MEMORY;
+    for (unsigned j=0; j < table->cols; j++)
+        cell_ctor(&cells[j]);
+    table->cells[row-1] = cells;
+    statAdd(&stats.cellsMaterialized, table->cols);
+
+    // the row was checked, when the table was loaded
+    RowInfo *info = &table->rowInfo[row-1];
+    char *data = &table->source.data[info->offset];
+    size_t i = 0;
+    for (unsigned col=0; i < info->length; col++) {
+        char cellBuffer[MAX_CELL_LENGTH];
+        i += parseString(cellBuffer, &data[i], table->delimiters) + 1;
+        // empty cells stay as they are
+        if (cellBuffer[0] == '\0')
+            continue;
+        // the column was deleted, the row is not the same as in the source
+        if (col >= table->cols) {
+            info->dirty = true;
+            continue;
         }
+        State s = writeCell(&cells[col], cellBuffer);
+        if (s != SUCCESS)
+            return s;
     }
     return SUCCESS;
 }
 
-State setSelectedCells(Table *table, char *str) {
-    // go through every selected cell
-    for (unsigned i=selUpperBound(table); i <= selLowerBound(table); i++) {
-        for (unsigned j=selLeftBound(table); j <= selRightBound(table); j++) {
-            Cell *cellPtr = getCellPtr(table, i, j);
-            State s = writeCell(cellPtr, str);
-            if (s != SUCCESS)
-                return s;
-        }
+// reads all the rows from first to last, user coordinates
+State materializeRows(Table *table, unsigned first, unsigned last) {
+    for (unsigned row=first; row <= last && row <= table->rows; row++) {
+        State s = materializeRow(table, row);
+        if (s != SUCCESS)
+            return s;
     }
     return SUCCESS;
 }
 
-// ---------- COMMAND FUNCTIONS -----------
-// the functions, that execute the actual commands
-// they all have the same interface (patrameter is Context, return is State)
-// all the functions also have _cmd just to signify this
-
-// prints context variables into stderr
-State dump_cmd(Context ctx) {
-    // if argument is not empty
-    if (ctx.argStr[0] != '\0')
-        return ERR_BAD_SYNTAX;
-
-    fprintf(stderr, "Context dump:\nVariables:\n");
+// checks if the cell is empty, without reading its row into the table
+bool isCellEmpty(Table *table, unsigned row, unsigned col) {
+    if (table->cells[row-1] != NULL)
+        return table->cells[row-1][col-1].str[0] == '\0';
 
-    for(int i=0; i<=9; i++)
-        fprintf(stderr, "\t_%d = '%s'\n", i, ctx.vars->cellVars[i].str);
+    RowInfo *info = &table->rowInfo[row-1];
+    if (col > info->cells)
+        return true;
 
-    fprintf(stderr, "\t_ = rows %d to %d, cols %d to %d\n",
-        ctx.vars->selVar.startRow,
-        ctx.vars->selVar.endRow,
-        ctx.vars->selVar.startCol,
-        ctx.vars->selVar.endRow
-    );
+    char *data = &table->source.data[info->offset];
+    char cellBuffer[MAX_CELL_LENGTH];
+    size_t i = 0;
+    for (unsigned j=1; j <= col; j++)
+        i += parseString(cellBuffer, &data[i], table->delimiters) + 1;
+    return cellBuffer[0] == '\0';
+}
 
-    fprintf(stderr, "Active selection: rows %d to %d, cols %d to %d\n",
-        ctx.table->sel.startRow,
-        ctx.table->sel.endRow,
-        ctx.table->sel.startCol,
-        ctx.table->sel.endRow
-    );
+// deletes the rows from first to last, user coordinates
+// the rows after them are moved only once, however many rows are deleted
+void deleteRows(Table *table, unsigned first, unsigned last) {
+    for (unsigned i=first-1; i < last; i++) {
+        // rows, that were not read yet, have nothing to destruct
+        for (unsigned j=0; j < table->cols && table->cells[i] != NULL; j++)
+            cell_dtor(&table->cells[i][j]);
+        freeRow(table, table->cells[i]);
+    }
 
-    fprintf(stderr, "Execution pointer: %d\n", *(ctx.execPtr));
-    return SUCCESS;
+    unsigned count = last - first + 1;
+    memmove(&table->cells[first-1], &table->cells[last], (table->rows - last) * sizeof(Cell *));
+    memmove(&table->rowInfo[first-1], &table->rowInfo[last], (table->rows - last) * sizeof(RowInfo));
+    table->rows -= count;
+    table->deadCells += (unsigned long long)count * table->cols;
+    rowsRearranged(table);
 }
 
-// prints the table into stderr
-State print_cmd(Context ctx) {
-    // if argument is not empty
-    if (ctx.argStr[0] != '\0')
-        return ERR_BAD_SYNTAX;
-
-    printTable(ctx.table, stderr);
+// adds a column to the end of the table
+State addCol(Table *table) {
+    for (unsigned i=0; i < table->rows; i++) {
+        // rows, that were not read yet, get the new cells when they are read
+        if (table->cells[i] == NULL)
+            continue;
+        table->cells[i] = resizeRow(table, table->cells[i], table->cols + 1);
+        cell_ctor(&table->cells[i][table->cols]);
+    }
+    table->cols++;
+    statAdd(&stats.cellsMaterialized, table->rows);
+    statMax(&stats.peakCols, table->cols);
     return SUCCESS;
 }
 
-// selects the lowest nuber from selected cells
-State selectMin_cmd(Context ctx) {
-    return selectMinMax(ctx.table, false);
-}
-
-// selects the highest nuber from selected cells
-State selectMax_cmd(Context ctx) {
-    return selectMinMax(ctx.table, true);
+// deletes the last column of the table
+void deleteCol(Table *table) {
+    dropFindIndex(table, table->cols);
+    dropMinMaxIndex(table);
+    formulasMoved(table);
+    for (unsigned i=0; i < table->rows; i++) {
+        // a row, that was not read yet, drops the cell when it is read
+        // but if there is something in it, the row must be printed differently
+        if (table->cells[i] == NULL && !isCellEmpty(table, i + 1, table->cols))
+            materializeRow(table, i + 1);
+        if (table->cells[i] == NULL)
+            continue;
+        // the column might come back later, but without the contents
+        if (table->cells[i][table->cols - 1].str[0] != '\0')
+            table->rowInfo[i].dirty = true;
+        cell_dtor(&table->cells[i][table->cols - 1]);
+        table->deadCells++;
+    }
+    table->cols--;
 }
 
-// Command to select cells from coordinates
-State selectCoords_cmd(Context ctx) {
-    if (ctx.argStr[0] != '[')
-        return ERR_BAD_SYNTAX;
-
-    const unsigned MAX_NUM = 4;
-    unsigned numValues = 0;
-    unsigned values[MAX_NUM];
+// deletes the columns from first to last, user coordinates
+// every row is moved only once, however many columns are deleted
+State deleteCols(Table *table, unsigned first, unsigned last) {
+    // the columns at the end don't need the rows, that were not read yet
+    if (last == table->cols) {
+        for (unsigned j=first; j <= last; j++)
+            deleteCol(table);
+        return SUCCESS;
+    }
 
-    // shift for '[' at the beginning
-    unsigned strIndex = 1;
-    while (numValues < MAX_NUM) {
-        if (ctx.argStr[strIndex] == '_') {
-            values[numValues] = 0;
-            strIndex += 1;
-        } else {
-            char *endPtr;
-            values[numValues] = (unsigned)strtol(&ctx.argStr[strIndex], &endPtr, 10);
-            int shift = endPtr - &ctx.argStr[strIndex];
+    State s = materializeRows(table, 1, table->rows);
+    if (s != SUCCESS)
+        return s;
 
-            if (shift == 0)
-                return ERR_BAD_SYNTAX;
+    unsigned count = last - first + 1;
+    for (unsigned i=0; i < table->rows; i++) {
+        Cell *cells = table->cells[i];
+        for (unsigned j=first-1; j < last; j++)
+            cell_dtor(&cells[j]);
+        memmove(&cells[first-1], &cells[last], (table->cols - last) * sizeof(Cell));
+    }
+    table->cols -= count;
+    table->deadCells += (unsigned long long)count * table->rows;
+    colsShifted(table);
+    return SUCCESS;
+}
 
-            strIndex += shift;
+// marks the columns, where the row has something, the row is not read into the table
+// returns how many columns were newly marked
+unsigned markFilledCols(Table *table, unsigned row, bool *filled) {
+    unsigned marked = 0;
+    Cell *cells = table->cells[row-1];
+    if (cells != NULL) {
+        for (unsigned j=0; j < table->cols; j++) {
+            if (!filled[j] && cells[j].str[0] != '\0') {
+                filled[j] = true;
+                marked++;
+            }
         }
-        numValues++;
+        return marked;
+    }
 
-        if (ctx.argStr[strIndex] == ',') {
-            strIndex++;
-            continue;
+    RowInfo *info = &table->rowInfo[row-1];
+    char *data = &table->source.data[info->offset];
+    size_t i = 0;
+    for (unsigned j=0; j < info->cells && j < table->cols; j++) {
+        char cellBuffer[MAX_CELL_LENGTH];
+        i += parseString(cellBuffer, &data[i], table->delimiters) + 1;
+        if (!filled[j] && cellBuffer[0] != '\0') {
+            filled[j] = true;
+            marked++;
         }
-
-        if (ctx.argStr[strIndex] == ']')
-            break;
-
-        return ERR_BAD_SYNTAX;
     }
-
-    if (numValues == 2)
-        return selectCell(ctx.table, values[0], values[1]);
-
-    if (numValues == 4)
-        return selectRectangle(ctx.table, values[0], values[1], values[2], values[3]);
-
-    return ERR_BAD_SYNTAX;
+    return marked;
 }
 
-// applies selection variable to the table
-State selectStore_cmd(Context ctx) {
-    ctx.vars->selVar = ctx.table->sel;
-    return SUCCESS;
-}
-
-// applies selection variable to the table
-State selectLoad_cmd(Context ctx) {
-    ctx.table->sel = ctx.vars->selVar;
-    return SUCCESS;
-}
+// counts columns, that stay after the empty ones are deleted from the right
+State usedCols(Table *table, unsigned *cols) {
+    bool *filled = statCalloc(ALLOC_INDEXES, table->cols + 1, sizeof(bool));
+    if (filled == NULL)
+        return ERR_MEMORY;
 
-// select the first cell, where str argument matches
-State selectFind_cmd(Context ctx) {
-    // copy original string
-    char searchStr[strlen(ctx.argStr) + 1];
-    strcpy(searchStr, ctx.argStr);
-    // remove the ] at the end
-    searchStr[strlen(ctx.argStr)-1] = '\0';
+    // one pass over the rows, it stops as soon as every column has something
+    unsigned unknown = table->cols;
+    for (unsigned i=1; i <= table->rows && unknown > 0; i++)
+        unknown -= markFilledCols(table, i, filled);
 
-    // go through every selected cell
-    for (unsigned i=selUpperBound(ctx.table); i <= selLowerBound(ctx.table); i++) {
-        for (unsigned j=selLeftBound(ctx.table); j <= selRightBound(ctx.table); j++) {
-            Cell *cellPtr = getCellPtr(ctx.table, i, j);
-            if (strcmp(cellPtr->str, searchStr) == 0) {
-                selectCell(ctx.table, i, j);
-                return SUCCESS;
-            }
-        }
+    // every empty column takes one column from the end
+    *cols = table->cols;
+    for (unsigned j=table->cols; j >= 1; j--) {
+        if (!filled[j-1])
+            (*cols)--;
     }
+    statFree(ALLOC_INDEXES, filled);
     return SUCCESS;
 }
 
-// Layout commands
-
-// appends a row after the lower bound of the selection
-State arow_cmd(Context ctx) {
-    // if argument is not empty
-    if (ctx.argStr[0] != '\0')
-        return ERR_BAD_SYNTAX;
-
-    State s;
-    s = addRow(ctx.table);
-
-    if (s == SUCCESS) {
-        // start on the last line
-        unsigned start = ctx.table->rows;
-        // and swap until you get to the lower bound of selection
-        unsigned end = selLowerBound(ctx.table) + 1;
-        // move the empty row up to the selection
-        s = moveRow(ctx.table, start, end);
-    }
+// deletes columns of the table from the right, that are empty
+State deleteExcessCols(Table *table) {
+    unsigned cols;
+    State s = usedCols(table, &cols);
+    while (s == SUCCESS && table->cols > cols)
+        deleteCol(table);
     return s;
 }
 
-// inserts a row right above the selected region
-State irow_cmd(Context ctx) {
-    if (ctx.argStr[0] != '\0')
-        return ERR_BAD_SYNTAX;
+// ---------- COMPACTION FUNCTIONS -----------
+// deleted rows and columns leave memory behind: long row arrays,
+// unused row pointers and holes between the strings of the cells, that stay
 
-    State s;
-    s = addRow(ctx.table);
+// the table is compacted only after at least this many cells were deleted
+#define COMPACT_MIN_CELLS 65536
 
-    if (s == SUCCESS) {
-        // start on the last line
-        unsigned start = ctx.table->rows;
-        // and swap until you get to the top of selection
-        unsigned end = selUpperBound(ctx.table);
-        // move the empty row up to the selection
-        s = moveRow(ctx.table, start, end);
-    }
-    return s;
+// checks if the string was packed by packStrings
+bool isPackedString(Table *table, char *str) {
+    return (table->strings != NULL)
+        && (str >= table->strings) && (str < table->strings + table->stringsLen);
 }
 
-// deletes selected rows
-State drow_cmd(Context ctx) {
-    if (ctx.argStr[0] != '\0')
-        return ERR_BAD_SYNTAX;
+// copies the strings of all the cells into one block, the cells borrow them from it
+// empty strings and strings of the snapshot stay where they are
+State packStrings(Table *table) {
+    size_t len = 0;
+    for (unsigned i=0; i < table->rows; i++) {
+        for (unsigned j=0; j < table->cols && table->cells[i] != NULL; j++) {
+            Cell *cell = &table->cells[i][j];
+            if (!cell->borrowed || isPackedString(table, cell->str))
+                len += strlen(cell->str) + 1;
+        }
+    }
 
-    State s;
-    // how many lines we need to delete
-    unsigned toDelete = selLowerBound(ctx.table) - selUpperBound(ctx.table) + 1;
+    char *strings = NULL;
+    if (len > 0) {
+        strings = statMalloc(ALLOC_CELLS, len);
+        if (strings == NULL)
+            return ERR_MEMORY;
+    }
 
-    for (unsigned i=0; i<toDelete; i++) {
-        // move the line to the last place in table
-        unsigned start = selUpperBound(ctx.table);
-        unsigned end = ctx.table->rows;
-        s = moveRow(ctx.table, start, end);
-        if (s != SUCCESS)
-            break;
-        // then delete it
-        deleteRow(ctx.table);
+    // the rows go one after another, so a row has its strings together
+    size_t pos = 0;
+    for (unsigned i=0; i < table->rows; i++) {
+        for (unsigned j=0; j < table->cols && table->cells[i] != NULL; j++) {
+            Cell *cell = &table->cells[i][j];
+            if (cell->borrowed && !isPackedString(table, cell->str))
+                continue;
+            size_t strLen = strlen(cell->str) + 1;
+            memcpy(&strings[pos], cell->str, strLen);
+            if (!cell->borrowed)
+                statFree(cell->category, cell->str);
+            cell->str = &strings[pos];
+            cell->borrowed = true;
+            pos += strLen;
+        }
     }
-    return s;
+
+    statFree(ALLOC_CELLS, table->strings);
+    table->strings = strings;
+    table->stringsLen = len;
+    return SUCCESS;
 }
 
-// appends an empty column after selected cells
-State acol_cmd(Context ctx) {
-    if (ctx.argStr[0] != '\0')
-        return ERR_BAD_SYNTAX;
+// gives the memory of deleted rows and columns back to the system
+State compactTable(Table *table) {
+    State s = packStrings(table);
+    if (s != SUCCESS)
+        return s;
 
-    State s;
-    s = addCol(ctx.table);
+    // the rows go into one block too, small rows allocated one by one
+    // would fill the holes after the strings and keep all the memory in use
+    size_t numRows = 0;
+    for (unsigned i=0; i < table->rows; i++)
+        numRows += (table->cells[i] != NULL);
+    size_t rowLen = (table->cols > 0) ? table->cols : 1;
+    Cell *packedRows = NULL;
+    if (numRows > 0) {
+        packedRows = statMalloc(ALLOC_ROWS, numRows * rowLen * sizeof(Cell));
+        if (packedRows == NULL)
+            return ERR_MEMORY;
+    }
 
-    if (s == SUCCESS) {
-        unsigned start = ctx.table->cols;
-        unsigned end = selRightBound(ctx.table) + 1;
-        s = moveCol(ctx.table, start, end);
+    Cell *next = packedRows;
+    for (unsigned i=0; i < table->rows; i++) {
+        if (table->cells[i] == NULL)
+            continue;
+        memcpy(next, table->cells[i], table->cols * sizeof(Cell));
+        freeRow(table, table->cells[i]);
+        table->cells[i] = next;
+        next += rowLen;
     }
-    return s;
+    statFree(ALLOC_ROWS, table->packedRows);
+    table->packedRows = packedRows;
+    table->packedRowsLen = numRows * rowLen;
+
+    s = setRowCap(table, table->rows);
+    if (s != SUCCESS)
+        return s;
+    table->deadCells = 0;
+    // free memory in the middle of the heap is not returned by free()
+    malloc_trim(0);
+    return SUCCESS;
 }
 
-// inserts an empty column left from the selected cells
-State icol_cmd(Context ctx) {
-    if (ctx.argStr[0] != '\0')
-        return ERR_BAD_SYNTAX;
+// compacts the table, if the deleted cells are more than the cells, that stay
+State maybeCompact(Table *table) {
+    unsigned long long cells = (unsigned long long)table->rows * table->cols;
+    if ((table->deadCells < COMPACT_MIN_CELLS) || (table->deadCells <= cells))
+        return SUCCESS;
+    return compactTable(table);
+}
 
-    State s;
-    s = addCol(ctx.table);
+// ---------- SELECTION FUNCTIONS -----------
+// functions don't have to access the data directly
+// program is more extensible this way
 
-    if (s == SUCCESS) {
-        unsigned start = ctx.table->cols;
-        unsigned end = selLeftBound(ctx.table);
-        s = moveCol(ctx.table, start, end);
+unsigned selUpperBound(Table *table) {
+    if (table->sel.startRow == 0) {
+        return 1;
     }
-    return s;
+    return table->sel.startRow;
 }
 
-// deletes selected columns
-State dcol_cmd(Context ctx) {
-    if (ctx.argStr[0] != '\0')
-        return ERR_BAD_SYNTAX;
-
-    State s;
-    // how many lines we need to delete
-    unsigned toDelete = selRightBound(ctx.table) - selLeftBound(ctx.table) + 1;
-
-    for (unsigned i=0; i<toDelete; i++) {
-        // move the line to the last place in table
-        unsigned start = selLeftBound(ctx.table);
-        unsigned end = ctx.table->cols;
-        s = moveCol(ctx.table, start, end);
-        if (s != SUCCESS)
-            break;
-        // then delete it
-        deleteCol(ctx.table);
+unsigned selLowerBound(Table *table) {
+    if (table->sel.endRow == 0) {
+        if (table->rows == 0)
+            return 1;
+        return table->rows;
     }
-    return s;
+    return table->sel.endRow;
 }
 
-State set_cmd(Context ctx) {
-    return setSelectedCells(ctx.table, ctx.argStr);
+unsigned selLeftBound(Table *table) {
+    if (table->sel.startCol == 0) {
+        return 1;
+    }
+    return table->sel.startCol;
 }
 
-State clear_cmd(Context ctx) {
-    if (ctx.argStr[0] != '\0')
-        return ERR_BAD_SYNTAX;
-    // go through every selected cell
-    for (unsigned i=selUpperBound(ctx.table); i <= selLowerBound(ctx.table); i++) {
-        for (unsigned j=selLeftBound(ctx.table); j <= selRightBound(ctx.table); j++) {
-            Cell *cellPtr = getCellPtr(ctx.table, i, j);
-            State s = writeCell(cellPtr, "");
-            if (s != SUCCESS)
-                return s;
-        }
+unsigned selRightBound(Table *table) {
+    if (table->sel.endCol == 0) {
+        if (table->cols == 0)
+            return 1;
+        return table->cols;
     }
-    return SUCCESS;
+    return table->sel.endCol;
 }
 
-// Data commands
+// checks if the selection goes through all the rows of the table
+// also makes sure, that all the selected cells exist
+bool selectsWholeColumns(Table *table) {
+    assureTableSize(table, selLowerBound(table), selRightBound(table));
+    return (selUpperBound(table) == 1) && (selLowerBound(table) == table->rows);
+}
 
-// swaps selected cell with the cell specified by argument
-State swap_cmd(Context ctx) {
-    unsigned row, col;
-    State s = parseCoords(ctx.argStr, &row, &col);
-    if (s != SUCCESS)
-        return s;
+// select one cell
+State selectCell(Table *table, unsigned row, unsigned col) {
+    table->sel.startRow = row;
+    table->sel.endRow = row;
+    table->sel.startCol = col;
+    table->sel.endCol = col;
+    assureTableSize(table, row, col);
+    return SUCCESS;
+}
 
-    Cell *c1 = getCellPtr(ctx.table, row, col);
-    Cell *c2 = selectedCell(ctx.table);
+// select multiple cells
+State selectRectangle(Table *table,
+    unsigned startRow, unsigned startCol,
+    unsigned endRow, unsigned endCol) {
 
-    if (c1 == NULL)
-        return ERR_BAD_SYNTAX;
+    if ((startRow == 0) || (startCol == 0))
+        return ERR_BAD_SELECTION;
 
-    if (c2 == NULL)
+    if ((startRow > endRow) && (endCol == 0))
         return ERR_BAD_SELECTION;
 
-    swapCell(c1, c2);
-    return SUCCESS;
-}
+    if ((startRow > endRow) && (endRow == 0))
+        return ERR_BAD_SELECTION;
 
-State sum_cmd(Context ctx) {
-    unsigned row, col;
-    State s = parseCoords(ctx.argStr, &row, &col);
-    if (s != SUCCESS)
-        return s;
-
-    double sum;
-    unsigned count;
-    sumCountSelected(ctx.table, &sum, &count);
-
-    char buffer[MAX_CELL_LENGTH];
-    sprintf(buffer, "%g", sum);
-
-    Cell *resultCell = getCellPtr(ctx.table, row, col);
-    writeCell(resultCell, buffer);
+    table->sel.startRow = startRow;
+    table->sel.endRow = endRow;
+    table->sel.startCol = startCol;
+    table->sel.endCol = endCol;
 
+    assureTableSize(table, endRow, endCol);
     return SUCCESS;
 }
 
-State avg_cmd(Context ctx) {
-    unsigned row, col;
-    State s = parseCoords(ctx.argStr, &row, &col);
-    if (s != SUCCESS)
-        return s;
-
-    double sum;
-    unsigned count;
-    sumCountSelected(ctx.table, &sum, &count);
-    char buffer[MAX_CELL_LENGTH];
-
-    sprintf(buffer, "%g", sum / count);
-    Cell *resultCell = getCellPtr(ctx.table, row, col);
-    writeCell(resultCell, buffer);
-    return SUCCESS;
+// walks through the selected cells, one row at a time
+// the bounds are resolved only once, the cells of a row are next to each other
+typedef struct {
+    Table *table;
+    unsigned startRow, endRow;
+    unsigned startCol, endCol;
+    // the current row, user addressing
+    unsigned row;
+    // selected cells of the current row, there are width of them
+    Cell *cells;
+    unsigned width;
+    // error, that stopped the walk
+    State state;
+} SelectionIterator;
+
+void iterator_init(SelectionIterator *it, Table *table) {
+    it->table = table;
+    it->startRow = selUpperBound(table);
+    it->endRow = selLowerBound(table);
+    it->startCol = selLeftBound(table);
+    it->endCol = selRightBound(table);
+    it->row = it->startRow - 1;
+    it->cells = NULL;
+    it->width = 0;
+    if (it->startCol <= it->endCol)
+        it->width = it->endCol - it->startCol + 1;
+    it->state = SUCCESS;
 }
 
-State count_cmd(Context ctx) {
-    unsigned row, col;
-    State s = parseCoords(ctx.argStr, &row, &col);
-    if (s != SUCCESS)
-        return s;
+// moves to the next selected row, returns false at the end or on an error
+// the table grows with the walk, the same way it does for single cells
+bool iteratorNext(SelectionIterator *it) {
+    if ((it->width == 0) || (it->row >= it->endRow))
+        return false;
+    it->row++;
+
+    it->state = assureTableSize(it->table, it->row, it->endCol);
+    if (it->state == SUCCESS)
+        it->state = materializeRow(it->table, it->row);
+    if (it->state != SUCCESS)
+        return false;
+
+    it->cells = &it->table->cells[it->row-1][it->startCol-1];
+    return true;
+}
 
-    unsigned count=0;
+State selectMinMax(Table *table, bool max) {
+    unsigned startRow = selUpperBound(table);
+    unsigned endRow = selLowerBound(table);
+    unsigned startCol = selLeftBound(table);
+    unsigned endCol = selRightBound(table);
+
+    // big blocks are searched through the index
+    if ((startRow <= endRow) && (startCol <= endCol)) {
+        assureTableSize(table, endRow, endCol);
+        unsigned row, col;
+        if (minMaxIndexLookup(table, startRow, endRow, startCol, endCol, max, &row, &col)) {
+            if (row != 0)
+                selectCell(table, row, col);
+            return SUCCESS;
+        }
+    }
 
+    double extreme = max ? -INFINITY : INFINITY;
+    unsigned extremeRow = 0;
+    unsigned extremeCol = 0;
     // go through every selected cell
-    for (unsigned i=selUpperBound(ctx.table); i <= selLowerBound(ctx.table); i++) {
-        for (unsigned j=selLeftBound(ctx.table); j <= selRightBound(ctx.table); j++) {
-            Cell *cellPtr = getCellPtr(ctx.table, i, j);
+    SelectionIterator it;
+    iterator_init(&it, table);
+    while (iteratorNext(&it)) {
+        for (unsigned k=0; k < it.width; k++) {
+            double value = cellToDouble(&it.cells[k]);
+            if (isnan(value))
+                continue;
 
-            if (strcmp(cellPtr->str, ""))
-                count++;
+            bool found = max ? (value > extreme) : (value < extreme);
+
+            if (found) {
+                extreme = value;
+                extremeRow = it.row;
+                extremeCol = it.startCol + k;
+            }
         }
     }
-    char buffer[MAX_CELL_LENGTH];
-    sprintf(buffer, "%d", count);
-    Cell *resultCell = getCellPtr(ctx.table, row, col);
-    writeCell(resultCell, buffer);
+    if (it.state != SUCCESS)
+        return it.state;
+    // if an extreme is found, set the selection on it
+    if (extremeRow != 0)
+        selectCell(table, extremeRow, extremeCol);
+    // otherwise leave the selection as is
     return SUCCESS;
 }
 
-State len_cmd(Context ctx) {
-    unsigned row, col;
-    State s = parseCoords(ctx.argStr, &row, &col);
-    if (s != SUCCESS)
-        return s;
-
-    Cell *measuredCell = selectedCell(ctx.table);
-    size_t len = strlen(measuredCell->str);
-
-    char buffer[MAX_CELL_LENGTH];
-    sprintf(buffer, "%lu", len);
+// ---------- INTERFACE FUNCTIONS -----------
+// these functions are interface between raw data and command functions
+// all addresses use user addressing for cells
 
-    Cell *resultCell = getCellPtr(ctx.table, row, col);
-    writeCell(resultCell, buffer);
+// make sure, that the coordinates up to these can be accessed
+State assureTableSize(Table *table, unsigned rows, unsigned cols) {
+    State s = SUCCESS;
+    // Add columns to table, until they at least match
+    while (cols > table->cols) {
+        s = addCol(table);
+        if (s != SUCCESS)
+            return s;
+    }
+    // Do the same for rows
+    while (rows > table->rows) {
+        s = addRow(table);
+        if (s != SUCCESS)
+            return s;
+    }
     return SUCCESS;
 }
 
-// Variable commands
+// writes a string into the cell, user coordinates
+State writeTableCell(Table *table, unsigned row, unsigned col, char *src) {
+    Cell *cell = getCellPtr(table, row, col);
+    if (cell == NULL)
+        return ERR_BAD_SELECTION;
 
-State def_cmd(Context ctx) {
-    int n = ctx.argStr[0] - '0';
-    if ((ctx.argStr[1] != '\0') || (n < 0) || (n > 9))
-        return ERR_BAD_SYNTAX;
+    cellWillChange(table, row, col);
+    State s = writeCell(cell, src);
+    cellDidChange(table, row, col);
+    return s;
+}
 
-    Cell *src = selectedCell(ctx.table);
-    if (src == NULL)
+// writes a number into the cell, user coordinates
+State writeTableCellDouble(Table *table, unsigned row, unsigned col, double value) {
+    Cell *cell = getCellPtr(table, row, col);
+    if (cell == NULL)
         return ERR_BAD_SELECTION;
-    deepCopyCell(&ctx.vars->cellVars[n], src);
 
-    return SUCCESS;
+    cellWillChange(table, row, col);
+    State s = writeCellDouble(cell, value);
+    cellDidChange(table, row, col);
+    return s;
 }
 
-State use_cmd(Context ctx) {
-    int n = ctx.argStr[0] - '0';
-    if ((ctx.argStr[1] != '\0') || (n < 0) || (n > 9))
-        return ERR_BAD_SYNTAX;
+// writes an unsigned number into the cell, user coordinates
+State writeTableCellUnsigned(Table *table, unsigned row, unsigned col, unsigned long value) {
+    Cell *cell = getCellPtr(table, row, col);
+    if (cell == NULL)
+        return ERR_BAD_SELECTION;
 
-    return setSelectedCells(ctx.table, ctx.vars->cellVars[n].str);
+    cellWillChange(table, row, col);
+    State s = writeCellUnsigned(cell, value);
+    cellDidChange(table, row, col);
+    return s;
 }
 
-State inc_cmd(Context ctx) {
-    int n = ctx.argStr[0] - '0';
-    if ((ctx.argStr[1] != '\0') || (n < 0) || (n > 9))
-        return ERR_BAD_SYNTAX;
+// swaps contents of two cells, user coordinates
+State swapTableCells(Table *table, unsigned r1, unsigned c1, unsigned r2, unsigned c2) {
+    Cell *cell1 = getCellPtr(table, r1, c1);
+    Cell *cell2 = getCellPtr(table, r2, c2);
+    if (cell1 == NULL || cell2 == NULL)
+        return ERR_BAD_SELECTION;
 
-    // variable to increment
-    Cell *cellPtr = &ctx.vars->cellVars[n];
+    cellWillChange(table, r1, c1);
+    cellWillChange(table, r2, c2);
+    swapCell(cell1, cell2);
+    cellDidChange(table, r1, c1);
+    cellDidChange(table, r2, c2);
+    return SUCCESS;
+}
 
-    double value = cellToDouble(cellPtr);
+// copies or moves the block of cells to the corner dstRow, dstCol, user coordinates
+// moved cells take their strings with them, the cells left behind are empty
+// copies share the strings, that are not owned by the cell, the others are copied
+// the block and the destination can overlap
+State copyBlock(Table *table, unsigned startRow, unsigned startCol,
+    unsigned endRow, unsigned endCol, unsigned dstRow, unsigned dstCol, bool move) {
 
-    if (isnan(value)) {
-        writeCell(cellPtr, "1");
+    if ((dstRow == startRow) && (dstCol == startCol))
         return SUCCESS;
-    }
 
-    char buffer[MAX_CELL_LENGTH];
-    sprintf(buffer, "%g", value + 1);
+    unsigned lastRow = dstRow + (endRow - startRow);
+    unsigned lastCol = dstCol + (endCol - startCol);
+    State s = assureTableSize(table, (lastRow > endRow) ? lastRow : endRow,
+        (lastCol > endCol) ? lastCol : endCol);
+    if (s != SUCCESS)
+        return s;
+
+    // like memmove, every cell is read before anything is written over it
+    bool down = dstRow > startRow;
+    bool right = dstCol > startCol;
+    unsigned height = endRow - startRow + 1;
+    unsigned width = endCol - startCol + 1;
+    for (unsigned di=0; di < height; di++) {
+        unsigned i = down ? endRow - di : startRow + di;
+        unsigned row = dstRow + (i - startRow);
+        s = materializeRow(table, i);
+        if (s == SUCCESS)
+            s = materializeRow(table, row);
+        if (s != SUCCESS)
+            return s;
 
-    writeCell(cellPtr, buffer);
+        for (unsigned dj=0; dj < width; dj++) {
+            unsigned j = right ? endCol - dj : startCol + dj;
+            unsigned col = dstCol + (j - startCol);
+            Cell *src = &table->cells[i-1][j-1];
+            Cell *dst = &table->cells[row-1][col-1];
+
+            cellWillChange(table, row, col);
+            if (move) {
+                cellWillChange(table, i, j);
+                cell_dtor(dst);
+                *dst = *src;
+                cell_ctor(src);
+                cellDidChange(table, i, j);
+            } else if (src->borrowed) {
+                cell_dtor(dst);
+                dst->str = src->str;
+                dst->borrowed = true;
+            } else {
+                s = writeCell(dst, src->str);
+            }
+            cellDidChange(table, row, col);
+            if (s != SUCCESS)
+                return s;
+        }
+    }
     return SUCCESS;
 }
 
-// Control commands
+// cells are moved in square blocks, so that the rows being read
+// and the rows being written all stay in the cache
+#define TRANSPOSE_BLOCK 64
 
-State goto_cmd(Context ctx) {
-    char *endPtr;
-    int steps = strtol(ctx.argStr, &endPtr, 10);
+// transposes the whole table, rows become columns
+State transposeTable(Table *table) {
+    unsigned rows = table->rows;
+    unsigned cols = table->cols;
+    if ((rows == 0) || (cols == 0))
+        return SUCCESS;
+    State s = materializeRows(table, 1, rows);
+    if (s != SUCCESS)
+        return s;
 
-    if (*endPtr != '\0')
-        return ERR_BAD_SYNTAX;
+    Cell **cells = statCalloc(ALLOC_ROWS, cols, sizeof(Cell *));
+    RowInfo *rowInfo = statMalloc(ALLOC_ROWS, cols * sizeof(RowInfo));
+    for (unsigned j=0; (cells != NULL) && (rowInfo != NULL) && (j < cols); j++) {
+        cells[j] = statMalloc(ALLOC_ROWS, rows * sizeof(Cell));
+        if (cells[j] == NULL)
+            break;
+        rowInfo[j] = (RowInfo){.dirty=true};
+    }
+    if ((cells == NULL) || (rowInfo == NULL) || (cells[cols-1] == NULL)) {
+        for (unsigned j=0; (cells != NULL) && (j < cols); j++)
+            statFree(ALLOC_ROWS, cells[j]);
+        statFree(ALLOC_ROWS, cells);
+        statFree(ALLOC_ROWS, rowInfo);
+        return ERR_MEMORY;
+    }
 
-    // goto +1 should have no effect
-    *ctx.execPtr += steps - 1;
+    for (unsigned bi=0; bi < rows; bi += TRANSPOSE_BLOCK) {
+        unsigned endI = (bi + TRANSPOSE_BLOCK < rows) ? bi + TRANSPOSE_BLOCK : rows;
+        for (unsigned bj=0; bj < cols; bj += TRANSPOSE_BLOCK) {
+            unsigned endJ = (bj + TRANSPOSE_BLOCK < cols) ? bj + TRANSPOSE_BLOCK : cols;
+            for (unsigned i=bi; i < endI; i++) {
+                for (unsigned j=bj; j < endJ; j++)
+                    cells[j][i] = table->cells[i][j];
+            }
+        }
+    }
+
+    for (unsigned i=0; i < rows; i++)
+        freeRow(table, table->cells[i]);
+    statFree(ALLOC_ROWS, table->cells);
+    statFree(ALLOC_ROWS, table->rowInfo);
+    statFree(ALLOC_ROWS, table->packedRows);
+    table->packedRows = NULL;
+    table->packedRowsLen = 0;
+    table->cells = cells;
+    table->rowInfo = rowInfo;
+    table->rowCap = cols;
+    table->rows = cols;
+    table->cols = rows;
+    statMax(&stats.peakRows, table->rows);
+    statMax(&stats.peakCols, table->cols);
+
+    rowsRearranged(table);
+    table->allRowsDirty = true;
     return SUCCESS;
 }
 
-State iszero_cmd(Context ctx) {
-    int n = ctx.argStr[0] - '0';
-    if ((ctx.argStr[1] != ' ') || (n < 0) || (n > 9))
-        return ERR_BAD_SYNTAX;
+// calls the hooks for both blocks of transposeBlock, every cell once
+void transposeHooks(Table *table, unsigned startRow, unsigned startCol,
+    unsigned height, unsigned width, bool did) {
 
-    // points at varible that needs to be checked
-    Cell *cellPtr = &ctx.vars->cellVars[n];
+    void (*hook)(Table *, unsigned, unsigned) = did ? cellDidChange : cellWillChange;
+    for (unsigned i=0; i < height; i++) {
+        for (unsigned j=0; j < width; j++)
+            hook(table, startRow + i, startCol + j);
+    }
+    // the transposed block, without the cells of the first one
+    for (unsigned i=0; i < width; i++) {
+        for (unsigned j=0; j < height; j++) {
+            if ((i >= height) || (j >= width))
+                hook(table, startRow + i, startCol + j);
+        }
+    }
+}
 
-    char *endPtr;
-    long steps = strtol(&ctx.argStr[2], &endPtr, 10);
-    if (*endPtr != '\0')
-        return ERR_BAD_SYNTAX;
+// transposes the block of cells, its upper left corner stays where it is
+// the cells of the block, that are not covered by the result, are empty
+// the result must not cover any filled cell outside the block
+State transposeBlock(Table *table, unsigned startRow, unsigned startCol,
+    unsigned endRow, unsigned endCol) {
 
-    if (strcmp(cellPtr->str, "0") == 0)
-        *ctx.execPtr += steps - 1;
+    unsigned height = endRow - startRow + 1;
+    unsigned width = endCol - startCol + 1;
+    for (unsigned i=0; i < width; i++) {
+        for (unsigned j=0; j < height; j++) {
+            unsigned row = startRow + i, col = startCol + j;
+            if ((i >= height || j >= width) && row <= table->rows && col <= table->cols
+                && !isCellEmpty(table, row, col))
+                return ERR_BAD_SELECTION;
+        }
+    }
+    unsigned lastRow = startRow + ((height > width) ? height : width) - 1;
+    State s = assureTableSize(table, lastRow, startCol + ((height > width) ? height : width) - 1);
+    if (s == SUCCESS)
+        s = materializeRows(table, startRow, lastRow);
+    if (s != SUCCESS)
+        return s;
 
-    return SUCCESS;
-}
+    Cell *tmp = statMalloc(ALLOC_ROWS, (size_t)height * width * sizeof(Cell));
+    if (tmp == NULL)
+        return ERR_MEMORY;
 
-State sub_cmd(Context ctx) {
-    int m = ctx.argStr[0] - '0';
-    int n = ctx.argStr[3] - '0';
-    // not robust at all but whatever
-    if ((m < 0) || (m > 9) || (n < 0) || (n > 9))
-        return ERR_BAD_SYNTAX;
+    transposeHooks(table, startRow, startCol, height, width, false);
+    // the cells go out of the block in the order of the result
+    for (unsigned bi=0; bi < height; bi += TRANSPOSE_BLOCK) {
+        unsigned endI = (bi + TRANSPOSE_BLOCK < height) ? bi + TRANSPOSE_BLOCK : height;
+        for (unsigned bj=0; bj < width; bj += TRANSPOSE_BLOCK) {
+            unsigned endJ = (bj + TRANSPOSE_BLOCK < width) ? bj + TRANSPOSE_BLOCK : width;
+            for (unsigned i=bi; i < endI; i++) {
+                Cell *src = &table->cells[startRow - 1 + i][startCol - 1];
+                for (unsigned j=bj; j < endJ; j++) {
+                    tmp[(size_t)j * height + i] = src[j];
+                    cell_ctor(&src[j]);
+                }
+            }
+        }
+    }
+    // and come back row by row
+    for (unsigned i=0; i < width; i++) {
+        Cell *dst = &table->cells[startRow - 1 + i][startCol - 1];
+        for (unsigned j=0; j < height; j++) {
+            cell_dtor(&dst[j]);
+            dst[j] = tmp[(size_t)i * height + j];
+        }
+    }
+    transposeHooks(table, startRow, startCol, height, width, true);
 
-    Cell *cellPtr = &ctx.vars->cellVars[n];
-    char *endPtr;
-    double toSubtract = strtod(cellPtr->str, &endPtr);
-    if ((*endPtr != '\0') && (endPtr != cellPtr->str))
-        return ERR_GENERIC;
+    statFree(ALLOC_ROWS, tmp);
+    return SUCCESS;
+}
 
-    cellPtr = &ctx.vars->cellVars[m];
-    double value = strtod(cellPtr->str, &endPtr);
-    if ((*endPtr != '\0') && (endPtr != cellPtr->str))
-        return ERR_GENERIC;
+// swap rows of table, user coordinates
+State swapRows(Table *table, unsigned r1, unsigned r2) {
+    // convert to real addressing
+    r1--;
+    r2--;
 
-    value -= toSubtract;
+    // swap around the pointers
+    Cell *tmp;
+    tmp = table->cells[r2];
+    table->cells[r2] = table->cells[r1];
+    table->cells[r1] = tmp;
 
-    char buffer[MAX_CELL_LENGTH];
-    sprintf(buffer, "%g", value);
-    writeCell(cellPtr, buffer);
+    RowInfo tmpInfo = table->rowInfo[r2];
+    table->rowInfo[r2] = table->rowInfo[r1];
+    table->rowInfo[r1] = tmpInfo;
 
+    rowsRearranged(table);
     return SUCCESS;
 }
 
-// ---------- MORE COMPLEX FUNCTIONS -----------
-
-// Reads table from stdin and saves it into the table structure
-// The function also reads delimiters from arguments
-// Returns program state
-// Expects an empty table
-State readTable(Table *table, FILE *f, char *delimiters) {
-    // set the table's main delimiter
-    table->delim = delimiters[0];
-
-    char *fileBuffer = fileToBuffer(f);
-    if (fileBuffer == NULL)
-        return ERR_MEMORY;
+// moves row while shifting the others
+State moveRow(Table *table, unsigned start, unsigned end) {
+    // convert to real addressing
+    start--;
+    end--;
 
-    State s = SUCCESS;
-    // current row and column
-    unsigned row=0, col=0;
-    size_t i = 0;
+    unsigned i = start;
 
-    while (true) {
-        char cellBuffer[MAX_CELL_LENGTH];
-        size_t shift = parseString(cellBuffer, &fileBuffer[i], delimiters);
-        // +1 to skip the delimiter
-        i += shift + 1;
+    int direction;
+    if (i < end)
+        direction = 1;
+    else
+        direction = -1;
 
-        // if there is nothing left
-        if (fileBuffer[i-1] == '\0')
-            break;
+    Cell *tmp = table->cells[start];
+    RowInfo tmpInfo = table->rowInfo[start];
 
-        // write to table
-        s = assureTableSize(table, row+1, col+1);
-        if (s != SUCCESS)
-            return s;
+    while (i != end) {
+        table->cells[i] = table->cells[i + direction];
+        table->rowInfo[i] = table->rowInfo[i + direction];
+        i += direction;
+    }
 
-        s = writeCell(&table->cells[row][col], cellBuffer);
-        if (s != SUCCESS)
-            return s;
+    table->cells[end] = tmp;
+    table->rowInfo[end] = tmpInfo;
 
-        if (fileBuffer[i-1] == '\n') {
-            row++;
-            col = 0;
-            continue;
-        }
+    rowsRearranged(table);
+    return SUCCESS;
+}
 
-        if (strchr(delimiters, fileBuffer[i-1])) {
-            col++;
-            continue;
-        }
-        // if nothing matches, the scanned STR was bad
-        return ERR_BAD_INPUT;
+// swap rows of table, user coordinates
+State swapCols(Table *table, unsigned c1, unsigned c2) {
+    State s = materializeRows(table, 1, table->rows);
+    if (s != SUCCESS)
+        return s;
+    // convert to real addressing
+    c1--;
+    c2--;
+    // for each line of the table
+    for (unsigned i=0; i<table->rows; i++) {
+        swapCell(&table->cells[i][c1], &table->cells[i][c2]);
     }
-    free(fileBuffer);
+
+    colsSwapped(table, c1 + 1, c2 + 1);
     return SUCCESS;
 }
 
-// prints the table into a file
-void printTable(Table *table, FILE *f) {
+// inserts empty columns in front of the column at, user addressing
+// every row is moved only once, however many columns there are
+State insertCols(Table *table, unsigned at, unsigned count) {
+    State s = materializeRows(table, 1, table->rows);
+    if (s != SUCCESS)
+        return s;
+
+    unsigned cols = table->cols + count;
     for (unsigned i=0; i < table->rows; i++) {
-        for (unsigned j=0; j < table->cols; j++) {
-            printCell(table, &table->cells[i][j], f);
+        Cell *p = resizeRow(table, table->cells[i], cols);
+        if (p == NULL)
+            return ERR_MEMORY;
+        table->cells[i] = p;
+        memmove(&p[at - 1 + count], &p[at - 1], (table->cols - at + 1) * sizeof(Cell));
+        for (unsigned j=at - 1; j < at - 1 + count; j++)
+            cell_ctor(&p[j]);
+    }
+    // rows, that are added later, have the new width
+    table->cols = cols;
+    statAdd(&stats.cellsMaterialized, (unsigned long long)table->rows * count);
+    statMax(&stats.peakCols, table->cols);
 
-            if (j < table->cols - 1)
-                fputc(table->delim, f);
+    colsShifted(table);
+    return SUCCESS;
+}
+
+// moves a column while shifting the others
+State moveCol(Table *table, unsigned start, unsigned end) {
+    unsigned i = start;
+
+    int direction;
+    if (i < end)
+        direction = 1;
+    else
+        direction = -1;
+
+    while (i != end) {
+        swapCols(table, i, i + direction);
+        i += direction;
+    }
+    return SUCCESS;
+}
+
+State sumCountSelected(Table *table, double *sum, unsigned *count) {
+    *sum = 0;
+    *count = 0;
+    // go through every selected cell
+    SelectionIterator it;
+    iterator_init(&it, table);
+    while (iteratorNext(&it)) {
+        for (unsigned k=0; k < it.width; k++) {
+            double value = cellToDouble(&it.cells[k]);
+            if (isnan(value))
+                continue;
+
+            *sum += value;
+            (*count)++;
+        }
+    }
+    return it.state;
+}
+
+// adds to or multiplies every number in the selection
+// cells, that are not numbers, are left as they are
+State computeSelectedCells(Table *table, double operand, bool multiply) {
+    // go through every selected cell
+    SelectionIterator it;
+    iterator_init(&it, table);
+    while (iteratorNext(&it)) {
+        for (unsigned k=0; k < it.width; k++) {
+            double value;
+            if (!cellNumber(&it.cells[k], &value))
+                continue;
+
+            value = multiply ? value * operand : value + operand;
+            cellWillChange(table, it.row, it.startCol + k);
+            State s = writeCellDouble(&it.cells[k], value);
+            cellDidChange(table, it.row, it.startCol + k);
+            if (s != SUCCESS)
+                return s;
+        }
+    }
+    return it.state;
+}
+
+State setSelectedCells(Table *table, char *str) {
+    // go through every selected cell
+    SelectionIterator it;
+    iterator_init(&it, table);
+    while (iteratorNext(&it)) {
+        for (unsigned k=0; k < it.width; k++) {
+            cellWillChange(table, it.row, it.startCol + k);
+            State s = writeCell(&it.cells[k], str);
+            cellDidChange(table, it.row, it.startCol + k);
+            if (s != SUCCESS)
+                return s;
+        }
+    }
+    return it.state;
+}
+
+// ---------- SORT FUNCTIONS -----------
+// rows are sorted by a stable merge sort of their positions
+// keys are extracted beforehand, so that every cell is parsed only once
+
+// everything, that the comparison of two rows needs
+typedef struct {
+    // numeric keys, NAN if the cell is not a number
+    double *numKeys;
+    // string keys, they point into the table cells
+    char **strKeys;
+    bool descending;
+} SortKeys;
+
+// compares keys of two rows, returns the same as strcmp
+// non-numeric keys always end up after the numbers
+int compareSortKeys(SortKeys *keys, unsigned a, unsigned b) {
+    int result;
+    if (keys->numKeys) {
+        double x = keys->numKeys[a];
+        double y = keys->numKeys[b];
+        if (isnan(x) || isnan(y))
+            return isnan(x) - isnan(y);
+        result = (x > y) - (x < y);
+    } else {
+        result = strcmp(keys->strKeys[a], keys->strKeys[b]);
+    }
+    return keys->descending ? -result : result;
+}
+
+// merges two sorted neighbouring parts of src into dst
+// on equal keys the left part goes first, that keeps the sort stable
+void mergeRuns(SortKeys *keys, unsigned *dst, unsigned *src,
+    size_t start, size_t middle, size_t end) {
+
+    size_t i = start, j = middle, k = start;
+    while (i < middle && j < end) {
+        if (compareSortKeys(keys, src[j], src[i]) < 0)
+            dst[k++] = src[j++];
+        else
+            dst[k++] = src[i++];
+    }
+    while (i < middle)
+        dst[k++] = src[i++];
+    while (j < end)
+        dst[k++] = src[j++];
+}
+
+// sorts positions from start to end, tmp is a buffer of the same size
+// the result ends up in positions
+void mergeSort(SortKeys *keys, unsigned *positions, unsigned *tmp,
+    size_t start, size_t end) {
+
+    // bottom-up, the buffers switch places after every pass
+    unsigned *src = positions;
+    unsigned *dst = tmp;
+    for (size_t width=1; width < end - start; width *= 2) {
+        for (size_t i=start; i < end; i += 2 * width) {
+            size_t middle = (i + width < end) ? i + width : end;
+            size_t right = (i + 2*width < end) ? i + 2*width : end;
+            mergeRuns(keys, dst, src, i, middle, right);
+        }
+        unsigned *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != positions)
+        memcpy(&positions[start], &src[start], (end - start) * sizeof(unsigned));
+}
+
+// work of one thread of the parallel sort
+typedef struct {
+    SortKeys *keys;
+    unsigned *positions;
+    unsigned *tmp;
+    size_t start, middle, end;
+} SortJob;
+
+void *sortJobRun(void *arg) {
+    SortJob *job = arg;
+    // middle is not used for sorting, only for merging
+    if (job->middle == 0)
+        mergeSort(job->keys, job->positions, job->tmp, job->start, job->end);
+    else
+        mergeRuns(job->keys, job->tmp, job->positions,
+            job->start, job->middle, job->end);
+    return NULL;
+}
+
+// reads a positive number from the environment, fallback if it is not there
+// the tests use it to try the paths, that depend on the machine
+unsigned envUnsigned(const char *name, unsigned fallback) {
+    const char *value = getenv(name);
+    if (value == NULL)
+        return fallback;
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+    return (end == value || *end != '\0' || n == 0 || n > UINT_MAX) ? fallback : n;
+}
+
+// number of threads, that can run at the same time
+// SPS_THREADS pretends more of them, even on one processor
+unsigned availableThreads() {
+    unsigned threads = envUnsigned("SPS_THREADS", 0);
+    if (threads > 0)
+        return threads;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : n;
+}
+
+// sorts the positions on multiple threads
+// every thread sorts its own part, then the parts are merged in pairs
+void parallelMergeSort(SortKeys *keys, unsigned *positions, unsigned *tmp,
+    size_t len, unsigned threads) {
+
+    size_t bounds[threads + 1];
+    for (unsigned i=0; i <= threads; i++)
+        bounds[i] = len * i / threads;
+
+    pthread_t ids[threads];
+    SortJob jobs[threads];
+    bool started[threads];
+    for (unsigned i=0; i < threads; i++) {
+        jobs[i] = (SortJob){.keys=keys, .positions=positions, .tmp=tmp,
+            .start=bounds[i], .middle=0, .end=bounds[i+1]};
+        started[i] = pthread_create(&ids[i], NULL, sortJobRun, &jobs[i]) == 0;
+        // if the thread can't start, do the work here
+        if (!started[i])
+            sortJobRun(&jobs[i]);
+    }
+    for (unsigned i=0; i < threads; i++) {
+        if (started[i])
+            pthread_join(ids[i], NULL);
+    }
+
+    // merge sorted parts in pairs, until there is only one
+    unsigned parts = threads;
+    while (parts > 1) {
+        unsigned pairs = parts / 2;
+        for (unsigned i=0; i < pairs; i++) {
+            jobs[i] = (SortJob){.keys=keys, .positions=positions, .tmp=tmp,
+                .start=bounds[2*i], .middle=bounds[2*i + 1], .end=bounds[2*i + 2]};
+            started[i] = pthread_create(&ids[i], NULL, sortJobRun, &jobs[i]) == 0;
+            if (!started[i])
+                sortJobRun(&jobs[i]);
+        }
+        for (unsigned i=0; i < pairs; i++) {
+            if (started[i])
+                pthread_join(ids[i], NULL);
+        }
+        // the odd part at the end is left alone
+        if (parts % 2 == 1) {
+            size_t start = bounds[parts - 1];
+            memcpy(&tmp[start], &positions[start], (len - start) * sizeof(unsigned));
+        }
+        memcpy(positions, tmp, len * sizeof(unsigned));
+
+        for (unsigned i=0; i <= pairs; i++)
+            bounds[i] = bounds[2*i];
+        if (parts % 2 == 1)
+            bounds[++pairs] = len;
+        else
+            bounds[pairs] = len;
+        parts = pairs;
+    }
+}
+
+// sorts rows from startRow to endRow by the key column, user coordinates
+// only row pointers are moved, cells stay where they are
+State sortRows(Table *table, unsigned startRow, unsigned endRow,
+    unsigned keyCol, bool descending, bool numeric) {
+
+    State s = assureTableSize(table, endRow, keyCol);
+    if (s == SUCCESS)
+        s = materializeRows(table, startRow, endRow);
+    if (s != SUCCESS)
+        return s;
+
+    size_t len = endRow - startRow + 1;
+    SortKeys keys = {.numKeys=NULL, .strKeys=NULL, .descending=descending};
+    unsigned *positions = statMalloc(ALLOC_ROWS, len * sizeof(unsigned));
+    unsigned *tmp = statMalloc(ALLOC_ROWS, len * sizeof(unsigned));
+    Cell **rows = statMalloc(ALLOC_ROWS, len * sizeof(Cell *));
+    RowInfo *infos = statMalloc(ALLOC_ROWS, len * sizeof(RowInfo));
+    if (numeric)
+        keys.numKeys = statMalloc(ALLOC_ROWS, len * sizeof(double));
+    else
+        keys.strKeys = statMalloc(ALLOC_ROWS, len * sizeof(char *));
+
+    if (!positions || !tmp || !rows || !infos || !(keys.numKeys || keys.strKeys)) {
+        s = ERR_MEMORY;
+    } else {
+        for (size_t i=0; i < len; i++) {
+            Cell *key = &table->cells[startRow - 1 + i][keyCol - 1];
+            positions[i] = i;
+            if (numeric)
+                keys.numKeys[i] = cellToDouble(key);
             else
-                fputc('\n', f);
+                keys.strKeys[i] = key->str;
         }
+
+        unsigned threads = availableThreads();
+        if (len >= PARALLEL_SORT_THRESHOLD && threads > 1)
+            parallelMergeSort(&keys, positions, tmp, len, threads);
+        else
+            mergeSort(&keys, positions, tmp, 0, len);
+
+        // permute the row pointers
+        Cell **first = &table->cells[startRow - 1];
+        RowInfo *firstInfo = &table->rowInfo[startRow - 1];
+        for (size_t i=0; i < len; i++) {
+            rows[i] = first[positions[i]];
+            infos[i] = firstInfo[positions[i]];
+        }
+        memcpy(first, rows, len * sizeof(Cell *));
+        memcpy(firstInfo, infos, len * sizeof(RowInfo));
+        rowsRearranged(table);
     }
+
+    statFree(ALLOC_ROWS, positions);
+    statFree(ALLOC_ROWS, tmp);
+    statFree(ALLOC_ROWS, rows);
+    statFree(ALLOC_ROWS, infos);
+    statFree(ALLOC_ROWS, keys.numKeys);
+    statFree(ALLOC_ROWS, keys.strKeys);
+    return s;
 }
 
-// takes commands as a string
-// and writes them into the program structure
-State parseCommands(Program *prog, char *cmdStr) {
-    // command delimiters
-    char *delims = ";";
-    // all commands except selection because of their weird syntax
-    const Command knownCommands[] = {
-        // Custom commands (not in official specification)
-        {.name="print", .fn=print_cmd},
-        {.name="dump", .fn=dump_cmd},
-        // Selection
-        {.name="[min]", .fn=selectMin_cmd},
-        {.name="[max]", .fn=selectMax_cmd},
-        {.name="[find ", .fn=selectFind_cmd},
-        {.name="[_]", .fn=selectLoad_cmd},
-        // Layout commands
-        {.name="irow", .fn=irow_cmd},
-        {.name="arow", .fn=arow_cmd},
-        {.name="drow", .fn=drow_cmd},
-        {.name="icol", .fn=icol_cmd},
-        {.name="acol", .fn=acol_cmd},
-        {.name="dcol", .fn=dcol_cmd},
-        // Data commands
-        {.name="set ", .fn=set_cmd},
-        {.name="clear", .fn=clear_cmd},
-        {.name="swap ", .fn=swap_cmd},
-        {.name="sum ", .fn=sum_cmd},
-        {.name="avg ", .fn=avg_cmd},
-        {.name="count ", .fn=count_cmd},
-        {.name="len ", .fn=len_cmd},
-        // Variable commands
-        {.name="def _", .fn=def_cmd},
-        {.name="use _", .fn=use_cmd},
-        {.name="inc _", .fn=inc_cmd},
-        {.name="[set]", .fn=selectStore_cmd},
-        // Control commands
-        {.name="goto ", .fn=goto_cmd},
-        {.name="iszero _", .fn=iszero_cmd},
-        {.name="sub _", .fn=sub_cmd},
+// ---------- GROUP BY FUNCTIONS -----------
+// rows are put into groups by a hash map on their keys
+// a group holds only its key and a running aggregate, never its rows
+
+typedef enum {
+    AGG_SUM,
+    AGG_AVG,
+    AGG_COUNT,
+    AGG_MIN,
+    AGG_MAX,
+    // only the keys, for distinct
+    AGG_NONE,
+} Aggregate;
+
+typedef struct {
+    // where the key is in the keys buffer
+    size_t keyOffset;
+    // sum, minimum or maximum of the numbers
+    double value;
+    // numbers or non-empty cells seen so far
+    unsigned long count;
+} Group;
+
+// groups in the order of their first rows
+typedef struct {
+    Group *groups;
+    unsigned len;
+    unsigned cap;
+    // all the keys one after another, each terminated by '\0'
+    char *keys;
+    size_t keysLen;
+    size_t keysCap;
+    // maps keys to group numbers, starting at 1
+    HashMap index;
+} Groups;
+
+// what hashmapFind needs to compare a key with a group
+typedef struct {
+    Groups *groups;
+    const char *key;
+} GroupKey;
+
+State groups_ctor(Groups *groups) {
+    groups->groups = NULL;
+    groups->len = 0;
+    groups->cap = 0;
+    groups->keys = NULL;
+    groups->keysLen = 0;
+    groups->keysCap = 0;
+    return hashmap_ctor(&groups->index, 0);
+}
+
+void groups_dtor(Groups *groups) {
+    statFree(ALLOC_INDEXES, groups->groups);
+    statFree(ALLOC_INDEXES, groups->keys);
+    hashmap_dtor(&groups->index);
+}
+
+char *groupKey(Groups *groups, unsigned group) {
+    return &groups->keys[groups->groups[group-1].keyOffset];
+}
+
+bool groupKeyEquals(void *ctx, unsigned group) {
+    GroupKey *key = ctx;
+    return strcmp(groupKey(key->groups, group), key->key) == 0;
+}
+
+// finds the group of the key, a new one is made if there isn't any
+State findGroup(Groups *groups, const char *key, Group **group) {
+    GroupKey groupKey = {.groups=groups, .key=key};
+    size_t hash = hashString(key);
+    HashSlot *slot = hashmapFind(&groups->index, hash, groupKeyEquals, &groupKey);
+    if (slot->value != 0) {
+        *group = &groups->groups[slot->value - 1];
+        return SUCCESS;
+    }
+
+    // both arrays grow twice, so the copying stays linear
+    if (groups->len == groups->cap) {
+        unsigned cap = groups->cap ? 2 * groups->cap : 64;
+        Group *p = statRealloc(ALLOC_INDEXES, groups->groups, cap * sizeof(Group));
+        if (p == NULL)
+            return ERR_MEMORY;
+        groups->groups = p;
+        groups->cap = cap;
+    }
+    size_t len = strlen(key) + 1;
+    if (groups->keysLen + len > groups->keysCap) {
+        size_t cap = groups->keysCap ? 2 * groups->keysCap : 1024;
+        while (groups->keysLen + len > cap)
+            cap *= 2;
+        char *p = statRealloc(ALLOC_INDEXES, groups->keys, cap);
+        if (p == NULL)
+            return ERR_MEMORY;
+        groups->keys = p;
+        groups->keysCap = cap;
+    }
+
+    Group *g = &groups->groups[groups->len];
+    *g = (Group){.keyOffset=groups->keysLen, .value=0, .count=0};
+    memcpy(&groups->keys[groups->keysLen], key, len);
+    groups->keysLen += len;
+    groups->len++;
+    *group = g;
+    return hashmapInsert(&groups->index, slot, hash, groups->len);
+}
+
+// adds the cell to the aggregate of the group
+void aggregateCell(Group *group, Aggregate agg, Cell *cell) {
+    if (agg == AGG_NONE)
+        return;
+    if (agg == AGG_COUNT) {
+        group->count += (cell->str[0] != '\0');
+        return;
+    }
+
+    double value = cellToDouble(cell);
+    if (isnan(value))
+        return;
+
+    if (agg == AGG_SUM || agg == AGG_AVG)
+        group->value += value;
+    else if (group->count == 0)
+        group->value = value;
+    else if ((agg == AGG_MAX) ? (value > group->value) : (value < group->value))
+        group->value = value;
+    group->count++;
+}
+
+// writes the result of the group into the cell, user coordinates
+// min and max of a group without numbers are empty
+State writeAggregate(Table *table, unsigned row, unsigned col, Group *group, Aggregate agg) {
+    switch (agg) {
+        case AGG_SUM:
+            return writeTableCellDouble(table, row, col, group->value);
+        case AGG_AVG:
+            return writeTableCellDouble(table, row, col, group->value / group->count);
+        case AGG_COUNT:
+            return writeTableCellUnsigned(table, row, col, group->count);
+        default:
+            if (group->count == 0)
+                return writeTableCell(table, row, col, "");
+            return writeTableCellDouble(table, row, col, group->value);
+    }
+}
+
+// aggregates valCol of the rows by keyCol, all user coordinates
+// the results go to the rows from dstRow, keys into dstCol and results next to them
+State groupRows(Table *table, unsigned startRow, unsigned endRow,
+    unsigned keyCol, unsigned valCol, Aggregate agg,
+    unsigned dstRow, unsigned dstCol) {
+
+    unsigned maxCol = (keyCol > valCol) ? keyCol : valCol;
+    if (agg == AGG_NONE)
+        maxCol = keyCol;
+    State s = assureTableSize(table, endRow, maxCol);
+    if (s != SUCCESS)
+        return s;
+
+    Groups groups;
+    s = groups_ctor(&groups);
+    for (unsigned i=startRow; (s == SUCCESS) && (i <= endRow); i++) {
+        s = materializeRow(table, i);
+        if (s != SUCCESS)
+            break;
+        Cell *row = table->cells[i-1];
+        Group *group;
+        s = findGroup(&groups, row[keyCol-1].str, &group);
+        if (s == SUCCESS)
+            aggregateCell(group, agg, &row[valCol-1]);
+    }
+
+    // the results can overwrite the rows, the keys are copied already
+    for (unsigned g=1; (s == SUCCESS) && (g <= groups.len); g++) {
+        unsigned row = dstRow + g - 1;
+        s = writeTableCell(table, row, dstCol, groupKey(&groups, g));
+        if (s == SUCCESS && agg != AGG_NONE)
+            s = writeAggregate(table, row, dstCol + 1, &groups.groups[g-1], agg);
+    }
+    groups_dtor(&groups);
+    return s;
+}
+
+// ---------- UNIQ FUNCTIONS -----------
+// duplicate rows are found by a hash map on their key cells
+// the rows, that stay, are moved up in one pass
+
+// what hashmapFind needs to compare the keys of a row with a kept row
+typedef struct {
+    Table *table;
+    unsigned row;
+    unsigned *cols;
+    unsigned numCols;
+} RowKey;
+
+size_t hashRowKey(RowKey *key) {
+    size_t hash = 14695981039346656037ULL;
+    Cell *cells = key->table->cells[key->row-1];
+    for (unsigned k=0; k < key->numCols; k++) {
+        // the cells are mixed in one by one, so that "a","bc" and "ab","c" differ
+        hash ^= hashString(cells[key->cols[k]-1].str);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool rowKeyEquals(void *ctx, unsigned row) {
+    RowKey *key = ctx;
+    Cell *a = key->table->cells[key->row-1];
+    Cell *b = key->table->cells[row-1];
+    for (unsigned k=0; k < key->numCols; k++) {
+        unsigned col = key->cols[k] - 1;
+        if (strcmp(a[col].str, b[col].str) != 0)
+            return false;
+    }
+    return true;
+}
+
+// removes rows from startRow to endRow, whose cols are the same as in an earlier row
+// the first rows stay where they were, user coordinates
+State uniqueRows(Table *table, unsigned startRow, unsigned endRow,
+    unsigned *cols, unsigned numCols) {
+
+    unsigned maxCol = 0;
+    for (unsigned k=0; k < numCols; k++)
+        maxCol = (cols[k] > maxCol) ? cols[k] : maxCol;
+    State s = assureTableSize(table, endRow, maxCol);
+    if (s != SUCCESS)
+        return s;
+
+    HashMap kept;
+    s = hashmap_ctor(&kept, 0);
+    // the next row, that stays, goes here
+    unsigned dst = startRow;
+    unsigned i;
+    for (i=startRow; (s == SUCCESS) && (i <= endRow); i++) {
+        s = materializeRow(table, i);
+        if (s != SUCCESS)
+            break;
+
+        RowKey key = {.table=table, .row=i, .cols=cols, .numCols=numCols};
+        size_t hash = hashRowKey(&key);
+        HashSlot *slot = hashmapFind(&kept, hash, rowKeyEquals, &key);
+        if (slot->value != 0) {
+            for (unsigned j=0; j < table->cols; j++)
+                cell_dtor(&table->cells[i-1][j]);
+            freeRow(table, table->cells[i-1]);
+            table->cells[i-1] = NULL;
+            continue;
+        }
+
+        table->cells[dst-1] = table->cells[i-1];
+        table->rowInfo[dst-1] = table->rowInfo[i-1];
+        s = hashmapInsert(&kept, slot, hash, dst);
+        dst++;
+    }
+    hashmap_dtor(&kept);
+
+    // the rows, that were not checked, follow the kept ones
+    // it is the rest of the table, or more after an error
+    unsigned removed = i - dst;
+    if (removed > 0) {
+        for (; i <= table->rows; i++) {
+            table->cells[i - removed - 1] = table->cells[i-1];
+            table->rowInfo[i - removed - 1] = table->rowInfo[i-1];
+        }
+        table->rows -= removed;
+        table->deadCells += (unsigned long long)removed * table->cols;
+        rowsRearranged(table);
+    }
+    return s;
+}
+
+// ---------- FORMULA FUNCTIONS -----------
+// "set =[1,2]*2" puts a formula into the selected cells, it is parsed only once
+// "set ==x" writes the text "=x"
+// the cells show the values of their formulas, those are printed and saved
+// a changed cell marks the formulas depending on it as dirty,
+// they are recalculated after the command in topological order
+
+// rows of one bucket of the dependencies
+#define FORMULA_BUCKET_ROWS 64
+// a node referring to more buckets is checked on every change instead
+#define FORMULA_MAX_BUCKETS 1024
+// maximum nesting of parentheses and minus signs
+#define FORMULA_MAX_DEPTH 64
+// removed formulas are dropped, when there are more of them than this
+#define FORMULA_MIN_REMOVED 1024
+
+// makes space for one more item of an array, the capacity grows twice
+// returns the new array or NULL, the old array stays valid then
+void *reserveItem(void *items, unsigned *cap, unsigned len, size_t size) {
+    if (len < *cap)
+        return items;
+    unsigned newCap = (*cap == 0) ? 16 : 2 * *cap;
+    void *p = statRealloc(ALLOC_INDEXES, items, newCap * size);
+    if (p != NULL)
+        *cap = newCap;
+    return p;
+}
+
+// state of the parser of one formula
+typedef struct {
+    const char *str;
+    ExprNode *nodes;
+    unsigned len;
+    unsigned depth;
+} FormulaParser;
+
+void skipFormulaSpaces(FormulaParser *p) {
+    while (*p->str == ' ')
+        p->str++;
+}
+
+// skips the char, returns false if it is not there
+bool expectFormulaChar(FormulaParser *p, char c) {
+    skipFormulaSpaces(p);
+    if (*p->str != c)
+        return false;
+    p->str++;
+    return true;
+}
+
+// parses a row or a column number
+bool parseFormulaCoord(FormulaParser *p, unsigned *coord) {
+    skipFormulaSpaces(p);
+    if ((*p->str < '0') || (*p->str > '9'))
+        return false;
+    char *end;
+    unsigned long value = strtoul(p->str, &end, 10);
+    if ((value == 0) || (value > UINT_MAX))
+        return false;
+    p->str = end;
+    *coord = value;
+    return true;
+}
+
+// parses "R,C" or "R1,C1,R2,C2" of a block
+bool parseFormulaBlock(FormulaParser *p, ExprNode *node, bool block) {
+    if (!parseFormulaCoord(p, &node->startRow) || !expectFormulaChar(p, ',')
+        || !parseFormulaCoord(p, &node->startCol))
+        return false;
+    node->endRow = node->startRow;
+    node->endCol = node->startCol;
+    if (!block || !expectFormulaChar(p, ','))
+        return true;
+    return parseFormulaCoord(p, &node->endRow) && expectFormulaChar(p, ',')
+        && parseFormulaCoord(p, &node->endCol)
+        && (node->endRow >= node->startRow) && (node->endCol >= node->startCol);
+}
+
+State parseFormulaSum(FormulaParser *p);
+
+// number, [R,C], FUNCTION(R1,C1,R2,C2), -factor or (sum)
+State parseFormulaFactor(FormulaParser *p) {
+    const char *names[] = {
+        [AGG_SUM] = "SUM", [AGG_AVG] = "AVG", [AGG_COUNT] = "COUNT",
+        [AGG_MIN] = "MIN", [AGG_MAX] = "MAX",
     };
-    const int NUM_KNOWN_CMDS = sizeof(knownCommands) / sizeof(Command);
-    // the imaginary reading head of cmdStr
-    int strIndex=0;
 
-    while (true) {
-        bool found = false;
-        // check for command
-        for (int j=0; j < NUM_KNOWN_CMDS; j++) {
-            // if the command is found at the beginning of current index
-            if (strbgn(&cmdStr[strIndex], knownCommands[j].name) == 0) {
-                strIndex += strlen(knownCommands[j].name);
-                addCommand(prog, &knownCommands[j]);
-                found = true;
-                break;
+    skipFormulaSpaces(p);
+    if (p->depth >= FORMULA_MAX_DEPTH)
+        return ERR_BAD_SYNTAX;
+
+    // every node takes at least one char, so there is always space for it
+    ExprNode node = {.type=NODE_NUMBER};
+    char c = *p->str;
+    if ((c == '(') || (c == '-')) {
+        p->str++;
+        p->depth++;
+        State s = (c == '(') ? parseFormulaSum(p) : parseFormulaFactor(p);
+        p->depth--;
+        if (s != SUCCESS)
+            return s;
+        if (c == '(')
+            return expectFormulaChar(p, ')') ? SUCCESS : ERR_BAD_SYNTAX;
+        node.type = NODE_NEGATE;
+    } else if (c == '[') {
+        p->str++;
+        node.type = NODE_CELL;
+        if (!parseFormulaBlock(p, &node, false) || !expectFormulaChar(p, ']'))
+            return ERR_BAD_SYNTAX;
+    } else if (((c >= '0') && (c <= '9')) || (c == '.')) {
+        char *end;
+        node.num = strtod(p->str, &end);
+        if (end == p->str)
+            return ERR_BAD_SYNTAX;
+        p->str = end;
+    } else {
+        int agg = -1;
+        for (int i=0; agg < 0 && i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+            size_t len = strlen(names[i]);
+            if ((strncmp(p->str, names[i], len) == 0) && (p->str[len] == '(')) {
+                agg = i;
+                p->str += len + 1;
             }
         }
-        // check for the weird coordinate selection command
-        if (!found && (cmdStr[strIndex] == '[')) {
-            const Command select = {.fn=selectCoords_cmd};
-            addCommand(prog, &select);
-            found = true;
-            // strIndex doesn't shift
-            // because the command is its own argument if it makes any sense
-        }
+        node.type = NODE_AGGREGATE;
+        node.agg = agg;
+        if ((agg < 0) || !parseFormulaBlock(p, &node, true) || !expectFormulaChar(p, ')'))
+            return ERR_BAD_SYNTAX;
+    }
+    p->nodes[p->len++] = node;
+    return SUCCESS;
+}
+
+// factors joined by '*' and '/'
+State parseFormulaProduct(FormulaParser *p) {
+    State s = parseFormulaFactor(p);
+    while (s == SUCCESS) {
+        skipFormulaSpaces(p);
+        char op = *p->str;
+        if ((op != '*') && (op != '/'))
+            break;
+        p->str++;
+        s = parseFormulaFactor(p);
+        p->nodes[p->len++] = (ExprNode){.type=(op == '*') ? NODE_MUL : NODE_DIV};
+    }
+    return s;
+}
+
+// products joined by '+' and '-'
+State parseFormulaSum(FormulaParser *p) {
+    State s = parseFormulaProduct(p);
+    while (s == SUCCESS) {
+        skipFormulaSpaces(p);
+        char op = *p->str;
+        if ((op != '+') && (op != '-'))
+            break;
+        p->str++;
+        s = parseFormulaProduct(p);
+        p->nodes[p->len++] = (ExprNode){.type=(op == '+') ? NODE_ADD : NODE_SUB};
+    }
+    return s;
+}
+
+// parses the formula without '=' into a new expression
+State parseFormula(const char *str, Expression **expr) {
+    FormulaParser p = {.str=str, .len=0, .depth=0};
+    p.nodes = statMalloc(ALLOC_PROGRAM, (strlen(str) + 1) * sizeof(ExprNode));
+    if (p.nodes == NULL)
+        return ERR_MEMORY;
+
+    State s = parseFormulaSum(&p);
+    if ((s == SUCCESS) && !expectFormulaChar(&p, '\0'))
+        s = ERR_BAD_SYNTAX;
+    if (s == SUCCESS) {
+        *expr = statMalloc(ALLOC_PROGRAM, sizeof(Expression));
+        if (*expr == NULL)
+            s = ERR_MEMORY;
+    }
+    if (s != SUCCESS) {
+        statFree(ALLOC_PROGRAM, p.nodes);
+        return s;
+    }
+    **expr = (Expression){.nodes=p.nodes, .len=p.len, .users=0};
+    return SUCCESS;
+}
+
+// frees the expression, when no formula uses it anymore
+void releaseExpression(Expression *expr) {
+    if (expr->users > 0)
+        return;
+    statFree(ALLOC_PROGRAM, expr->nodes);
+    statFree(ALLOC_PROGRAM, expr);
+}
+
+// value of the cells of a NODE_CELL or a NODE_AGGREGATE
+// a cell outside of the table or an empty cell counts as 0
+State blockValue(Table *table, ExprNode *node, double *value) {
+    Group group = {.value=0, .count=0};
+    Aggregate agg = (node->type == NODE_CELL) ? AGG_SUM : node->agg;
+    unsigned endRow = (node->endRow < table->rows) ? node->endRow : table->rows;
+    unsigned endCol = (node->endCol < table->cols) ? node->endCol : table->cols;
+    bool isText = false;
+
+    for (unsigned i=node->startRow; i <= endRow; i++) {
+        State s = materializeRow(table, i);
+        if (s != SUCCESS)
+            return s;
+        for (unsigned j=node->startCol; j <= endCol; j++) {
+            Cell *cell = &table->cells[i-1][j-1];
+            aggregateCell(&group, agg, cell);
+            isText = (cell->str[0] != '\0') && isnan(cellToDouble(cell));
+        }
+    }
+
+    switch (agg) {
+        case AGG_SUM:
+            // one cell with text is not a number, a block just skips it
+            *value = (node->type == NODE_CELL && isText) ? NAN : group.value;
+            break;
+        case AGG_AVG:
+            *value = group.value / group.count;
+            break;
+        case AGG_COUNT:
+            *value = group.count;
+            break;
+        default:
+            *value = (group.count == 0) ? NAN : group.value;
+    }
+    return SUCCESS;
+}
+
+// computes the value of the expression
+State evalExpression(Table *table, Expression *expr, double *value) {
+    double *stack = table->formulas->stack;
+    unsigned top = 0;
+    for (unsigned i=0; i < expr->len; i++) {
+        ExprNode *node = &expr->nodes[i];
+        State s;
+        switch (node->type) {
+            case NODE_NUMBER:
+                stack[top++] = node->num;
+                break;
+            case NODE_CELL:
+            case NODE_AGGREGATE:
+                s = blockValue(table, node, &stack[top++]);
+                if (s != SUCCESS)
+                    return s;
+                break;
+            case NODE_NEGATE:
+                stack[top-1] = -stack[top-1];
+                break;
+            case NODE_ADD:
+                top--;
+                stack[top-1] += stack[top];
+                break;
+            case NODE_SUB:
+                top--;
+                stack[top-1] -= stack[top];
+                break;
+            case NODE_MUL:
+                top--;
+                stack[top-1] *= stack[top];
+                break;
+            case NODE_DIV:
+                top--;
+                stack[top-1] /= stack[top];
+                break;
+        }
+    }
+    *value = stack[0];
+    return SUCCESS;
+}
+
+// checks if the node refers to the cell, user coordinates
+bool nodeRefersTo(ExprNode *node, unsigned row, unsigned col) {
+    return (row >= node->startRow) && (row <= node->endRow)
+        && (col >= node->startCol) && (col <= node->endCol);
+}
+
+// mixes the bucket and the column into a hash
+size_t bucketHash(unsigned bucket, unsigned col) {
+    unsigned long long x = ((unsigned long long)bucket << 32) | col;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// what hashmapFind needs to compare a bucket with a dependency
+typedef struct {
+    Formulas *formulas;
+    unsigned bucket;
+    unsigned col;
+} BucketKey;
+
+bool bucketKeyEquals(void *ctx, unsigned value) {
+    BucketKey *key = ctx;
+    Dependency *dep = &key->formulas->deps[value];
+    return (dep->bucket == key->bucket) && (dep->col == key->col);
+}
+
+// remembers, that the node of the formula refers to the bucket
+State addDependency(Formulas *formulas, unsigned formula, unsigned node,
+    unsigned bucket, unsigned col, bool wide) {
+
+    Dependency *deps = reserveItem(formulas->deps, &formulas->depsCap,
+        formulas->depsLen, sizeof(Dependency));
+    if (deps == NULL)
+        return ERR_MEMORY;
+    formulas->deps = deps;
+    unsigned n = formulas->depsLen++;
+    deps[n] = (Dependency){.formula=formula, .node=node, .bucket=bucket, .col=col, .next=0};
+
+    if (wide) {
+        unsigned *p = reserveItem(formulas->wide, &formulas->wideCap,
+            formulas->wideLen, sizeof(unsigned));
+        if (p == NULL)
+            return ERR_MEMORY;
+        formulas->wide = p;
+        formulas->wide[formulas->wideLen++] = n;
+        return SUCCESS;
+    }
+
+    // the new dependency is the first one of its bucket
+    BucketKey key = {.formulas=formulas, .bucket=bucket, .col=col};
+    size_t hash = bucketHash(bucket, col);
+    HashSlot *slot = hashmapFind(&formulas->buckets, hash, bucketKeyEquals, &key);
+    if (slot->value != 0) {
+        deps[n].next = slot->value;
+        slot->value = n;
+        return SUCCESS;
+    }
+    return hashmapInsert(&formulas->buckets, slot, hash, n);
+}
+
+// adds the cells, the formula refers to, into the dependencies
+State indexFormula(Formulas *formulas, unsigned formula) {
+    Expression *expr = formulas->items[formula].expr;
+    for (unsigned i=0; i < expr->len; i++) {
+        ExprNode *node = &expr->nodes[i];
+        if ((node->type != NODE_CELL) && (node->type != NODE_AGGREGATE))
+            continue;
+
+        unsigned first = (node->startRow - 1) / FORMULA_BUCKET_ROWS;
+        unsigned last = (node->endRow - 1) / FORMULA_BUCKET_ROWS;
+        unsigned long long buckets = (unsigned long long)(last - first + 1)
+            * (node->endCol - node->startCol + 1);
+        if (buckets > FORMULA_MAX_BUCKETS) {
+            State s = addDependency(formulas, formula, i, 0, 0, true);
+            if (s != SUCCESS)
+                return s;
+            continue;
+        }
+        for (unsigned col=node->startCol; col <= node->endCol; col++) {
+            for (unsigned bucket=first; bucket <= last; bucket++) {
+                State s = addDependency(formulas, formula, i, bucket, col, false);
+                if (s != SUCCESS)
+                    return s;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+// puts the formula on the list of dirty formulas
+void markFormula(Formulas *formulas, unsigned formula) {
+    Formula *f = &formulas->items[formula];
+    if ((f->expr == NULL) || f->dirty)
+        return;
+
+    unsigned *p = reserveItem(formulas->dirty, &formulas->dirtyCap,
+        formulas->dirtyLen, sizeof(unsigned));
+    // without memory for the list everything is recalculated
+    if (p == NULL) {
+        formulas->moved = true;
+        return;
+    }
+    formulas->dirty = p;
+    f->dirty = true;
+    formulas->dirty[formulas->dirtyLen++] = formula;
+}
+
+// marks the formulas, that refer to the cell, user coordinates
+void markDependents(Formulas *formulas, unsigned row, unsigned col) {
+    BucketKey key = {.formulas=formulas, .bucket=(row - 1) / FORMULA_BUCKET_ROWS, .col=col};
+    HashSlot *slot = hashmapFind(&formulas->buckets, bucketHash(key.bucket, col),
+        bucketKeyEquals, &key);
+
+    for (unsigned n=slot->value; n != 0; n = formulas->deps[n].next) {
+        Dependency *dep = &formulas->deps[n];
+        Formula *f = &formulas->items[dep->formula];
+        if ((f->expr != NULL) && nodeRefersTo(&f->expr->nodes[dep->node], row, col))
+            markFormula(formulas, dep->formula);
+    }
+    for (unsigned i=0; i < formulas->wideLen; i++) {
+        Dependency *dep = &formulas->deps[formulas->wide[i]];
+        Formula *f = &formulas->items[dep->formula];
+        if ((f->expr != NULL) && nodeRefersTo(&f->expr->nodes[dep->node], row, col))
+            markFormula(formulas, dep->formula);
+    }
+}
+
+// called by cellDidChange, marks the formulas depending on the cell
+// and the formulas depending on them
+void formulaCellDidChange(Table *table, unsigned row, unsigned col) {
+    Formulas *formulas = table->formulas;
+    // after a move all of them are recalculated anyway
+    if ((formulas == NULL) || formulas->recalculating || formulas->moved)
+        return;
+
+    unsigned start = formulas->dirtyLen;
+    markDependents(formulas, row, col);
+    for (unsigned i=start; i < formulas->dirtyLen; i++) {
+        Formula *f = &formulas->items[formulas->dirty[i]];
+        markDependents(formulas, f->row, f->col);
+    }
+}
+
+// called by cellWillChange, a cell, that gets new contents, loses its formula
+// moved and swapped cells lose them too, only their values move
+void formulaCellWillChange(Table *table, unsigned row, unsigned col) {
+    Formulas *formulas = table->formulas;
+    if ((formulas == NULL) || formulas->recalculating)
+        return;
+
+    Cell *cell = &table->cells[row-1][col-1];
+    if (cell->formula == 0)
+        return;
+    Formula *f = &formulas->items[cell->formula];
+    f->expr->users--;
+    releaseExpression(f->expr);
+    f->expr = NULL;
+    formulas->removed++;
+    cell->formula = 0;
+}
+
+// called when cells change their positions
+void formulasMoved(Table *table) {
+    if (table->formulas != NULL)
+        table->formulas->moved = true;
+}
+
+// frees all the formulas, the table is destructed or no cell has a formula
+void dropFormulas(Table *table) {
+    Formulas *formulas = table->formulas;
+    if (formulas == NULL)
+        return;
+
+    for (unsigned i=1; i < formulas->len; i++) {
+        Expression *expr = formulas->items[i].expr;
+        if (expr == NULL)
+            continue;
+        expr->users--;
+        releaseExpression(expr);
+    }
+    statFree(ALLOC_INDEXES, formulas->items);
+    statFree(ALLOC_INDEXES, formulas->deps);
+    hashmap_dtor(&formulas->buckets);
+    statFree(ALLOC_INDEXES, formulas->wide);
+    statFree(ALLOC_INDEXES, formulas->dirty);
+    statFree(ALLOC_INDEXES, formulas->edges);
+    statFree(ALLOC_INDEXES, formulas->stack);
+    statFree(ALLOC_INDEXES, formulas);
+    table->formulas = NULL;
+}
+
+// finds the formulas in the cells again, drops the removed ones
+// and builds the dependencies from scratch, after a move all are dirty
+State reindexFormulas(Table *table) {
+    Formulas *formulas = table->formulas;
+    Formula *items = statMalloc(ALLOC_INDEXES, formulas->len * sizeof(Formula));
+    if (items == NULL)
+        return ERR_MEMORY;
+
+    unsigned len = 1;
+    for (unsigned i=0; i < table->rows; i++) {
+        for (unsigned j=0; j < table->cols && table->cells[i] != NULL; j++) {
+            Cell *cell = &table->cells[i][j];
+            if (cell->formula == 0)
+                continue;
+            Formula *f = &formulas->items[cell->formula];
+            items[len] = *f;
+            items[len].row = i + 1;
+            items[len].col = j + 1;
+            items[len].dirty = f->dirty || formulas->moved;
+            f->expr = NULL;
+            cell->formula = len++;
+        }
+    }
+    // the formulas of deleted cells
+    for (unsigned i=1; i < formulas->len; i++) {
+        Expression *expr = formulas->items[i].expr;
+        if (expr == NULL)
+            continue;
+        expr->users--;
+        releaseExpression(expr);
+    }
+    statFree(ALLOC_INDEXES, formulas->items);
+    formulas->items = items;
+    formulas->cap = formulas->len;
+    formulas->len = len;
+    formulas->removed = 0;
+    formulas->moved = false;
+
+    formulas->dirtyLen = 0;
+    formulas->depsLen = 1;
+    formulas->wideLen = 0;
+    hashmap_dtor(&formulas->buckets);
+    State s = hashmap_ctor(&formulas->buckets, 0);
+    for (unsigned i=1; i < len && s == SUCCESS; i++) {
+        s = indexFormula(formulas, i);
+        if (items[i].dirty) {
+            items[i].dirty = false;
+            markFormula(formulas, i);
+        }
+    }
+    return s;
+}
+
+// adds an edge, the formula to waits for the formula from
+State addFormulaEdge(Formulas *formulas, unsigned from, unsigned to) {
+    FormulaEdge *p = reserveItem(formulas->edges, &formulas->edgesCap,
+        formulas->edgesLen, sizeof(FormulaEdge));
+    if (p == NULL)
+        return ERR_MEMORY;
+    formulas->edges = p;
+    unsigned n = formulas->edgesLen++;
+    p[n] = (FormulaEdge){.to=to, .next=formulas->items[from].firstEdge};
+    formulas->items[from].firstEdge = n;
+    formulas->items[to].waitsFor++;
+    return SUCCESS;
+}
+
+// connects every dirty formula with the dirty formulas in its cells
+State linkDirtyFormulas(Table *table) {
+    Formulas *formulas = table->formulas;
+    formulas->edgesLen = 1;
+    for (unsigned i=0; i < formulas->dirtyLen; i++) {
+        Formula *f = &formulas->items[formulas->dirty[i]];
+        f->waitsFor = 0;
+        f->firstEdge = 0;
+    }
+
+    for (unsigned i=0; i < formulas->dirtyLen; i++) {
+        unsigned to = formulas->dirty[i];
+        Expression *expr = formulas->items[to].expr;
+        for (unsigned k=0; expr != NULL && k < expr->len; k++) {
+            ExprNode *node = &expr->nodes[k];
+            if ((node->type != NODE_CELL) && (node->type != NODE_AGGREGATE))
+                continue;
+            unsigned endRow = (node->endRow < table->rows) ? node->endRow : table->rows;
+            unsigned endCol = (node->endCol < table->cols) ? node->endCol : table->cols;
+            if ((endRow < node->startRow) || (endCol < node->startCol))
+                continue;
+
+            // a big block is cheaper to check against the dirty formulas
+            unsigned long long cells = (unsigned long long)(endRow - node->startRow + 1)
+                * (endCol - node->startCol + 1);
+            if (cells > formulas->dirtyLen) {
+                for (unsigned j=0; j < formulas->dirtyLen; j++) {
+                    unsigned from = formulas->dirty[j];
+                    Formula *f = &formulas->items[from];
+                    if ((f->expr == NULL) || !nodeRefersTo(node, f->row, f->col))
+                        continue;
+                    State s = addFormulaEdge(formulas, from, to);
+                    if (s != SUCCESS)
+                        return s;
+                }
+                continue;
+            }
+            // rows, that were not read yet, have no formulas
+            for (unsigned row=node->startRow; row <= endRow; row++) {
+                for (unsigned col=node->startCol; col <= endCol && table->cells[row-1] != NULL; col++) {
+                    unsigned from = table->cells[row-1][col-1].formula;
+                    if ((from == 0) || !formulas->items[from].dirty)
+                        continue;
+                    State s = addFormulaEdge(formulas, from, to);
+                    if (s != SUCCESS)
+                        return s;
+                }
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+// evaluates the dirty formulas, every one after the formulas it depends on
+// the formulas left in the end wait for each other in a cycle
+State evalDirtyFormulas(Table *table) {
+    Formulas *formulas = table->formulas;
+    unsigned *queue = statMalloc(ALLOC_INDEXES, formulas->dirtyLen * sizeof(unsigned));
+    if (queue == NULL)
+        return ERR_MEMORY;
+
+    unsigned head = 0, tail = 0;
+    for (unsigned i=0; i < formulas->dirtyLen; i++) {
+        Formula *f = &formulas->items[formulas->dirty[i]];
+        if ((f->expr != NULL) && (f->waitsFor == 0))
+            queue[tail++] = formulas->dirty[i];
+    }
+
+    State s = SUCCESS;
+    formulas->recalculating = true;
+    while (head < tail && s == SUCCESS) {
+        Formula *f = &formulas->items[queue[head++]];
+        double value;
+        s = evalExpression(table, f->expr, &value);
+        if (s != SUCCESS)
+            break;
+
+        cellWillChange(table, f->row, f->col);
+        s = writeCellDouble(&table->cells[f->row-1][f->col-1], value);
+        cellDidChange(table, f->row, f->col);
+        f->dirty = false;
+
+        for (unsigned n=f->firstEdge; n != 0; n = formulas->edges[n].next) {
+            unsigned to = formulas->edges[n].to;
+            if (--formulas->items[to].waitsFor == 0)
+                queue[tail++] = to;
+        }
+    }
+    formulas->recalculating = false;
+    statFree(ALLOC_INDEXES, queue);
+
+    // formulas in a cycle keep their old contents, until their cells change again
+    // after any other error the rest is calculated later
+    bool cycle = (s == SUCCESS);
+    unsigned len = 0;
+    for (unsigned i=0; i < formulas->dirtyLen; i++) {
+        Formula *f = &formulas->items[formulas->dirty[i]];
+        if ((f->expr == NULL) || !f->dirty)
+            continue;
+        if (cycle) {
+            f->dirty = false;
+            s = ERR_FORMULA_CYCLE;
+        } else {
+            formulas->dirty[len++] = formulas->dirty[i];
+        }
+    }
+    formulas->dirtyLen = len;
+    return s;
+}
+
+// recalculates the dirty formulas, called after every command
+State recalcFormulas(Table *table) {
+    Formulas *formulas = table->formulas;
+    if (formulas == NULL)
+        return SUCCESS;
+
+    State s;
+    if (formulas->moved || (formulas->removed >= FORMULA_MIN_REMOVED
+        && 2 * formulas->removed > formulas->len)) {
+        s = reindexFormulas(table);
+        if (s != SUCCESS)
+            return s;
+    }
+    // the table doesn't need the formulas anymore
+    if (formulas->removed == formulas->len - 1) {
+        dropFormulas(table);
+        return SUCCESS;
+    }
+    if (formulas->dirtyLen == 0)
+        return SUCCESS;
+
+    s = linkDirtyFormulas(table);
+    if (s != SUCCESS)
+        return s;
+    return evalDirtyFormulas(table);
+}
+
+// adds the formula of the cell, user coordinates, it is calculated after the command
+State addFormula(Table *table, Cell *cell, unsigned row, unsigned col, Expression *expr) {
+    Formulas *formulas = table->formulas;
+    Formula *items = reserveItem(formulas->items, &formulas->cap,
+        formulas->len, sizeof(Formula));
+    if (items == NULL)
+        return ERR_MEMORY;
+    formulas->items = items;
+
+    unsigned n = formulas->len++;
+    items[n] = (Formula){.expr=expr, .row=row, .col=col, .dirty=false};
+    expr->users++;
+    cell->formula = n;
+    markFormula(formulas, n);
+    return indexFormula(formulas, n);
+}
+
+// makes the formulas of a table, the first item is unused
+State formulas_ctor(Formulas *formulas) {
+    *formulas = (Formulas){.len=1, .depsLen=1, .edgesLen=1};
+    formulas->items = reserveItem(NULL, &formulas->cap, 0, sizeof(Formula));
+    if (formulas->items == NULL)
+        return ERR_MEMORY;
+    return hashmap_ctor(&formulas->buckets, 0);
+}
+
+// checks if the argument of set is a formula, "==" starts a text with '='
+bool isFormulaArg(const char *str) {
+    return (str[0] == '=') && (str[1] != '=');
+}
+
+// sets the formula "=..." to every selected cell
+// the cells hold its text, until it is calculated
+State setSelectedFormula(Table *table, char *str) {
+    Expression *expr;
+    State s = parseFormula(&str[1], &expr);
+    if (s != SUCCESS)
+        return s;
+
+    if (table->formulas == NULL) {
+        table->formulas = statMalloc(ALLOC_INDEXES, sizeof(Formulas));
+        if (table->formulas == NULL)
+            s = ERR_MEMORY;
+        else if (formulas_ctor(table->formulas) != SUCCESS)
+            s = ERR_MEMORY;
+        if (s != SUCCESS) {
+            statFree(ALLOC_INDEXES, table->formulas);
+            table->formulas = NULL;
+            releaseExpression(expr);
+            return s;
+        }
+    }
+
+    Formulas *formulas = table->formulas;
+    if (formulas->stackCap < expr->len) {
+        double *stack = statRealloc(ALLOC_INDEXES, formulas->stack, expr->len * sizeof(double));
+        if (stack == NULL) {
+            releaseExpression(expr);
+            return ERR_MEMORY;
+        }
+        formulas->stack = stack;
+        formulas->stackCap = expr->len;
+    }
+
+    // go through every selected cell
+    SelectionIterator it;
+    iterator_init(&it, table);
+    while (s == SUCCESS && iteratorNext(&it)) {
+        for (unsigned k=0; k < it.width && s == SUCCESS; k++) {
+            cellWillChange(table, it.row, it.startCol + k);
+            s = writeCell(&it.cells[k], str);
+            cellDidChange(table, it.row, it.startCol + k);
+            if (s == SUCCESS)
+                s = addFormula(table, &it.cells[k], it.row, it.startCol + k, expr);
+        }
+    }
+    releaseExpression(expr);
+    if (s != SUCCESS)
+        return s;
+    return it.state;
+}
+
+// ---------- COMMAND FUNCTIONS -----------
+// the functions, that execute the actual commands
+// they all have the same interface (patrameter is Context, return is State)
+// all the functions also have _cmd just to signify this
+
+// prints context variables into stderr
+State dump_cmd(Context ctx) {
+    // if argument is not empty
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+
+    fprintf(stderr, "Context dump:\nVariables:\n");
+
+    for(int i=0; i<=9; i++) {
+        char buffer[MAX_NUMBER_LENGTH];
+        fprintf(stderr, "\t_%d = '%s'\n", i, variableString(&ctx.vars->values[i], buffer));
+    }
+
+    fprintf(stderr, "\t_ = rows %d to %d, cols %d to %d\n",
+        ctx.vars->selVar.startRow,
+        ctx.vars->selVar.endRow,
+        ctx.vars->selVar.startCol,
+        ctx.vars->selVar.endRow
+    );
+
+    fprintf(stderr, "Active selection: rows %d to %d, cols %d to %d\n",
+        ctx.table->sel.startRow,
+        ctx.table->sel.endRow,
+        ctx.table->sel.startCol,
+        ctx.table->sel.endRow
+    );
+
+    fprintf(stderr, "Execution pointer: %d\n", *(ctx.execPtr));
+    return SUCCESS;
+}
+
+// prints the table into stderr
+State print_cmd(Context ctx) {
+    // if argument is not empty
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+
+    printTable(ctx.table, stderr);
+    return SUCCESS;
+}
+
+// selects the lowest nuber from selected cells
+State selectMin_cmd(Context ctx) {
+    return selectMinMax(ctx.table, false);
+}
+
+// selects the highest nuber from selected cells
+State selectMax_cmd(Context ctx) {
+    return selectMinMax(ctx.table, true);
+}
+
+// Command to select cells from coordinates
+State selectCoords_cmd(Context ctx) {
+    if (ctx.argStr[0] != '[')
+        return ERR_BAD_SYNTAX;
+
+    const unsigned MAX_NUM = 4;
+    unsigned numValues = 0;
+    unsigned values[MAX_NUM];
+
+    // shift for '[' at the beginning
+    unsigned strIndex = 1;
+    while (numValues < MAX_NUM) {
+        if (ctx.argStr[strIndex] == '_') {
+            values[numValues] = 0;
+            strIndex += 1;
+        } else {
+            char *endPtr;
+            values[numValues] = (unsigned)strtol(&ctx.argStr[strIndex], &endPtr, 10);
+            int shift = endPtr - &ctx.argStr[strIndex];
+
+            if (shift == 0)
+                return ERR_BAD_SYNTAX;
+
+            strIndex += shift;
+        }
+        numValues++;
+
+        if (ctx.argStr[strIndex] == ',') {
+            strIndex++;
+            continue;
+        }
+
+        if (ctx.argStr[strIndex] == ']')
+            break;
+
+        return ERR_BAD_SYNTAX;
+    }
+
+    if (numValues == 2)
+        return selectCell(ctx.table, values[0], values[1]);
+
+    if (numValues == 4)
+        return selectRectangle(ctx.table, values[0], values[1], values[2], values[3]);
+
+    return ERR_BAD_SYNTAX;
+}
+
+// applies selection variable to the table
+State selectStore_cmd(Context ctx) {
+    ctx.vars->selVar = ctx.table->sel;
+    return SUCCESS;
+}
+
+// applies selection variable to the table
+State selectLoad_cmd(Context ctx) {
+    ctx.table->sel = ctx.vars->selVar;
+    return SUCCESS;
+}
+
+// select the first cell, where str argument matches
+State selectFind_cmd(Context ctx) {
+    // copy original string
+    char searchStr[strlen(ctx.argStr) + 1];
+    strcpy(searchStr, ctx.argStr);
+    // remove the ] at the end
+    searchStr[strlen(ctx.argStr)-1] = '\0';
+
+    // whole columns are selected, the indexes can be used
+    if (selectsWholeColumns(ctx.table)) {
+        unsigned foundRow = 0;
+        unsigned foundCol = 0;
+        for (unsigned j=selLeftBound(ctx.table); j <= selRightBound(ctx.table); j++) {
+            unsigned row = findIndexLookup(ctx.table, j, searchStr);
+            // the first match in the row-major order
+            if ((row != 0) && ((foundRow == 0) || (row < foundRow))) {
+                foundRow = row;
+                foundCol = j;
+            }
+        }
+        if (foundRow != 0)
+            selectCell(ctx.table, foundRow, foundCol);
+        return SUCCESS;
+    }
+
+    // go through every selected cell
+    SelectionIterator it;
+    iterator_init(&it, ctx.table);
+    while (iteratorNext(&it)) {
+        for (unsigned k=0; k < it.width; k++) {
+            if (strcmp(it.cells[k].str, searchStr) == 0)
+                return selectCell(ctx.table, it.row, it.startCol + k);
+        }
+    }
+    return it.state;
+}
+
+// Layout commands
+
+// appends a row after the lower bound of the selection
+State arow_cmd(Context ctx) {
+    // if argument is not empty
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+
+    State s;
+    s = addRow(ctx.table);
+
+    if (s == SUCCESS) {
+        // start on the last line
+        unsigned start = ctx.table->rows;
+        // and swap until you get to the lower bound of selection
+        unsigned end = selLowerBound(ctx.table) + 1;
+        // move the empty row up to the selection
+        s = moveRow(ctx.table, start, end);
+    }
+    return s;
+}
+
+// inserts a row right above the selected region
+State irow_cmd(Context ctx) {
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+
+    State s;
+    s = addRow(ctx.table);
+
+    if (s == SUCCESS) {
+        // start on the last line
+        unsigned start = ctx.table->rows;
+        // and swap until you get to the top of selection
+        unsigned end = selUpperBound(ctx.table);
+        // move the empty row up to the selection
+        s = moveRow(ctx.table, start, end);
+    }
+    return s;
+}
+
+// deletes selected rows
+State drow_cmd(Context ctx) {
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+
+    unsigned first = selUpperBound(ctx.table);
+    unsigned last = selLowerBound(ctx.table);
+    if (last > ctx.table->rows)
+        last = ctx.table->rows;
+    if (first > last)
+        return SUCCESS;
+
+    deleteRows(ctx.table, first, last);
+    return maybeCompact(ctx.table);
+}
+
+// sorts the selected rows: sort [COL] [asc|desc] [num|str]
+// the key column defaults to the first selected column
+State sort_cmd(Context ctx) {
+    unsigned keyCol = selLeftBound(ctx.table);
+    bool descending = false;
+    bool numeric = true;
+
+    char *str = ctx.argStr;
+    while (*str != '\0') {
+        if (*str != ' ')
+            return ERR_BAD_SYNTAX;
+        str++;
+
+        if (strbgn(str, "asc") == 0) {
+            descending = false;
+            str += strlen("asc");
+        } else if (strbgn(str, "desc") == 0) {
+            descending = true;
+            str += strlen("desc");
+        } else if (strbgn(str, "num") == 0) {
+            numeric = true;
+            str += strlen("num");
+        } else if (strbgn(str, "str") == 0) {
+            numeric = false;
+            str += strlen("str");
+        } else {
+            char *endPtr;
+            long col = strtol(str, &endPtr, 10);
+            if ((endPtr == str) || (col < 1))
+                return ERR_BAD_SYNTAX;
+            keyCol = col;
+            str = endPtr;
+        }
+        // the words must be separated
+        if (*str != ' ' && *str != '\0')
+            return ERR_BAD_SYNTAX;
+    }
+
+    unsigned startRow = selUpperBound(ctx.table);
+    unsigned endRow = selLowerBound(ctx.table);
+    if (startRow > endRow)
+        return ERR_BAD_SELECTION;
+
+    return sortRows(ctx.table, startRow, endRow, keyCol, descending, numeric);
+}
+
+// transposes the selection, or the whole table if it is selected
+// a transposed block keeps its upper left corner and stays selected
+State transpose_cmd(Context ctx) {
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+
+    unsigned startRow = selUpperBound(ctx.table);
+    unsigned endRow = selLowerBound(ctx.table);
+    unsigned startCol = selLeftBound(ctx.table);
+    unsigned endCol = selRightBound(ctx.table);
+    if ((startRow > endRow) || (startCol > endCol))
+        return ERR_BAD_SELECTION;
+
+    if ((startRow == 1) && (endRow == ctx.table->rows)
+        && (startCol == 1) && (endCol == ctx.table->cols)) {
+        State s = transposeTable(ctx.table);
+        // the selection has to fit into the table
+        if ((s == SUCCESS) && (ctx.table->sel.endRow != 0 || ctx.table->sel.endCol != 0))
+            selectRectangle(ctx.table, 1, 1, ctx.table->rows, ctx.table->cols);
+        return s;
+    }
+
+    State s = transposeBlock(ctx.table, startRow, startCol, endRow, endCol);
+    if (s != SUCCESS)
+        return s;
+    return selectRectangle(ctx.table, startRow, startCol,
+        startRow + (endCol - startCol), startCol + (endRow - startRow));
+}
+
+// appends an empty column after selected cells
+State acol_cmd(Context ctx) {
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+
+    State s;
+    s = addCol(ctx.table);
+
+    if (s == SUCCESS) {
+        unsigned start = ctx.table->cols;
+        unsigned end = selRightBound(ctx.table) + 1;
+        s = moveCol(ctx.table, start, end);
+    }
+    return s;
+}
+
+// inserts an empty column left from the selected cells
+State icol_cmd(Context ctx) {
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+
+    State s;
+    s = addCol(ctx.table);
+
+    if (s == SUCCESS) {
+        unsigned start = ctx.table->cols;
+        unsigned end = selLeftBound(ctx.table);
+        s = moveCol(ctx.table, start, end);
+    }
+    return s;
+}
+
+// deletes selected columns
+State dcol_cmd(Context ctx) {
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+
+    unsigned first = selLeftBound(ctx.table);
+    unsigned last = selRightBound(ctx.table);
+    if (last > ctx.table->cols)
+        last = ctx.table->cols;
+    if (first > last)
+        return SUCCESS;
+
+    State s = deleteCols(ctx.table, first, last);
+    if (s != SUCCESS)
+        return s;
+    return maybeCompact(ctx.table);
+}
+
+State set_cmd(Context ctx) {
+    // "=..." is a formula, the cells get its value
+    if (isFormulaArg(ctx.argStr))
+        return setSelectedFormula(ctx.table, ctx.argStr);
+    // "==..." is the text "=..."
+    if (ctx.argStr[0] == '=')
+        return setSelectedCells(ctx.table, &ctx.argStr[1]);
+    return setSelectedCells(ctx.table, ctx.argStr);
+}
+
+State clear_cmd(Context ctx) {
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+    return setSelectedCells(ctx.table, "");
+}
+
+// Data commands
+
+// swaps selected cell with the cell specified by argument
+State swap_cmd(Context ctx) {
+    unsigned row, col;
+    State s = parseCoords(ctx.argStr, &row, &col);
+    if (s != SUCCESS)
+        return s;
+
+    Cell *c1 = getCellPtr(ctx.table, row, col);
+    Cell *c2 = selectedCell(ctx.table);
+
+    if (c1 == NULL)
+        return ERR_BAD_SYNTAX;
+
+    if (c2 == NULL)
+        return ERR_BAD_SELECTION;
+
+    return swapTableCells(ctx.table, row, col,
+        selUpperBound(ctx.table), selLeftBound(ctx.table));
+}
+
+State sum_cmd(Context ctx) {
+    unsigned row, col;
+    State s = parseCoords(ctx.argStr, &row, &col);
+    if (s != SUCCESS)
+        return s;
+
+    double sum;
+    unsigned count;
+    sumCountSelected(ctx.table, &sum, &count);
+
+    return writeTableCellDouble(ctx.table, row, col, sum);
+}
+
+State avg_cmd(Context ctx) {
+    unsigned row, col;
+    State s = parseCoords(ctx.argStr, &row, &col);
+    if (s != SUCCESS)
+        return s;
+
+    double sum;
+    unsigned count;
+    sumCountSelected(ctx.table, &sum, &count);
+
+    return writeTableCellDouble(ctx.table, row, col, sum / count);
+}
+
+State count_cmd(Context ctx) {
+    unsigned row, col;
+    State s = parseCoords(ctx.argStr, &row, &col);
+    if (s != SUCCESS)
+        return s;
+
+    unsigned count=0;
+
+    // go through every selected cell
+    SelectionIterator it;
+    iterator_init(&it, ctx.table);
+    while (iteratorNext(&it)) {
+        for (unsigned k=0; k < it.width; k++)
+            count += (it.cells[k].str[0] != '\0');
+    }
+    if (it.state != SUCCESS)
+        return it.state;
+    return writeTableCellUnsigned(ctx.table, row, col, count);
+}
+
+State len_cmd(Context ctx) {
+    unsigned row, col;
+    State s = parseCoords(ctx.argStr, &row, &col);
+    if (s != SUCCESS)
+        return s;
+
+    Cell *measuredCell = selectedCell(ctx.table);
+    if (measuredCell == NULL)
+        return ERR_BAD_SELECTION;
+    size_t len = strlen(measuredCell->str);
+
+    return writeTableCellUnsigned(ctx.table, row, col, len);
+}
+
+// adds a number to all the selected numbers
+State add_cmd(Context ctx) {
+    double operand;
+    State s = parseNumber(ctx.argStr, &operand);
+    if (s != SUCCESS)
+        return s;
+
+    return computeSelectedCells(ctx.table, operand, false);
+}
+
+// multiplies all the selected numbers
+State mul_cmd(Context ctx) {
+    double operand;
+    State s = parseNumber(ctx.argStr, &operand);
+    if (s != SUCCESS)
+        return s;
+
+    return computeSelectedCells(ctx.table, operand, true);
+}
+
+// fills the selection with a sequence: seq START STEP
+// numbers go in the row-major order
+State seq_cmd(Context ctx) {
+    char *space = strchr(ctx.argStr, ' ');
+    if (space == NULL)
+        return ERR_BAD_SYNTAX;
+
+    // split the argument into two numbers
+    char startStr[space - ctx.argStr + 1];
+    memcpy(startStr, ctx.argStr, space - ctx.argStr);
+    startStr[space - ctx.argStr] = '\0';
+
+    double start, step;
+    State s = parseNumber(startStr, &start);
+    if (s == SUCCESS)
+        s = parseNumber(space + 1, &step);
+    if (s != SUCCESS)
+        return s;
+
+    unsigned long n = 0;
+    SelectionIterator it;
+    iterator_init(&it, ctx.table);
+    while (iteratorNext(&it)) {
+        for (unsigned k=0; k < it.width; k++) {
+            cellWillChange(ctx.table, it.row, it.startCol + k);
+            s = writeCellDouble(&it.cells[k], start + n * step);
+            cellDidChange(ctx.table, it.row, it.startCol + k);
+            if (s != SUCCESS)
+                return s;
+            n++;
+        }
+    }
+    return it.state;
+}
+
+// writes contents of the cell from the argument into all the selected cells
+State fill_cmd(Context ctx) {
+    unsigned row, col;
+    State s = parseCoords(ctx.argStr, &row, &col);
+    if (s != SUCCESS)
+        return s;
+
+    Cell *src = getCellPtr(ctx.table, row, col);
+    if (src == NULL)
+        return ERR_BAD_SYNTAX;
+
+    // the source can be overwritten during the loop
+    char value[strlen(src->str) + 1];
+    strcpy(value, src->str);
+    return setSelectedCells(ctx.table, value);
+}
+
+// copies or moves the selection, so that its upper left corner is at [R,C]
+State copyMove(Context ctx, bool move) {
+    unsigned row, col;
+    State s = parseCoords(ctx.argStr, &row, &col);
+    if (s != SUCCESS)
+        return s;
+    if (row == 0)
+        return ERR_BAD_SYNTAX;
+
+    unsigned startRow = selUpperBound(ctx.table);
+    unsigned endRow = selLowerBound(ctx.table);
+    unsigned startCol = selLeftBound(ctx.table);
+    unsigned endCol = selRightBound(ctx.table);
+    if ((startRow > endRow) || (startCol > endCol))
+        return ERR_BAD_SELECTION;
+
+    return copyBlock(ctx.table, startRow, startCol, endRow, endCol, row, col, move);
+}
+
+State copy_cmd(Context ctx) {
+    return copyMove(ctx, false);
+}
+
+State move_cmd(Context ctx) {
+    return copyMove(ctx, true);
+}
+
+// Table commands
+
+// reads another table, that is only used for lookups
+State readLookupTable(Table *lookup, char *filename, char *delimiters) {
+    State s = openSource(&lookup->source, filename, true);
+    if (s == SUCCESS) {
+        statAdd(&stats.bytesRead, lookup->source.len);
+        s = readTable(lookup, lookup->source.data, delimiters, false);
+    }
+    if (s == SUCCESS)
+        s = stopReader(&lookup->source);
+    return s;
+}
+
+// parses a list of columns like 2,3,5 into cols
+// returns the number of columns, or 0 if the list is bad
+unsigned parseColumnList(char *str, unsigned *cols, unsigned maxCols) {
+    unsigned n = 0;
+    while (n < maxCols) {
+        char *endPtr;
+        unsigned long col = strtoul(str, &endPtr, 10);
+        if ((endPtr == str) || (col == 0) || (col > UINT_MAX) || (*str == '-'))
+            return 0;
+        cols[n++] = col;
+        if (*endPtr == '\0')
+            return n;
+        if (*endPtr != ',')
+            return 0;
+        str = endPtr + 1;
+    }
+    return 0;
+}
+
+// join FILE KEYCOL [VALCOLS]
+// the keys are in the first selected column, KEYCOL is where they are in FILE
+// values from VALCOLS of the first matching row in FILE go into new columns,
+// which are inserted after the selection; all the other columns are the default
+// empty keys never match
+State join_cmd(Context ctx) {
+    // the numbers are at the end, the name of the file can have spaces
+    char args[strlen(ctx.argStr) + 1];
+    strcpy(args, ctx.argStr);
+    char *last = strrchr(args, ' ');
+    if ((last == NULL) || (last == args))
+        return ERR_BAD_SYNTAX;
+    *last = '\0';
+    char *keyStr = last + 1;
+    char *valStr = NULL;
+    char *prev = strrchr(args, ' ');
+    if ((prev != NULL) && (prev != args) && (strspn(prev + 1, "0123456789") == strlen(prev + 1))) {
+        *prev = '\0';
+        valStr = keyStr;
+        keyStr = prev + 1;
+    }
+
+    unsigned keyCol;
+    if (parseColumnList(keyStr, &keyCol, 1) != 1)
+        return ERR_BAD_SYNTAX;
+    unsigned maxValCols = (valStr != NULL) ? strlen(valStr) / 2 + 1 : 1;
+    unsigned valCols[maxValCols];
+    unsigned numValCols = 0;
+    if (valStr != NULL) {
+        numValCols = parseColumnList(valStr, valCols, maxValCols);
+        if (numValCols == 0)
+            return ERR_BAD_SYNTAX;
+    }
+
+    Table lookup;
+    table_ctor(&lookup);
+    State s = readLookupTable(&lookup, args, ctx.table->delimiters);
+
+    // all the other columns, if they are not given
+    unsigned defaultCols[lookup.cols + 1];
+    if ((s == SUCCESS) && (valStr == NULL)) {
+        for (unsigned j=1; j <= lookup.cols; j++) {
+            if (j != keyCol)
+                defaultCols[numValCols++] = j;
+        }
+    }
+    unsigned *cols = (valStr != NULL) ? valCols : defaultCols;
+    if ((s == SUCCESS) && (keyCol > lookup.cols))
+        s = ERR_BAD_SYNTAX;
+    for (unsigned k=0; (s == SUCCESS) && (k < numValCols); k++) {
+        if (cols[k] > lookup.cols)
+            s = ERR_BAD_SYNTAX;
+    }
+
+    // the first occurrence of every key
+    HashMap index = {0};
+    if (s == SUCCESS)
+        s = hashmap_ctor(&index, lookup.rows);
+    for (unsigned i=1; (s == SUCCESS) && (i <= lookup.rows); i++) {
+        FindKey key = {.table=&lookup, .col=keyCol, .key=lookup.cells[i-1][keyCol-1].str};
+        if (key.key[0] == '\0')
+            continue;
+        size_t hash = hashString(key.key);
+        HashSlot *slot = hashmapFind(&index, hash, findKeyEquals, &key);
+        if (slot->value == 0)
+            s = hashmapInsert(&index, slot, hash, i);
+    }
+
+    // the bounds are taken before the new columns are there
+    SelectionIterator it;
+    iterator_init(&it, ctx.table);
+    if ((s == SUCCESS) && (it.width > 0) && (numValCols > 0)) {
+        s = assureTableSize(ctx.table, 0, it.endCol);
+        if (s == SUCCESS)
+            s = insertCols(ctx.table, it.endCol + 1, numValCols);
+    }
+
+    while ((s == SUCCESS) && (numValCols > 0) && iteratorNext(&it)) {
+        FindKey key = {.table=&lookup, .col=keyCol, .key=it.cells[0].str};
+        if (key.key[0] == '\0')
+            continue;
+        HashSlot *slot = hashmapFind(&index, hashString(key.key), findKeyEquals, &key);
+        if (slot->value == 0)
+            continue;
+
+        Cell *dst = &ctx.table->cells[it.row-1][it.endCol];
+        for (unsigned k=0; (s == SUCCESS) && (k < numValCols); k++) {
+            cellWillChange(ctx.table, it.row, it.endCol + 1 + k);
+            s = writeCell(&dst[k], lookup.cells[slot->value - 1][cols[k] - 1].str);
+            cellDidChange(ctx.table, it.row, it.endCol + 1 + k);
+        }
+    }
+    if (s == SUCCESS)
+        s = it.state;
+
+    hashmap_dtor(&index);
+    table_dtor(&lookup);
+    return s;
+}
+
+// groupby KEYCOL VALCOL sum|avg|count|min|max [R,C]
+// aggregates the selected rows, one row per key goes to [R,C]
+// or under the table, if there are no coordinates
+State groupby_cmd(Context ctx) {
+    const char *names[] = {
+        [AGG_SUM] = "sum", [AGG_AVG] = "avg", [AGG_COUNT] = "count",
+        [AGG_MIN] = "min", [AGG_MAX] = "max",
+    };
+
+    char *str = ctx.argStr;
+    char *endPtr;
+    long keyCol = strtol(str, &endPtr, 10);
+    if ((endPtr == str) || (keyCol < 1) || (*endPtr != ' '))
+        return ERR_BAD_SYNTAX;
+    str = endPtr + 1;
+    long valCol = strtol(str, &endPtr, 10);
+    if ((endPtr == str) || (valCol < 1) || (*endPtr != ' '))
+        return ERR_BAD_SYNTAX;
+    str = endPtr + 1;
+
+    int agg = -1;
+    for (int i=0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        size_t len = strlen(names[i]);
+        if ((strncmp(str, names[i], len) == 0) && (str[len] == ' ' || str[len] == '\0')) {
+            agg = i;
+            str += len;
+            break;
+        }
+    }
+    if (agg < 0)
+        return ERR_BAD_SYNTAX;
+
+    unsigned startRow = selUpperBound(ctx.table);
+    unsigned endRow = selLowerBound(ctx.table);
+    if (startRow > endRow)
+        return ERR_BAD_SELECTION;
+
+    unsigned dstRow = ctx.table->rows + 1;
+    unsigned dstCol = 1;
+    if (*str == ' ') {
+        State s = parseCoords(str + 1, &dstRow, &dstCol);
+        if (s != SUCCESS)
+            return s;
+    } else if (endRow > ctx.table->rows) {
+        // the selection goes under the table, the results go under the selection
+        dstRow = endRow + 1;
+    }
+
+    return groupRows(ctx.table, startRow, endRow, keyCol, valCol, agg, dstRow, dstCol);
+}
+
+// uniq [COLS]
+// removes the selected rows, that repeat an earlier selected row in COLS,
+// which are the selected columns by default
+State uniq_cmd(Context ctx) {
+    // the name of the command has no space, it can have no argument
+    char *args = ctx.argStr;
+    if (*args == ' ')
+        args++;
+    else if (*args != '\0')
+        return ERR_BAD_SYNTAX;
+
+    unsigned startRow = selUpperBound(ctx.table);
+    unsigned endRow = selLowerBound(ctx.table);
+    unsigned startCol = selLeftBound(ctx.table);
+    unsigned endCol = selRightBound(ctx.table);
+    if ((startRow > endRow) || (startCol > endCol))
+        return ERR_BAD_SELECTION;
+
+    unsigned maxCols = (args[0] != '\0') ? strlen(args) / 2 + 1 : endCol - startCol + 1;
+    unsigned cols[maxCols];
+    unsigned numCols = 0;
+    if (args[0] != '\0') {
+        numCols = parseColumnList(args, cols, maxCols);
+        if (numCols == 0)
+            return ERR_BAD_SYNTAX;
+    } else {
+        for (unsigned j=startCol; j <= endCol; j++)
+            cols[numCols++] = j;
+    }
+    State s = uniqueRows(ctx.table, startRow, endRow, cols, numCols);
+    if (s != SUCCESS)
+        return s;
+    return maybeCompact(ctx.table);
+}
+
+// releases the memory of deleted rows and columns right away
+State compact_cmd(Context ctx) {
+    if (ctx.argStr[0] != '\0')
+        return ERR_BAD_SYNTAX;
+    return compactTable(ctx.table);
+}
+
+// distinct COL [R,C]
+// writes every value from COL of the selected rows once, in the order of first appearance,
+// into the rows from [R,C], or under the table if there are no coordinates
+State distinct_cmd(Context ctx) {
+    char *endPtr;
+    long col = strtol(ctx.argStr, &endPtr, 10);
+    if ((endPtr == ctx.argStr) || (col < 1))
+        return ERR_BAD_SYNTAX;
+
+    unsigned startRow = selUpperBound(ctx.table);
+    unsigned endRow = selLowerBound(ctx.table);
+    if (startRow > endRow)
+        return ERR_BAD_SELECTION;
+
+    unsigned dstRow = (endRow > ctx.table->rows) ? endRow + 1 : ctx.table->rows + 1;
+    unsigned dstCol = 1;
+    if (*endPtr == ' ') {
+        State s = parseCoords(endPtr + 1, &dstRow, &dstCol);
+        if (s != SUCCESS)
+            return s;
+    } else if (*endPtr != '\0') {
+        return ERR_BAD_SYNTAX;
+    }
+
+    return groupRows(ctx.table, startRow, endRow, col, col, AGG_NONE, dstRow, dstCol);
+}
+
+// Variable commands
+
+State def_cmd(Context ctx) {
+    int n = ctx.argStr[0] - '0';
+    if ((ctx.argStr[1] != '\0') || (n < 0) || (n > 9))
+        return ERR_BAD_SYNTAX;
+
+    Cell *src = selectedCell(ctx.table);
+    if (src == NULL)
+        return ERR_BAD_SELECTION;
+    setVariableString(&ctx.vars->values[n], src->str);
+
+    return SUCCESS;
+}
+
+State use_cmd(Context ctx) {
+    int n = ctx.argStr[0] - '0';
+    if ((ctx.argStr[1] != '\0') || (n < 0) || (n > 9))
+        return ERR_BAD_SYNTAX;
+
+    char buffer[MAX_NUMBER_LENGTH];
+    return setSelectedCells(ctx.table, variableString(&ctx.vars->values[n], buffer));
+}
+
+State inc_cmd(Context ctx) {
+    int n = ctx.argStr[0] - '0';
+    if ((ctx.argStr[1] != '\0') || (n < 0) || (n > 9))
+        return ERR_BAD_SYNTAX;
+
+    // variable to increment
+    Variable *var = &ctx.vars->values[n];
+
+    double value = var->isNumber ? var->num : cellToDouble(&var->cell);
+
+    if (isnan(value))
+        value = 0;
+
+    setVariableNumber(var, value + 1);
+    return SUCCESS;
+}
+
+// Control commands
+
+State goto_cmd(Context ctx) {
+    char *endPtr;
+    int steps = strtol(ctx.argStr, &endPtr, 10);
+
+    if (*endPtr != '\0')
+        return ERR_BAD_SYNTAX;
+
+    // goto +1 should have no effect
+    *ctx.execPtr += steps - 1;
+    return SUCCESS;
+}
+
+State iszero_cmd(Context ctx) {
+    int n = ctx.argStr[0] - '0';
+    if ((ctx.argStr[1] != ' ') || (n < 0) || (n > 9))
+        return ERR_BAD_SYNTAX;
+
+    // points at varible that needs to be checked
+    Variable *var = &ctx.vars->values[n];
+
+    char *endPtr;
+    long steps = strtol(&ctx.argStr[2], &endPtr, 10);
+    if (*endPtr != '\0')
+        return ERR_BAD_SYNTAX;
+
+    // -0 is not printed as "0"
+    bool zero;
+    if (var->isNumber)
+        zero = (var->num == 0) && !signbit(var->num);
+    else
+        zero = (strcmp(var->cell.str, "0") == 0);
+
+    if (zero)
+        *ctx.execPtr += steps - 1;
+
+    return SUCCESS;
+}
+
+State sub_cmd(Context ctx) {
+    int m = ctx.argStr[0] - '0';
+    int n = ctx.argStr[3] - '0';
+    // not robust at all but whatever
+    if ((m < 0) || (m > 9) || (n < 0) || (n > 9))
+        return ERR_BAD_SYNTAX;
+
+    double toSubtract, value;
+    State s = variableOperand(&ctx.vars->values[n], &toSubtract);
+    if (s != SUCCESS)
+        return s;
+
+    s = variableOperand(&ctx.vars->values[m], &value);
+    if (s != SUCCESS)
+        return s;
+
+    setVariableNumber(&ctx.vars->values[m], value - toSubtract);
+    return SUCCESS;
+}
+
+// ---------- MORE COMPLEX FUNCTIONS -----------
+
+// checks if the row would be printed exactly as it is in the input
+// (no quotes, no escapes and only the main delimiter)
+bool isCanonicalRow(char *str, size_t len, char *delimiters) {
+    for (size_t i=0; i < len; i++) {
+        char c = str[i];
+        if (c == '\"' || c == '\\')
+            return false;
+        if (c != delimiters[0] && strchr(&delimiters[1], c) && c != '\0')
+            return false;
+    }
+    return true;
+}
+
+// checks the row, that ends with '\n', just like readTable would read it
+// cells gets the number of cells in the row
+State scanRow(char *str, size_t len, char *delimiters, bool canonical, unsigned *cells) {
+    *cells = 1;
+    // only delimiters have to be counted
+    if (canonical) {
+        for (size_t i=0; i < len; i++) {
+            if (str[i] == delimiters[0])
+                (*cells)++;
+        }
+        return SUCCESS;
+    }
+
+    size_t i = 0;
+    while (true) {
+        char cellBuffer[MAX_CELL_LENGTH];
+        i += parseString(cellBuffer, &str[i], delimiters) + 1;
+        if (str[i-1] == '\n')
+            return SUCCESS;
+        if (str[i-1] == '\0' || !strchr(delimiters, str[i-1]))
+            return ERR_BAD_INPUT;
+        (*cells)++;
+    }
+}
+
+// ---------- BACKGROUND READING -----------
+// big files are read in blocks by another thread, while the rows are parsed
+// the blocks go into one buffer, because the rows point into it until the table is saved
+
+#define READ_BLOCK_SIZE (1 << 20)
+#define BACKGROUND_READ_MIN (4 * READ_BLOCK_SIZE)
+
+void *readerRun(void *arg) {
+    Source *source = arg;
+    size_t filled = 0;
+    bool failed = false;
+
+    while (filled < source->len) {
+        size_t len = source->len - filled;
+        if (len > READ_BLOCK_SIZE)
+            len = READ_BLOCK_SIZE;
+        ssize_t n = pread(source->fd, &source->data[filled], len, filled);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // the file got shorter since it was opened
+        if (n <= 0) {
+            failed = true;
+            break;
+        }
+        filled += n;
+
+        pthread_mutex_lock(&source->lock);
+        source->filled = filled;
+        bool stop = source->stop;
+        pthread_cond_signal(&source->moved);
+        pthread_mutex_unlock(&source->lock);
+        if (stop)
+            break;
+    }
+
+    pthread_mutex_lock(&source->lock);
+    source->done = true;
+    source->failed = failed;
+    pthread_cond_signal(&source->moved);
+    pthread_mutex_unlock(&source->lock);
+    return NULL;
+}
+
+// checks, if most of the file is in the page cache already
+// mapping it is faster then, there is nothing to wait for
+bool isFileCached(int fd, size_t len) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t pages = (len + pageSize - 1) / pageSize;
+    void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+
+    unsigned char *resident = statMalloc(ALLOC_IO, pages);
+    size_t count = 0;
+    if (resident != NULL && mincore(p, len, resident) == 0) {
+        for (size_t i=0; i < pages; i++)
+            count += resident[i] & 1;
+    }
+    statFree(ALLOC_IO, resident);
+    munmap(p, len);
+    return count >= pages - pages / 10;
+}
+
+// starts reading the file into the already allocated data
+State startReader(Source *source) {
+    source->filled = 0;
+    source->done = false;
+    source->failed = false;
+    source->stop = false;
+    pthread_mutex_init(&source->lock, NULL);
+    pthread_cond_init(&source->moved, NULL);
+
+    if (pthread_create(&source->reader, NULL, readerRun, source) == 0) {
+        source->reading = true;
+        return SUCCESS;
+    }
+    // without the thread, the file is read right away
+    readerRun(source);
+    pthread_mutex_destroy(&source->lock);
+    pthread_cond_destroy(&source->moved);
+    return source->failed ? ERR_FILE_ACCESS : SUCCESS;
+}
+
+// waits for the reader thread to end, the data may not be complete
+State stopReader(Source *source) {
+    if (!source->reading)
+        return SUCCESS;
+
+    pthread_mutex_lock(&source->lock);
+    source->stop = true;
+    pthread_mutex_unlock(&source->lock);
+    pthread_join(source->reader, NULL);
+    pthread_mutex_destroy(&source->lock);
+    pthread_cond_destroy(&source->moved);
+    source->reading = false;
+    return source->failed ? ERR_FILE_ACCESS : SUCCESS;
+}
+
+// waits, until there is a whole row from the offset, or the whole file is read
+// ready is set to the end of the last whole row, that can be parsed
+State waitForRows(Source *source, size_t offset, size_t *ready) {
+    // rows can span many blocks, every byte is searched only once
+    size_t scanned = offset;
+
+    pthread_mutex_lock(&source->lock);
+    while (true) {
+        size_t filled = source->filled;
+        bool done = source->done;
+        bool failed = source->failed;
+        pthread_mutex_unlock(&source->lock);
+        if (failed)
+            return ERR_FILE_ACCESS;
+
+        char *last = memrchr(&source->data[scanned], '\n', filled - scanned);
+        if (last != NULL) {
+            *ready = last - source->data + 1;
+            return SUCCESS;
+        }
+        // the last row does not have to end with '\n'
+        if (done) {
+            *ready = filled;
+            return SUCCESS;
+        }
+        scanned = filled;
+
+        pthread_mutex_lock(&source->lock);
+        while (source->filled == filled && !source->done)
+            pthread_cond_wait(&source->moved, &source->lock);
+    }
+}
+
+// Reads table from the buffer and saves it into the table structure
+// The function also reads delimiters from arguments
+// Returns program state
+// Expects an empty table
+// lazy tables have only rows checked, the cells are read when they are needed
+// and the buffer must stay until the table is destructed
+State readTable(Table *table, char *fileBuffer, char *delimiters, bool lazy) {
+    // set the table's main delimiter
+    table->delim = delimiters[0];
+    table->delimiters = delimiters;
+
+    State s = SUCCESS;
+    // current row and column
+    unsigned row=0, col=0;
+    size_t i = 0;
+    // where the current row begins
+    size_t rowStart = 0;
+    // the rows up to here are read from the file
+    size_t ready = table->source.reading ? 0 : SIZE_MAX;
+
+    while (true) {
+        if (col == 0 && i >= ready) {
+            s = waitForRows(&table->source, i, &ready);
+            if (s != SUCCESS)
+                return s;
+        }
+
+        // the last row without '\n' is always read right away
+        char *end = (lazy && col == 0) ? strchr(&fileBuffer[i], '\n') : NULL;
+        if (end != NULL) {
+            size_t len = end - &fileBuffer[i] + 1;
+            RowInfo info = {.offset=i, .length=len};
+            info.dirty = !isCanonicalRow(&fileBuffer[i], len, delimiters);
+            s = scanRow(&fileBuffer[i], len, delimiters, !info.dirty, &info.cells);
+            if (s == SUCCESS)
+                s = addLazyRow(table, &info);
+            if (s != SUCCESS)
+                return s;
+
+            i += len;
+            rowStart = i;
+            row++;
+            continue;
+        }
+
+        char cellBuffer[MAX_CELL_LENGTH];
+        size_t shift = parseString(cellBuffer, &fileBuffer[i], delimiters);
+        // +1 to skip the delimiter
+        i += shift + 1;
+
+        // if there is nothing left
+        if (fileBuffer[i-1] == '\0')
+            break;
+
+        // write to table
+        s = assureTableSize(table, row+1, col+1);
+        if (s != SUCCESS)
+            return s;
+
+        s = writeCell(&table->cells[row][col], cellBuffer);
+        if (s != SUCCESS)
+            return s;
+
+        if (fileBuffer[i-1] == '\n') {
+            // remember, where the row is in the input
+            RowInfo *info = &table->rowInfo[row];
+            info->offset = rowStart;
+            info->length = i - rowStart;
+            info->cells = col + 1;
+            info->dirty = !isCanonicalRow(&fileBuffer[rowStart], i - rowStart, delimiters);
+            rowStart = i;
+
+            row++;
+            col = 0;
+            continue;
+        }
+
+        if (strchr(delimiters, fileBuffer[i-1])) {
+            col++;
+            continue;
+        }
+        // if nothing matches, the scanned STR was bad
+        return ERR_BAD_INPUT;
+    }
+    return SUCCESS;
+}
+
+// releases the input file
+void closeSource(Source *source) {
+    stopReader(source);
+    if (source->mapLen != 0)
+        munmap(source->data, source->mapLen);
+    else
+        statFree(ALLOC_IO, source->data);
+    if (source->fd >= 0)
+        close(source->fd);
+
+    source->data = NULL;
+    source->len = 0;
+    source->mapLen = 0;
+    source->fd = -1;
+}
+
+// opens the input file and maps it into memory
+// the data are always terminated by '\0'
+// if background is set, big files are read by another thread instead, see readTable
+State openSource(Source *source, char *filename, bool background) {
+    source->fd = open(filename, O_RDONLY);
+    if (source->fd < 0)
+        return ERR_FILE_ACCESS;
+
+    struct stat st;
+    if (fstat(source->fd, &st) != 0)
+        return ERR_FILE_ACCESS;
+
+    // files, that can't be mapped, are read the old way
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        FILE *f = fdopen(dup(source->fd), "r");
+        if (f == NULL)
+            return ERR_FILE_ACCESS;
+        source->data = fileToBuffer(f);
+        fclose(f);
+        if (source->data == NULL)
+            return ERR_MEMORY;
+        source->len = strlen(source->data);
+        return SUCCESS;
+    }
+
+    // one more zeroed page after the file works as the terminating '\0'
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    source->len = st.st_size;
+    size_t mapLen = (source->len / pageSize + 1) * pageSize;
+    background = background && (source->len >= BACKGROUND_READ_MIN)
+        && !isFileCached(source->fd, source->len);
+    int prot = background ? PROT_READ | PROT_WRITE : PROT_READ;
+    char *p = mmap(NULL, mapLen, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return ERR_MEMORY;
+    source->data = p;
+    source->mapLen = mapLen;
+    if (background)
+        return startReader(source);
+
+    p = mmap(p, source->len, PROT_READ, MAP_PRIVATE | MAP_FIXED, source->fd, 0);
+    if (p == MAP_FAILED)
+        return ERR_FILE_ACCESS;
+    madvise(source->data, source->len, MADV_SEQUENTIAL);
+    return SUCCESS;
+}
+
+
+// prints first cols cells of one row of the table into a file, user coordinates
+// returns number of printed characters
+size_t printRow(Table *table, unsigned row, unsigned cols, FILE *f) {
+    size_t len = 0;
+    if (materializeRow(table, row) != SUCCESS)
+        return 0;
+    for (unsigned j=0; j < cols; j++) {
+        len += printCell(table, &table->cells[row-1][j], f) + 1;
+
+        if (j < cols - 1)
+            fputc(table->delim, f);
+        else
+            fputc('\n', f);
+    }
+    return len;
+}
+
+// prints the table into a file
+void printTable(Table *table, FILE *f) {
+    for (unsigned i=1; i <= table->rows; i++) {
+        printRow(table, i, table->cols, f);
+    }
+}
+
+// copies a part of the input into the output file
+State copySource(Source *source, size_t offset, size_t len, FILE *f) {
+    // long parts are copied by the kernel, without going through the memory
+    if (len >= COPY_RANGE_THRESHOLD && source->fd >= 0) {
+        fflush(f);
+        loff_t inOffset = offset;
+        while (len > 0) {
+            ssize_t copied = copy_file_range(source->fd, &inOffset,
+                fileno(f), NULL, len, 0);
+            // not supported for these files, let the memory copy do the rest
+            if (copied <= 0)
+                break;
+            len -= copied;
+        }
+        offset = inOffset;
+    }
+
+    if (len > 0 && fwrite(&source->data[offset], 1, len, f) != len)
+        return ERR_FILE_ACCESS;
+    return SUCCESS;
+}
+
+// can the row be copied from the input as it is, when cols cells are printed
+bool isRowClean(Table *table, unsigned row, unsigned cols) {
+    RowInfo *info = &table->rowInfo[row-1];
+    return !table->allRowsDirty && !info->dirty
+        && (info->cells == cols) && (table->source.data != NULL);
+}
+
+// checks if the row was not read and can be printed straight from the source
+// with some empty cells at the end
+bool isRowPaddable(Table *table, unsigned row, unsigned cols) {
+    RowInfo *info = &table->rowInfo[row-1];
+    return table->cells[row-1] == NULL && !table->allRowsDirty && !info->dirty
+        && info->cells < cols && table->source.data != NULL;
+}
+
+// checks if a printed row would be read back into the same cells
+bool isRowPrintable(Table *table, unsigned row, unsigned cols, char *delimiters) {
+    for (unsigned j=0; j < cols; j++) {
+        char *str = table->cells[row-1][j].str;
+        if (strpbrk(str, "\\\"") || strpbrk(str, &delimiters[1]))
+            return false;
+    }
+    return true;
+}
+
+// prints first cols columns of the table into the file, the table stays as it is
+// unchanged rows are copied from the input, neighbouring ones all at once
+// if newInfo is not NULL, it gets information about rows in the new file
+State writeTable(Table *table, unsigned cols, FILE *f, RowInfo *newInfo, char *delimiters) {
+    State s = SUCCESS;
+    // part of the input, that is waiting to be copied
+    size_t copyStart = 0;
+    size_t copyLen = 0;
+    // position in the output
+    size_t position = 0;
+
+    for (unsigned i=1; i <= table->rows && s == SUCCESS; i++) {
+        if (isRowClean(table, i, cols)) {
+            RowInfo *info = &table->rowInfo[i-1];
+            if (newInfo != NULL) {
+                newInfo[i-1] = (RowInfo){.offset=position, .length=info->length,
+                    .cells=info->cells, .dirty=false};
+            }
+            position += info->length;
+            // the row follows the waiting part
+            if (copyLen > 0 && copyStart + copyLen == info->offset) {
+                copyLen += info->length;
+                continue;
+            }
+            if (copyLen > 0)
+                s = copySource(&table->source, copyStart, copyLen, f);
+            copyStart = info->offset;
+            copyLen = info->length;
+            continue;
+        }
+
+        if (copyLen > 0) {
+            s = copySource(&table->source, copyStart, copyLen, f);
+            copyLen = 0;
+        }
+        if (s != SUCCESS)
+            break;
+
+        // untouched row, that is only narrower than the table
+        if (isRowPaddable(table, i, cols)) {
+            RowInfo *info = &table->rowInfo[i-1];
+            s = copySource(&table->source, info->offset, info->length - 1, f);
+            for (unsigned j=info->cells; j < cols; j++)
+                fputc(table->delim, f);
+            fputc('\n', f);
+
+            size_t len = info->length + cols - info->cells;
+            if (newInfo != NULL)
+                newInfo[i-1] = (RowInfo){.offset=position, .length=len, .cells=cols};
+            position += len;
+            continue;
+        }
+
+        s = materializeRow(table, i);
+        if (s != SUCCESS)
+            break;
+        size_t len = printRow(table, i, cols, f);
+        if (newInfo != NULL) {
+            newInfo[i-1] = (RowInfo){.offset=position, .length=len, .cells=cols,
+                .dirty=!isRowPrintable(table, i, cols, delimiters)};
+        }
+        position += len;
+    }
+    if (s == SUCCESS && copyLen > 0)
+        s = copySource(&table->source, copyStart, copyLen, f);
+    statAdd(&stats.bytesWritten, position);
+    return s;
+}
+
+// checks if first cols columns of the table would be saved exactly as they were loaded
+bool isTableUnchanged(Table *table, unsigned cols) {
+    size_t position = 0;
+    for (unsigned i=1; i <= table->rows; i++) {
+        if (!isRowClean(table, i, cols) || table->rowInfo[i-1].offset != position)
+            return false;
+        position += table->rowInfo[i-1].length;
+    }
+    return position == table->source.len;
+}
+
+// saves first cols columns of the table into the file
+// the table is written into a temporary file, that replaces the original
+// if newInfo is not NULL, it gets information about rows in the new file
+// written gets the size of the new file, rows appended after the rename are not part of it
+State writeTableFile(Table *table, unsigned cols, char *filename, RowInfo *newInfo,
+    char *delimiters, size_t *written) {
+    // the link itself must not be replaced
+    char *target = realpath(filename, NULL);
+    if (target == NULL)
+        return ERR_FILE_ACCESS;
+
+    char tmpName[strlen(target) + sizeof(".XXXXXX")];
+    sprintf(tmpName, "%s.XXXXXX", target);
+    int fd = mkstemp(tmpName);
+    if (fd < 0) {
+        free(target);
+        return ERR_FILE_ACCESS;
+    }
+
+    // keep the permissions of the original file
+    struct stat st;
+    if (stat(target, &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+
+    State s = SUCCESS;
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        s = ERR_FILE_ACCESS;
+    }
+    if (s == SUCCESS)
+        s = writeTable(table, cols, f, newInfo, delimiters);
+    // some parts could be copied by the kernel, only the file knows its size
+    if (s == SUCCESS && (fflush(f) != 0 || fstat(fd, &st) != 0))
+        s = ERR_FILE_ACCESS;
+    if (s == SUCCESS)
+        *written = st.st_size;
+    if (f != NULL && fclose(f) != 0)
+        s = ERR_FILE_ACCESS;
+    if (s == SUCCESS && rename(tmpName, target) != 0)
+        s = ERR_FILE_ACCESS;
+    if (s != SUCCESS)
+        unlink(tmpName);
+
+    free(target);
+    return s;
+}
+
+// ---------- SNAPSHOT FUNCTIONS -----------
+// snapshot is a binary image of the parsed table saved next to it
+// it is mapped directly into memory, cells borrow their strings from it
+// layout: header, RowInfo of every row, offset of every cell, string heap
+
+#define SNAPSHOT_MAGIC "SPSSNAP1"
+// the table is hashed through a buffer of this size
+#define SNAPSHOT_HASH_BUFFER 65536
+
+typedef struct {
+    char magic[8];
+    // the table file, that the snapshot belongs to
+    unsigned long long srcSize;
+    long long srcMtimeSec;
+    long long srcMtimeNsec;
+    unsigned long long srcHash;
+    // delimiters the table was read with
+    char delimiters[32];
+    unsigned rows, cols;
+    unsigned long long heapLen;
+} SnapshotHeader;
+
+// hash of the whole file
+// together with the size and mtime it tells if the file has changed,
+// an edit, that keeps both of them, changes the hash
+unsigned long long fileHash(int fd) {
+    char buffer[SNAPSHOT_HASH_BUFFER];
+    unsigned long long hash = 14695981039346656037ULL;
+
+    ssize_t len;
+    for (off_t offset=0; (len = pread(fd, buffer, sizeof(buffer), offset)) > 0; offset += len) {
+        for (ssize_t j=0; j < len; j++) {
+            hash ^= (unsigned char)buffer[j];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// fills the header fields, that describe the table file
+State snapshotDescribeSource(SnapshotHeader *header, int fd, char *delimiters) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return ERR_FILE_ACCESS;
+    if (strlen(delimiters) >= sizeof(header->delimiters))
+        return ERR_GENERIC;
+
+    memset(header, 0, sizeof(SnapshotHeader));
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->srcSize = st.st_size;
+    header->srcMtimeSec = st.st_mtim.tv_sec;
+    header->srcMtimeNsec = st.st_mtim.tv_nsec;
+    header->srcHash = fileHash(fd);
+    strcpy(header->delimiters, delimiters);
+    return SUCCESS;
+}
+
+// loads the table from its snapshot
+// returns SUCCESS only if the snapshot exists and is up to date
+State loadSnapshot(Table *table, char *filename, char *delimiters) {
+    SnapshotHeader expected;
+    State s = snapshotDescribeSource(&expected, table->source.fd, delimiters);
+    if (s != SUCCESS)
+        return s;
+
+    char snapName[strlen(filename) + sizeof(SNAPSHOT_SUFFIX)];
+    sprintf(snapName, "%s%s", filename, SNAPSHOT_SUFFIX);
+    int fd = open(snapName, O_RDONLY);
+    if (fd < 0)
+        return ERR_FILE_ACCESS;
+
+    struct stat st;
+    char *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SnapshotHeader))
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return ERR_FILE_ACCESS;
+
+    SnapshotHeader *header = (SnapshotHeader *)data;
+    size_t len = st.st_size;
+    size_t numCells = (size_t)header->rows * header->cols;
+    size_t rowsStart = sizeof(SnapshotHeader);
+    size_t cellsStart = rowsStart + header->rows * sizeof(RowInfo);
+    size_t heapStart = cellsStart + numCells * sizeof(unsigned long long);
+
+    // everything, that says the snapshot is for this very file
+    bool valid = memcmp(header->magic, expected.magic, sizeof(header->magic)) == 0
+        && header->srcSize == expected.srcSize
+        && header->srcMtimeSec == expected.srcMtimeSec
+        && header->srcMtimeNsec == expected.srcMtimeNsec
+        && header->srcHash == expected.srcHash
+        && strcmp(header->delimiters, expected.delimiters) == 0
+        && heapStart + header->heapLen == len
+        && header->heapLen > 0
+        && data[len - 1] == '\0';
+    if (!valid) {
+        munmap(data, len);
+        return ERR_GENERIC;
+    }
+
+    table->snapshot = data;
+    table->snapshotLen = len;
+    table->delim = delimiters[0];
+    table->delimiters = delimiters;
+
+    // rows are made empty and then pointed into the snapshot
+    RowInfo *rowInfo = (RowInfo *)&data[rowsStart];
+    unsigned long long *offsets = (unsigned long long *)&data[cellsStart];
+    char *heap = &data[heapStart];
+    s = assureTableSize(table, header->rows, header->cols);
+
+    for (unsigned i=0; i < table->rows && s == SUCCESS; i++) {
+        table->rowInfo[i] = rowInfo[i];
+        for (unsigned j=0; j < table->cols; j++) {
+            unsigned long long offset = offsets[(size_t)i * table->cols + j];
+            if (offset >= header->heapLen) {
+                s = ERR_BAD_INPUT;
+                break;
+            }
+            Cell *cell = &table->cells[i][j];
+            cell_dtor(cell);
+            cell->str = &heap[offset];
+            cell->borrowed = true;
+        }
+    }
+    return s;
+}
+
+// for deduplication of strings in the snapshot heap
+typedef struct {
+    char **strings;
+    const char *key;
+} HeapKey;
+
+bool heapKeyEquals(void *ctx, unsigned value) {
+    HeapKey *key = ctx;
+    return strcmp(key->strings[value-1], key->key) == 0;
+}
+
+// writes the snapshot of first cols columns of the table, that were just saved into the file
+// rowInfo describes rows in the saved file
+State writeSnapshot(Table *table, unsigned cols, char *filename, char *delimiters, RowInfo *rowInfo) {
+    int srcFd = open(filename, O_RDONLY);
+    if (srcFd < 0)
+        return ERR_FILE_ACCESS;
+    SnapshotHeader header;
+    State s = snapshotDescribeSource(&header, srcFd, delimiters);
+    close(srcFd);
+    if (s != SUCCESS)
+        return s;
+
+    // the snapshot has all the cells
+    s = materializeRows(table, 1, table->rows);
+    if (s != SUCCESS)
+        return s;
+
+    header.rows = table->rows;
+    header.cols = cols;
+    size_t numCells = (size_t)table->rows * cols;
+
+    // same strings are in the heap only once
+    unsigned long long *offsets = statMalloc(ALLOC_IO, (numCells + 1) * sizeof(unsigned long long));
+    char **strings = statMalloc(ALLOC_IO, (numCells + 1) * sizeof(char *));
+    unsigned long long *stringOffsets = statMalloc(ALLOC_IO, (numCells + 1) * sizeof(unsigned long long));
+    HashMap unique;
+    s = hashmap_ctor(&unique, numCells);
+    if (!offsets || !strings || !stringOffsets)
+        s = ERR_MEMORY;
+
+    unsigned numStrings = 0;
+    header.heapLen = 0;
+    for (unsigned i=0; i < table->rows && s == SUCCESS; i++) {
+        for (unsigned j=0; j < cols && s == SUCCESS; j++) {
+            HeapKey key = {.strings=strings, .key=table->cells[i][j].str};
+            size_t hash = hashString(key.key);
+            HashSlot *slot = hashmapFind(&unique, hash, heapKeyEquals, &key);
+            if (slot->value == 0) {
+                strings[numStrings] = table->cells[i][j].str;
+                stringOffsets[numStrings] = header.heapLen;
+                header.heapLen += strlen(key.key) + 1;
+                s = hashmapInsert(&unique, slot, hash, ++numStrings);
+                if (s != SUCCESS)
+                    break;
+                slot = hashmapFind(&unique, hash, heapKeyEquals, &key);
+            }
+            offsets[(size_t)i * cols + j] = stringOffsets[slot->value - 1];
+        }
+    }
+    // the heap is never empty, so it always ends with '\0'
+    if (s == SUCCESS && numStrings == 0) {
+        strings[numStrings++] = "";
+        header.heapLen = 1;
+    }
+
+    char snapName[strlen(filename) + sizeof(SNAPSHOT_SUFFIX) + sizeof(".XXXXXX")];
+    sprintf(snapName, "%s%s.XXXXXX", filename, SNAPSHOT_SUFFIX);
+    int fd = -1;
+    FILE *f = NULL;
+    if (s == SUCCESS) {
+        fd = mkstemp(snapName);
+        if (fd >= 0)
+            f = fdopen(fd, "w");
+        if (f == NULL)
+            s = ERR_FILE_ACCESS;
+    }
+    if (s == SUCCESS) {
+        fwrite(&header, sizeof(header), 1, f);
+        fwrite(rowInfo, sizeof(RowInfo), table->rows, f);
+        fwrite(offsets, sizeof(unsigned long long), numCells, f);
+        for (unsigned i=0; i < numStrings; i++)
+            fwrite(strings[i], 1, strlen(strings[i]) + 1, f);
+        statAdd(&stats.bytesWritten, sizeof(header) + table->rows * sizeof(RowInfo)
+            + numCells * sizeof(unsigned long long) + header.heapLen);
+        if (ferror(f))
+            s = ERR_FILE_ACCESS;
+    }
+    if (f != NULL && fclose(f) != 0)
+        s = ERR_FILE_ACCESS;
+    if (f == NULL && fd >= 0)
+        close(fd);
+
+    if (fd >= 0) {
+        char finalName[strlen(filename) + sizeof(SNAPSHOT_SUFFIX)];
+        sprintf(finalName, "%s%s", filename, SNAPSHOT_SUFFIX);
+        if (s == SUCCESS && rename(snapName, finalName) != 0)
+            s = ERR_FILE_ACCESS;
+        if (s != SUCCESS)
+            unlink(snapName);
+    }
+
+    hashmap_dtor(&unique);
+    statFree(ALLOC_IO, offsets);
+    statFree(ALLOC_IO, strings);
+    statFree(ALLOC_IO, stringOffsets);
+    return s;
+}
+
+// reads the table from the file
+// the file stays open, until the table is saved or destructed
+State loadTable(Table *table, char *filename, Arguments *args) {
+    // the file is not read in the background, if the snapshot may be used instead
+    State s = openSource(&table->source, filename, !args->cache);
+    if (s != SUCCESS)
+        return s;
+
+    // snapshot is the fastest way, if it is up to date
+    if (args->cache && table->source.mapLen != 0) {
+        if (loadSnapshot(table, filename, args->delimiters) == SUCCESS) {
+            statAdd(&stats.bytesRead, table->snapshotLen);
+            return SUCCESS;
+        }
+        // start again with an empty table
+        table_dtor(table);
+        table_ctor(table);
+        s = openSource(&table->source, filename, true);
+        if (s != SUCCESS)
+            return s;
+    }
+
+    statAdd(&stats.bytesRead, table->source.len);
+    s = readTable(table, table->source.data, args->delimiters, args->lazy);
+    if (s != SUCCESS)
+        return s;
+    return stopReader(&table->source);
+}
+
+// saves first cols columns of the table into the file, it is not touched if nothing has changed
+// the snapshot is written too, if it is wanted
+// if saved is not NULL, it gets the size of the file, as it was saved or loaded
+State saveTable(Table *table, unsigned cols, char *filename, Arguments *args, size_t *saved) {
+    bool unchanged = isTableUnchanged(table, cols);
+    size_t written = table->source.len;
+    if (saved != NULL)
+        *saved = written;
+    if (unchanged && (!args->cache || table->snapshot != NULL))
+        return SUCCESS;
+
+    RowInfo *newInfo = NULL;
+    if (args->cache) {
+        newInfo = statMalloc(ALLOC_ROWS, (table->rows + 1) * sizeof(RowInfo));
+        if (newInfo == NULL)
+            return ERR_MEMORY;
+    }
+
+    State s = SUCCESS;
+    if (!unchanged) {
+        s = writeTableFile(table, cols, filename, newInfo, args->delimiters, &written);
+        if (s == SUCCESS && saved != NULL)
+            *saved = written;
+    } else if (newInfo != NULL) {
+        memcpy(newInfo, table->rowInfo, table->rows * sizeof(RowInfo));
+    }
+
+    // the table is saved even if the snapshot fails, it is only a cache
+    if (s == SUCCESS && args->cache) {
+        // the snapshot must not skip reading of rows, that could be read differently
+        bool readable = true;
+        for (unsigned i=0; i < table->rows; i++)
+            readable = readable && !newInfo[i].dirty;
+
+        if (readable) {
+            writeSnapshot(table, cols, filename, args->delimiters, newInfo);
+        } else {
+            char snapName[strlen(filename) + sizeof(SNAPSHOT_SUFFIX)];
+            sprintf(snapName, "%s%s", filename, SNAPSHOT_SUFFIX);
+            unlink(snapName);
+        }
+    }
+
+    statFree(ALLOC_ROWS, newInfo);
+    return s;
+}
+
+// takes commands as a string
+// and writes them into the program structure
+State parseCommands(Program *prog, char *cmdStr) {
+    // command delimiters
+    char *delims = ";";
+    // all commands except selection because of their weird syntax
+    const Command knownCommands[] = {
+        // Custom commands (not in official specification)
+        {.name="print", .fn=print_cmd},
+        {.name="dump", .fn=dump_cmd},
+        // Selection
+        {.name="[min]", .fn=selectMin_cmd},
+        {.name="[max]", .fn=selectMax_cmd},
+        {.name="[find ", .fn=selectFind_cmd},
+        {.name="[_]", .fn=selectLoad_cmd},
+        // Layout commands
+        {.name="irow", .fn=irow_cmd},
+        {.name="arow", .fn=arow_cmd},
+        {.name="drow", .fn=drow_cmd},
+        {.name="icol", .fn=icol_cmd},
+        {.name="acol", .fn=acol_cmd},
+        {.name="dcol", .fn=dcol_cmd},
+        {.name="sort", .fn=sort_cmd},
+        {.name="transpose", .fn=transpose_cmd},
+        // Data commands
+        {.name="set ", .fn=set_cmd},
+        {.name="clear", .fn=clear_cmd},
+        {.name="swap ", .fn=swap_cmd},
+        {.name="sum ", .fn=sum_cmd},
+        {.name="avg ", .fn=avg_cmd},
+        {.name="count ", .fn=count_cmd},
+        {.name="len ", .fn=len_cmd},
+        {.name="add ", .fn=add_cmd},
+        {.name="mul ", .fn=mul_cmd},
+        {.name="seq ", .fn=seq_cmd},
+        {.name="fill ", .fn=fill_cmd},
+        {.name="copy ", .fn=copy_cmd},
+        {.name="move ", .fn=move_cmd},
+        // Table commands
+        {.name="join ", .fn=join_cmd},
+        {.name="groupby ", .fn=groupby_cmd},
+        {.name="uniq", .fn=uniq_cmd},
+        {.name="distinct ", .fn=distinct_cmd},
+        {.name="compact", .fn=compact_cmd},
+        // Variable commands
+        {.name="def _", .fn=def_cmd},
+        {.name="use _", .fn=use_cmd},
+        {.name="inc _", .fn=inc_cmd},
+        {.name="[set]", .fn=selectStore_cmd},
+        // Control commands
+        {.name="goto ", .fn=goto_cmd},
+        {.name="iszero _", .fn=iszero_cmd},
+        {.name="sub _", .fn=sub_cmd},
+    };
+    const int NUM_KNOWN_CMDS = sizeof(knownCommands) / sizeof(Command);
+    // the imaginary reading head of cmdStr
+    int strIndex=0;
+
+    while (true) {
+        bool found = false;
+        // check for command
+        for (int j=0; j < NUM_KNOWN_CMDS; j++) {
+            // if the command is found at the beginning of current index
+            if (strbgn(&cmdStr[strIndex], knownCommands[j].name) == 0) {
+                strIndex += strlen(knownCommands[j].name);
+                addCommand(prog, &knownCommands[j]);
+                found = true;
+                break;
+            }
+        }
+        // check for the weird coordinate selection command
+        if (!found && (cmdStr[strIndex] == '[')) {
+            const Command select = {.fn=selectCoords_cmd};
+            addCommand(prog, &select);
+            found = true;
+            // strIndex doesn't shift
+            // because the command is its own argument if it makes any sense
+        }
+
+        if (!found)
+            return ERR_COMMAND_NOT_FOUND;
+        // buffer for command's arguments
+        char argBuf[MAX_COMMAND_LENGTH];
+        // this might cause some issues later, now commands can be in
+        // quotation marks and escaping is allowed
+        size_t shift = parseString(argBuf, &cmdStr[strIndex], delims);
+        // to make the next line cleaner
+        Command *lastCmdPtr = &prog->cmds[prog->len - 1];
+        lastCmdPtr->argStr = statMalloc(ALLOC_PROGRAM, (strlen(argBuf) + 1) * sizeof(char));
+        if (lastCmdPtr->argStr == NULL)
+            return ERR_MEMORY;
+        strcpy(lastCmdPtr->argStr, argBuf);
+
+        // +1 to skip the delimiter
+        strIndex += shift + 1;
+        // if there is delimiter, there maust be another command
+        if (cmdStr[strIndex-1] == ';')
+            continue;
+        // if there is nothing left
+        if (cmdStr[strIndex-1] == '\0')
+            break;
+    }
+    return SUCCESS;
+}
+
+// executes the commands of the program one after another
+State runProgram(Program *prog, Table *table) {
+    State s;
+    State (*function)(Context);
+
+    Variables variables;
+    variables_ctor(&variables);
+    // set context, that doesn't change with each command
+    unsigned i;
+    Context context = {.table=table, .vars=&variables, .execPtr=&i};
+
+    unsigned realCounter = 0;
+
+    for (i=0; i < prog->len; i++) {
+        // set the correct function
+        function = prog->cmds[i].fn;
+        // set up the context before executing
+        context.argStr = prog->cmds[i].argStr;
+
+        s = function(context);
+        // formulas depending on the changed cells get their new values
+        if (s == SUCCESS)
+            s = recalcFormulas(table);
+        if (s != SUCCESS)
+            break;
+
+        if (realCounter++ >= INF_CYCLE_LIMIT) {
+            s = ERR_INF_CYCLE;
+            break;
+        }
+    }
+    variables_dtor(&variables);
+    return s;
+}
+
+// ---------- PARTITION FUNCTIONS -----------
+// some programs do the same thing with every row and never look at other rows
+// such a program can run on parts of the table at once, every part has its own thread
+
+// smallest part of the table worth its own thread, SPS_PARTITION_MIN_ROWS overrides it
+#define PARTITION_MIN_ROWS 65536
+
+// checks if the selection command selects whole columns
+// the columns must exist, growing the table would change earlier selections
+bool isWholeColumnSelection(Command *cmd, Table *table) {
+    Selection sel;
+    if (parseSelection(&sel, cmd->argStr) != SUCCESS)
+        return false;
+    return (sel.startRow == 0) && (sel.endRow == 0) && (sel.endCol <= table->cols);
+}
+
+// checks if the program gives the same result, when it runs on the parts of the table
+// only whole columns may be selected and only the selected cells or variables may change
+// control flow depends only on the variables, so every part goes the same way
+bool isRowPartitionable(Program *prog, Table *table) {
+    State (*const cellwise[])(Context) = {
+        set_cmd, clear_cmd, add_cmd, mul_cmd,
+        use_cmd, inc_cmd, sub_cmd, goto_cmd, iszero_cmd,
+    };
+    // the table starts with one cell selected, so a selection must come first
+    if ((prog->len == 0) || (prog->cmds[0].fn != selectCoords_cmd))
+        return false;
+    // formulas may refer to any rows
+    if (table->formulas != NULL)
+        return false;
+
+    for (unsigned i=0; i < prog->len; i++) {
+        Command *cmd = &prog->cmds[i];
+        if ((cmd->fn == set_cmd) && isFormulaArg(cmd->argStr))
+            return false;
+        bool allowed = false;
+        if (cmd->fn == selectCoords_cmd)
+            allowed = isWholeColumnSelection(cmd, table);
+        for (size_t j=0; !allowed && j < sizeof(cellwise) / sizeof(cellwise[0]); j++)
+            allowed = (cmd->fn == cellwise[j]);
+        if (!allowed)
+            return false;
+    }
+    return true;
+}
+
+// makes a table from the rows first to last, user coordinates
+// the view shares the rows with the table, it is not destructed
+void tableView(Table *view, Table *table, unsigned first, unsigned last) {
+    table_ctor(view);
+    view->rows = last - first + 1;
+    view->cols = table->cols;
+    view->cells = &table->cells[first-1];
+    view->rowInfo = &table->rowInfo[first-1];
+    view->delim = table->delim;
+    view->delimiters = table->delimiters;
+    view->source.data = table->source.data;
+    view->snapshot = table->snapshot;
+    view->sel = table->sel;
+}
+
+typedef struct {
+    Program *prog;
+    Table view;
+    State state;
+} PartitionJob;
+
+void *partitionJobRun(void *arg) {
+    PartitionJob *job = arg;
+    job->state = runProgram(job->prog, &job->view);
+    return NULL;
+}
+
+// runs the program on every part of the table in its own thread
+State runPartitioned(Program *prog, Table *table, unsigned threads) {
+    // the parts have no indexes, they would be wrong afterwards
+    dropAllFindIndexes(table);
+    dropMinMaxIndex(table);
+
+    PartitionJob jobs[threads];
+    pthread_t ids[threads];
+    bool started[threads];
+    for (unsigned i=0; i < threads; i++) {
+        unsigned first = (unsigned long long)table->rows * i / threads + 1;
+        unsigned last = (unsigned long long)table->rows * (i + 1) / threads;
+        jobs[i].prog = prog;
+        tableView(&jobs[i].view, table, first, last);
+        started[i] = pthread_create(&ids[i], NULL, partitionJobRun, &jobs[i]) == 0;
+        if (!started[i])
+            partitionJobRun(&jobs[i]);
+    }
+
+    State s = SUCCESS;
+    for (unsigned i=0; i < threads; i++) {
+        if (started[i])
+            pthread_join(ids[i], NULL);
+        if (s == SUCCESS)
+            s = jobs[i].state;
+    }
+    // all the parts end with the same selection of whole columns
+    table->sel = jobs[0].view.sel;
+    return s;
+}
+
+// takes in program structure and executes commands in it
+State executeProgram(Program *prog, Table *table) {
+    unsigned threads = availableThreads();
+    unsigned minRows = envUnsigned("SPS_PARTITION_MIN_ROWS", PARTITION_MIN_ROWS);
+    if (threads > table->rows / minRows)
+        threads = table->rows / minRows;
+
+    if ((threads > 1) && isRowPartitionable(prog, table))
+        return runPartitioned(prog, table, threads);
+    return runProgram(prog, table);
+}
+
+// adds a file name to the arguments
+State addFilename(Arguments *args, const char *name) {
+    char **p = statRealloc(ALLOC_PROGRAM, args->filenames, (args->numFiles + 1) * sizeof(char *));
+    if (p == NULL)
+        return ERR_MEMORY;
+    args->filenames = p;
+
+    char *copy = statMalloc(ALLOC_PROGRAM, strlen(name) + 1);
+    if (copy == NULL)
+        return ERR_MEMORY;
+    strcpy(copy, name);
+    args->filenames[args->numFiles++] = copy;
+    return SUCCESS;
+}
+
+// reads file names from a file, one on each line
+State readFilenames(Arguments *args, const char *listName) {
+    FILE *fp = fopen(listName, "r");
+    if (!fp)
+        return ERR_FILE_ACCESS;
+
+    char *list = fileToBuffer(fp);
+    fclose(fp);
+    if (list == NULL)
+        return ERR_MEMORY;
+
+    State s = SUCCESS;
+    char *line = list;
+    while (*line != '\0' && s == SUCCESS) {
+        char *end = strchr(line, '\n');
+        if (end != NULL)
+            *end = '\0';
+        // empty lines are skipped
+        if (*line != '\0')
+            s = addFilename(args, line);
+        if (end == NULL)
+            break;
+        line = end + 1;
+    }
+    statFree(ALLOC_IO, list);
+    return s;
+}
+
+// deallocates everything in the arguments structure
+void arguments_dtor(Arguments *args) {
+    statFree(ALLOC_PROGRAM, args->delimiters);
+    statFree(ALLOC_IO, args->commandString);
+    for (unsigned i=0; i < args->numFiles; i++)
+        statFree(ALLOC_PROGRAM, args->filenames[i]);
+    statFree(ALLOC_PROGRAM, args->filenames);
+
+    args->delimiters = NULL;
+    args->commandString = NULL;
+    args->filenames = NULL;
+    args->numFiles = 0;
+}
+
+// there must be some files, stdin ("-") only on its own
+State checkFilenames(Arguments *args) {
+    if (args->numFiles == 0)
+        return ERR_BAD_SYNTAX;
+    // only one file can be watched, and it must be a file
+    if (args->watch && (args->numFiles > 1 || strcmp(args->filenames[0], "-") == 0))
+        return ERR_BAD_SYNTAX;
+    for (unsigned i=0; i < args->numFiles && args->numFiles > 1; i++) {
+        if (strcmp(args->filenames[i], "-") == 0)
+            return ERR_BAD_SYNTAX;
+    }
+    return SUCCESS;
+}
+
+// reads delimiters from arguments
+State parseArguments(int argc, char **argv, Arguments *args) {
+    // initialize in case anything fails
+    args->delimiters = NULL;
+    args->filenames = NULL;
+    args->numFiles = 0;
+    args->commandString = NULL;
+    args->jobs = availableThreads();
+    args->serveSocket = NULL;
+    args->cache = false;
+    args->time = false;
+    args->stats = STATS_NONE;
+    args->lazy = false;
+    args->watch = false;
+
+    if (argc < 2)
+        return ERR_BAD_SYNTAX;
+
+    int i = 1;
+    // reading options
+    while (i < argc) {
+        // reading delimiters
+        if (strcmp("-d", argv[i]) == 0) {
+            if (++i >= argc || args->delimiters != NULL)
+                return ERR_BAD_SYNTAX;
+
+            args->delimiters = statMalloc(ALLOC_PROGRAM, strlen(argv[i]) + 1);
+            if (args->delimiters == NULL)
+                return ERR_MEMORY;
+
+            strcpy(args->delimiters, argv[i]);
+            i++;
+            continue;
+        }
+        // number of files processed at the same time
+        if (strcmp("-j", argv[i]) == 0) {
+            if (++i >= argc)
+                return ERR_BAD_SYNTAX;
+
+            char *endPtr;
+            long jobs = strtol(argv[i], &endPtr, 10);
+            if (*endPtr != '\0' || jobs < 1)
+                return ERR_BAD_SYNTAX;
+
+            args->jobs = jobs;
+            i++;
+            continue;
+        }
+        // server mode
+        if (strcmp("--serve", argv[i]) == 0) {
+            if (++i >= argc)
+                return ERR_BAD_SYNTAX;
+
+            args->serveSocket = argv[i];
+            i++;
+            continue;
+        }
+        // loading from snapshots
+        if (strcmp("--cache", argv[i]) == 0) {
+            args->cache = true;
+            i++;
+            continue;
+        }
+        // printing how long it took
+        if (strcmp("--time", argv[i]) == 0) {
+            args->time = true;
+            i++;
+            continue;
+        }
+        // reading rows only when they are needed
+        if (strcmp("--lazy", argv[i]) == 0) {
+            args->lazy = true;
+            i++;
+            continue;
+        }
+        // processing the table again after every change
+        if (strcmp("--watch", argv[i]) == 0) {
+            args->watch = true;
+            i++;
+            continue;
+        }
+        // printing statistics
+        if (strcmp("--stats", argv[i]) == 0 || strcmp("--stats=json", argv[i]) == 0) {
+            args->stats = (argv[i][7] == '=') ? STATS_JSON : STATS_TEXT;
+            i++;
+            continue;
+        }
+        break;
+    }
+    if (i >= argc)
+        return ERR_BAD_SYNTAX;
+
+    if (args->delimiters == NULL) {
+        args->delimiters = statMalloc(ALLOC_PROGRAM, 2 * sizeof(char));
+        if (args->delimiters == NULL)
+            return ERR_MEMORY;
+
+        strcpy(args->delimiters, " ");
+    }
+
+    // the server gets commands later, there is only the table
+    if (args->serveSocket != NULL) {
+        if (args->watch)
+            return ERR_BAD_SYNTAX;
+        // stdin is for the commands
+        if (i != argc - 1 || strcmp(argv[i], "-") == 0)
+            return ERR_BAD_SYNTAX;
+        return addFilename(args, argv[i]);
+    }
+
+    // reading commands from file
+    if (strcmp("-c", argv[i]) == 0) {
+        if (++i >= argc)
+            return ERR_BAD_SYNTAX;
+
+        // file with commands
+        FILE *fp = fopen(argv[i], "r");
+        if (!fp)
+            return ERR_FILE_ACCESS;
+
+        args->commandString = fileToBuffer(fp);
+        fclose(fp);
+        if (args->commandString == NULL)
+            return ERR_MEMORY;
+
+        if (++i >= argc)
+            return ERR_BAD_SYNTAX;
+    } else {
+        // reading commands from the argument
+        // counted as an input buffer, just like the one from the file
+        args->commandString = statMalloc(ALLOC_IO, strlen(argv[i]) + 1);
+        if (args->commandString == NULL)
+            return ERR_MEMORY;
+
+        strcpy(args->commandString, argv[i]);
+
+        if (++i >= argc)
+            return ERR_BAD_SYNTAX;
+    }
+
+    // list of files in a file
+    if (strcmp("--files-from", argv[i]) == 0) {
+        if (i + 2 != argc)
+            return ERR_BAD_SYNTAX;
+
+        State s = readFilenames(args, argv[i + 1]);
+        if (s != SUCCESS)
+            return s;
+        return checkFilenames(args);
+    }
+
+    // all the other arguments are files
+    for (; i < argc; i++) {
+        State s = addFilename(args, argv[i]);
+        if (s != SUCCESS)
+            return s;
+    }
+    return checkFilenames(args);
+}
+
+// prints basic help on how to use the program
+void printUsage() {
+    const char *usageString = "\nUsage:\n"
+        "./sps [-d DELIM] [-j JOBS] [--cache] [--lazy] [--time] [--stats[=json]] [Commands | -c FILE] TABLE...\n"
+        "./sps [-d DELIM] [--time] [--stats[=json]] [Commands | -c FILE] - <INPUT >OUTPUT\n"
+        "./sps [-d DELIM] [-j JOBS] [--cache] [--lazy] [--time] [--stats[=json]] [Commands | -c FILE] --files-from LIST\n"
+        "./sps [-d DELIM] [--cache] [--lazy] --serve SOCKET|- TABLE\n"
+        "./sps [-d DELIM] [--cache] [--lazy] [--time] [--stats[=json]] --watch [Commands | -c FILE] TABLE\n";
+
+    fprintf(stderr, "%s", usageString);
+}
+
+// returns error message according to the error state
+const char *errorMessage(State err_state) {
+    const char *errMsgs[] = {
+        [SUCCESS] = "",
+        [ERR_GENERIC] = "Generic error",
+        [ERR_BAD_SELECTION] = "A command can't be executed for this selection",
+        [ERR_BAD_SYNTAX] = "Bad syntax",
+        [ERR_COMMAND_NOT_FOUND] = "Command not found",
+        [ERR_BAD_INPUT] = "Input table's format is incompatible",
+        [ERR_FILE_ACCESS] = "Could not access the file",
+        [ERR_MEMORY] = "Memory allocation failed",
+        [ERR_INF_CYCLE] = "The program has run into an infinite loop",
+        [ERR_FORMULA_CYCLE] = "Formulas depend on each other in a cycle",
+    };
+
+    const unsigned NUM_KNOWN_ERRORS = sizeof(errMsgs) / sizeof(char *);
+
+    if (err_state < NUM_KNOWN_ERRORS)
+        return errMsgs[err_state];
+    return "Unknown error";
+}
+
+// prints error message according to the error state
+void printErrorMessage(State err_state) {
+    fputs(errorMessage(err_state), stderr);
+    fputs("\n", stderr);
+}
+
+// prints error message of one file from many
+void printFileErrorMessage(const char *filename, State err_state) {
+    // whole message on one line, even if more threads fail at once
+    flockfile(stderr);
+    fprintf(stderr, "%s: ", filename);
+    printErrorMessage(err_state);
+    funlockfile(stderr);
+}
+
+// ---------- PIPELINE FUNCTIONS -----------
+// with "-" instead of the file, the table is read from stdin and written to stdout
+// if the program works only with rows at the front of the table, these are
+// written as soon as the program ends and the rest of the input flows through
+// the rows passed through are not a part of the table, they keep their own
+// width and only get empty cells to be as wide as the table
+
+// how far from the selection a command can reach
+typedef enum {
+    REACH_SELECTION,
+    // also the cell in the argument
+    REACH_ARGUMENT,
+    // deletes a row, so the next one moves up
+    REACH_DELETE,
+    // the whole table (or the command is not known)
+    REACH_ALL,
+} Reach;
+
+Reach commandReach(Command *cmd) {
+    const struct {
+        State (*fn)(Context);
+        Reach reach;
+    } reaches[] = {
+        {selectCoords_cmd, REACH_ARGUMENT},
+        {selectMin_cmd, REACH_SELECTION}, {selectMax_cmd, REACH_SELECTION},
+        {selectFind_cmd, REACH_SELECTION}, {selectLoad_cmd, REACH_SELECTION},
+        {selectStore_cmd, REACH_SELECTION},
+        {irow_cmd, REACH_SELECTION}, {arow_cmd, REACH_SELECTION},
+        {drow_cmd, REACH_DELETE}, {sort_cmd, REACH_SELECTION},
+        {set_cmd, REACH_SELECTION}, {clear_cmd, REACH_SELECTION},
+        {swap_cmd, REACH_ARGUMENT}, {sum_cmd, REACH_ARGUMENT},
+        {avg_cmd, REACH_ARGUMENT}, {count_cmd, REACH_ARGUMENT},
+        {len_cmd, REACH_ARGUMENT}, {fill_cmd, REACH_ARGUMENT},
+        {add_cmd, REACH_SELECTION}, {mul_cmd, REACH_SELECTION},
+        {seq_cmd, REACH_SELECTION},
+        {def_cmd, REACH_SELECTION}, {use_cmd, REACH_SELECTION},
+        {inc_cmd, REACH_SELECTION}, {goto_cmd, REACH_SELECTION},
+        {iszero_cmd, REACH_SELECTION}, {sub_cmd, REACH_SELECTION},
+        {dump_cmd, REACH_SELECTION},
+    };
+    // a formula can refer to any cell
+    if ((cmd->fn == set_cmd) && isFormulaArg(cmd->argStr))
+        return REACH_ALL;
+    for (size_t i=0; i < sizeof(reaches) / sizeof(reaches[0]); i++) {
+        if (reaches[i].fn == cmd->fn)
+            return reaches[i].reach;
+    }
+    return REACH_ALL;
+}
+
+// finds the last input row, that the program can ever work with
+// returns false if it can be any row
+bool programRowBound(Program *prog, unsigned *bound) {
+    // [1,1] is selected at the beginning
+    *bound = 1;
+    unsigned deleted = 0;
+    bool jumps = false;
+
+    for (unsigned i=0; i < prog->len; i++) {
+        Command *cmd = &prog->cmds[i];
+        Reach reach = commandReach(cmd);
+        if (reach == REACH_ALL)
+            return false;
+        if (reach == REACH_DELETE)
+            deleted++;
+        if (cmd->fn == goto_cmd)
+            jumps = true;
+
+        if (reach == REACH_ARGUMENT) {
+            Selection sel;
+            if (parseSelection(&sel, cmd->argStr) != SUCCESS)
+                return false;
+            // whole columns
+            if (sel.startRow == 0 || sel.endRow == 0)
+                return false;
+            if (sel.startRow > *bound)
+                *bound = sel.startRow;
+            if (sel.endRow > *bound)
+                *bound = sel.endRow;
+        }
+    }
+    // a loop can delete any number of rows
+    if (deleted > 0 && jumps)
+        return false;
+    *bound += deleted;
+    return true;
+}
+
+// reads at most maxLines lines from the file (all of them if it is 0)
+// the buffer is terminated by '\0', NULL if there is not enough memory
+char *readLines(FILE *f, unsigned maxLines, size_t *len) {
+    size_t cap = 4096;
+    char *buffer = statMalloc(ALLOC_IO, cap);
+    if (buffer == NULL)
+        return NULL;
+    *len = 0;
+
+    for (unsigned lines=0; maxLines == 0 || lines < maxLines; lines++) {
+        char *line = NULL;
+        size_t lineCap = 0;
+        ssize_t lineLen = getline(&line, &lineCap, f);
+        if (lineLen < 0) {
+            free(line);
+            break;
+        }
+        if (*len + lineLen + 1 > cap) {
+            while (*len + lineLen + 1 > cap)
+                cap *= 2;
+            char *p = statRealloc(ALLOC_IO, buffer, cap);
+            if (p == NULL) {
+                free(line);
+                statFree(ALLOC_IO, buffer);
+                return NULL;
+            }
+            buffer = p;
+        }
+        memcpy(&buffer[*len], line, lineLen);
+        *len += lineLen;
+        free(line);
+    }
+    buffer[*len] = '\0';
+    return buffer;
+}
+
+// writes one input row, that the program didn't work with
+// the row gets empty cells at the end to be at least cols wide
+State passRow(char *line, size_t len, unsigned cols, char *delimiters, FILE *f) {
+    // rows without any special characters are written as they are
+    if (len > 0 && line[len-1] == '\n' && isCanonicalRow(line, len, delimiters)) {
+        unsigned cells = 1;
+        for (size_t i=0; i < len; i++) {
+            if (line[i] == delimiters[0])
+                cells++;
+        }
+        fwrite(line, 1, len - 1, f);
+        statAdd(&stats.bytesWritten, len);
+        for (; cells < cols; cells++) {
+            fputc(delimiters[0], f);
+            statAdd(&stats.bytesWritten, 1);
+        }
+        fputc('\n', f);
+        return SUCCESS;
+    }
+
+    // the others are read and printed again just like in the table
+    Table row;
+    table_ctor(&row);
+    State s = readTable(&row, line, delimiters, false);
+    if (s == SUCCESS && row.rows > 0)
+        s = assureTableSize(&row, row.rows, cols);
+    for (unsigned i=1; i <= row.rows && s == SUCCESS; i++)
+        statAdd(&stats.bytesWritten, printRow(&row, i, row.cols, f));
+    table_dtor(&row);
+    return s;
+}
+
+// reads the rest of the input into a temporary file, rest is NULL if there is nothing
+// wider is set, if some of the rows has more than cols cells
+State spoolRows(FILE *in, unsigned cols, char *delimiters, FILE **rest, bool *wider) {
+    *rest = NULL;
+    State s = SUCCESS;
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t lineLen;
+    while (s == SUCCESS && (lineLen = getline(&line, &lineCap, in)) >= 0) {
+        statAdd(&stats.bytesRead, lineLen);
+        if (*rest == NULL && (*rest = tmpfile()) == NULL) {
+            s = ERR_FILE_ACCESS;
+            break;
+        }
+        // the last row without '\n' can't be scanned, it is read with the others
+        unsigned cells;
+        if (scanRow(line, lineLen, delimiters, isCanonicalRow(line, lineLen, delimiters), &cells) != SUCCESS
+            || cells > cols)
+            *wider = true;
+        if (fwrite(line, 1, lineLen, *rest) != (size_t)lineLen)
+            s = ERR_FILE_ACCESS;
+    }
+    free(line);
+    if (s == SUCCESS && *rest != NULL && fflush(*rest) != 0)
+        s = ERR_FILE_ACCESS;
+    return s;
+}
+
+// runs the program again on the front and the rest of the input as one table
+State processWholeStream(Program *program, Table *front, FILE *rest, Arguments *args) {
+    long restLen = ftell(rest);
+    if (restLen < 0)
+        return ERR_FILE_ACCESS;
+    rewind(rest);
+
+    Table table;
+    table_ctor(&table);
+    size_t len = front->source.len + restLen;
+    table.source.data = statMalloc(ALLOC_IO, len + 1);
+    State s = (table.source.data != NULL) ? SUCCESS : ERR_MEMORY;
+    if (s == SUCCESS) {
+        memcpy(table.source.data, front->source.data, front->source.len);
+        if (fread(&table.source.data[front->source.len], 1, restLen, rest) != (size_t)restLen)
+            s = ERR_FILE_ACCESS;
+        table.source.data[len] = '\0';
+        table.source.len = len;
+    }
+
+    if (s == SUCCESS)
+        s = readTable(&table, table.source.data, args->delimiters, false);
+    if (s == SUCCESS)
+        s = executeProgram(program, &table);
+    if (s == SUCCESS)
+        s = deleteExcessCols(&table);
+    if (s == SUCCESS)
+        s = writeTable(&table, table.cols, stdout, NULL, args->delimiters);
+    table_dtor(&table);
+    return s;
+}
+
+// runs the program on the table from stdin and writes it into stdout
+State processStream(Program *program, Arguments *args) {
+    unsigned bound = 0;
+    if (!programRowBound(program, &bound))
+        bound = 0;
+
+    long long start = nanoTime();
+    Table table;
+    table_ctor(&table);
+    table.source.data = readLines(stdin, bound, &table.source.len);
+    State s = (table.source.data != NULL) ? SUCCESS : ERR_MEMORY;
+
+    if (s == SUCCESS) {
+        statAdd(&stats.bytesRead, table.source.len);
+        s = readTable(&table, table.source.data, args->delimiters, false);
+    }
+    start = addPhaseTime(PHASE_LOAD, start);
+    if (s == SUCCESS)
+        s = executeProgram(program, &table);
+    start = addPhaseTime(PHASE_EXECUTE, start);
+    // the front gets as wide as the widest row, before the empty columns are deleted
+    unsigned frontCols = table.cols;
+    if (s == SUCCESS)
+        s = deleteExcessCols(&table);
+    start = addPhaseTime(PHASE_TRIM, start);
+    statMax(&stats.rssAfterProgram, currentRss());
+
+    // the rest waits, until it is known, that the front is printed just like in a file
+    FILE *rest = NULL;
+    bool wider = false;
+    if (s == SUCCESS && bound != 0)
+        s = spoolRows(stdin, table.cols, args->delimiters, &rest, &wider);
+    // the deleted column could be filled in the rest
+    if (rest != NULL && table.cols < frontCols)
+        wider = true;
+
+    if (s == SUCCESS && wider) {
+        s = processWholeStream(program, &table, rest, args);
+    } else if (s == SUCCESS) {
+        s = writeTable(&table, table.cols, stdout, NULL, args->delimiters);
+        if (rest != NULL)
+            rewind(rest);
+
+        char *line = NULL;
+        size_t lineCap = 0;
+        ssize_t lineLen;
+        while (s == SUCCESS && rest != NULL && (lineLen = getline(&line, &lineCap, rest)) >= 0)
+            s = passRow(line, lineLen, table.cols, args->delimiters, stdout);
+        free(line);
+    }
+    if (rest != NULL)
+        fclose(rest);
+
+    if (fflush(stdout) != 0 && s == SUCCESS)
+        s = ERR_FILE_ACCESS;
+    addPhaseTime(PHASE_SAVE, start);
+    table_dtor(&table);
+    return s;
+}
+
+// runs the program on one table file
+// if saved is not NULL, it gets the size of the saved file
+State processFile(Program *program, char *filename, Arguments *args, size_t *saved) {
+    if (strcmp(filename, "-") == 0)
+        return processStream(program, args);
+
+    long long start = nanoTime();
+    Table table;
+    table_ctor(&table);
 
-        if (!found)
-            return ERR_COMMAND_NOT_FOUND;
-        // buffer for command's arguments
-        char argBuf[MAX_COMMAND_LENGTH];
-        // this might cause some issues later, now commands can be in
-        // quotation marks and escaping is allowed
-        size_t shift = parseString(argBuf, &cmdStr[strIndex], delims);
-        // to make the next line cleaner
-        Command *lastCmdPtr = &prog->cmds[prog->len - 1];
-        lastCmdPtr->argStr = malloc((strlen(argBuf) + 1) * sizeof(char));
-        if (lastCmdPtr->argStr == NULL)
-            return ERR_MEMORY;
-        strcpy(lastCmdPtr->argStr, argBuf);
+    State s = loadTable(&table, filename, args);
+    start = addPhaseTime(PHASE_LOAD, start);
+    // execute commands on the table
+    if (s == SUCCESS)
+        s = executeProgram(program, &table);
+    start = addPhaseTime(PHASE_EXECUTE, start);
+    // remove empty column on the right
+    if (s == SUCCESS)
+        s = deleteExcessCols(&table);
+    start = addPhaseTime(PHASE_TRIM, start);
+    statMax(&stats.rssAfterProgram, currentRss());
+    // write the table back into the same file
+    if (s == SUCCESS)
+        s = saveTable(&table, table.cols, filename, args, saved);
+    addPhaseTime(PHASE_SAVE, start);
 
-        // +1 to skip the delimiter
-        strIndex += shift + 1;
-        // if there is delimiter, there maust be another command
-        if (cmdStr[strIndex-1] == ';')
-            continue;
-        // if there is nothing left
-        if (cmdStr[strIndex-1] == '\0')
+    table_dtor(&table);
+    return s;
+}
+
+// shared by all the threads processing files
+typedef struct {
+    Program *program;
+    Arguments *args;
+    // result of every file
+    State *results;
+    // the next file, that nobody is working on yet
+    unsigned next;
+    pthread_mutex_t lock;
+} FileQueue;
+
+// takes files from the queue until there are none left
+void *fileWorker(void *arg) {
+    FileQueue *queue = arg;
+    while (true) {
+        pthread_mutex_lock(&queue->lock);
+        unsigned i = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (i >= queue->args->numFiles)
+            break;
+
+        char *filename = queue->args->filenames[i];
+        State s = processFile(queue->program, filename, queue->args, NULL);
+        queue->results[i] = s;
+        if (s != SUCCESS)
+            printFileErrorMessage(filename, s);
+    }
+    return NULL;
+}
+
+// runs the program on all the files, more of them at the same time
+// returns the error of the first file, that failed
+State processFiles(Program *program, Arguments *args) {
+    // one file is processed just like before
+    if (args->numFiles == 1)
+        return processFile(program, args->filenames[0], args, NULL);
+
+    State results[args->numFiles];
+    FileQueue queue = {.program=program, .args=args, .results=results, .next=0};
+    pthread_mutex_init(&queue.lock, NULL);
+
+    unsigned threads = args->jobs;
+    if (threads > args->numFiles)
+        threads = args->numFiles;
+
+    pthread_t ids[threads];
+    unsigned started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&ids[started], NULL, fileWorker, &queue) != 0)
             break;
     }
+    // the main thread works too
+    fileWorker(&queue);
+    for (unsigned i=0; i < started; i++)
+        pthread_join(ids[i], NULL);
+    pthread_mutex_destroy(&queue.lock);
+
+    for (unsigned i=0; i < args->numFiles; i++) {
+        if (results[i] != SUCCESS)
+            return results[i];
+    }
     return SUCCESS;
 }
 
-// takes in program structure and executes commands in it
-State executeProgram(Program *prog, Table *table) {
-    State s;
-    State (*function)(Context);
+// ---------- SERVER FUNCTIONS -----------
+// the table stays loaded and batches of commands come one per line
+// every line is answered by "OK" or "ERR message"
+// "flush" saves the table, "quit" saves it and stops the server
 
-    Variables variables;
-    variables_ctor(&variables);
-    // set context, that doesn't change with each command
-    unsigned i;
-    Context context = {.table=table, .vars=&variables, .execPtr=&i};
+// the loaded table and everything around it
+typedef struct {
+    Table table;
+    char *filename;
+    Arguments *args;
+    // the table was changed since it was saved the last time
+    bool unsaved;
+    bool quit;
+} Server;
 
-    unsigned realCounter = 0;
+// one connection to the server
+typedef struct {
+    // -1 if the slot is free
+    int fd;
+    // where the answers go, the same as fd for sockets
+    int outFd;
+    // received data, that don't make a whole line yet
+    char *buffer;
+    size_t len;
+} Client;
+
+// saves the table the same way as the end of a normal run
+State serverFlush(Server *server) {
+    // only the file is trimmed, the table keeps its columns for the next commands
+    unsigned cols;
+    State s = usedCols(&server->table, &cols);
+    if (s == SUCCESS)
+        s = saveTable(&server->table, cols, server->filename, server->args, NULL);
+    if (s == SUCCESS)
+        server->unsaved = false;
+    return s;
+}
 
-    for (i=0; i < prog->len; i++) {
-        // set the correct function
-        function = prog->cmds[i].fn;
-        // set up the context before executing
-        context.argStr = prog->cmds[i].argStr;
+// runs commands from one line
+State serverExecute(Server *server, char *line) {
+    if (strcmp(line, "flush") == 0)
+        return serverFlush(server);
 
-        s = function(context);
-        if (s != SUCCESS)
-            break;
+    if (strcmp(line, "quit") == 0) {
+        server->quit = true;
+        return serverFlush(server);
+    }
 
-        if (realCounter++ >= INF_CYCLE_LIMIT) {
-            s = ERR_INF_CYCLE;
+    Program program;
+    program_ctor(&program);
+    State s = parseCommands(&program, line);
+    if (s == SUCCESS) {
+        s = executeProgram(&program, &server->table);
+        // even a failed program could have changed something
+        server->unsaved = true;
+    }
+    program_dtor(&program);
+    return s;
+}
+
+// writes the whole string, even if it takes more calls
+void writeAll(int fd, const char *str) {
+    size_t len = strlen(str);
+    while (len > 0) {
+        ssize_t written = write(fd, str, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+        str += written;
+        len -= written;
+    }
+}
+
+// executes all the whole lines the client has sent
+void clientProcessLines(Server *server, Client *client) {
+    size_t start = 0;
+    while (!server->quit) {
+        char *end = memchr(&client->buffer[start], '\n', client->len - start);
+        if (end == NULL)
             break;
+        *end = '\0';
+        char *line = &client->buffer[start];
+        start = end - client->buffer + 1;
+        // empty lines are ignored
+        if (*line == '\0')
+            continue;
+
+        State s = serverExecute(server, line);
+        if (s == SUCCESS) {
+            writeAll(client->outFd, "OK\n");
+        } else {
+            char answer[strlen(errorMessage(s)) + sizeof("ERR \n")];
+            sprintf(answer, "ERR %s\n", errorMessage(s));
+            writeAll(client->outFd, answer);
         }
     }
-    variables_dtor(&variables);
-    return s;
+    // keep only the unfinished line
+    memmove(client->buffer, &client->buffer[start], client->len - start);
+    client->len -= start;
 }
 
-// reads delimiters from arguments
-State parseArguments(int argc, char **argv, Arguments *args) {
-    // initialize in case anything fails
-    args->delimiters = NULL;
-    args->filename = NULL;
-    args->commandString = NULL;
+// reads what the client sent, returns false if the client disconnected
+bool clientReceive(Server *server, Client *client) {
+    char chunk[4096];
+    ssize_t received = read(client->fd, chunk, sizeof(chunk));
+    if (received < 0 && errno == EINTR)
+        return true;
+    if (received <= 0) {
+        // the last line doesn't need '\n'
+        if (client->len > 0) {
+            char *p = statRealloc(ALLOC_IO, client->buffer, client->len + 1);
+            if (p != NULL) {
+                client->buffer = p;
+                client->buffer[client->len++] = '\n';
+                clientProcessLines(server, client);
+            }
+        }
+        return false;
+    }
 
-    if (argc < 2)
-        return ERR_BAD_SYNTAX;
+    char *p = statRealloc(ALLOC_IO, client->buffer, client->len + received);
+    if (p == NULL)
+        return false;
+    client->buffer = p;
+    memcpy(&client->buffer[client->len], chunk, received);
+    client->len += received;
 
-    int i = 1;
-    // reading delimiters
-    if (strcmp("-d", argv[i]) == 0) {
-        if (++i >= argc)
-            return ERR_BAD_SYNTAX;
+    clientProcessLines(server, client);
+    return true;
+}
 
-        args->delimiters = malloc(strlen(argv[i]) + 1);
-        if (args->delimiters == NULL)
-            return ERR_MEMORY;
+void clientClose(Client *client, bool closeFd) {
+    if (closeFd)
+        close(client->fd);
+    statFree(ALLOC_IO, client->buffer);
+    client->fd = -1;
+    client->buffer = NULL;
+    client->len = 0;
+}
 
-        strcpy(args->delimiters, argv[i]);
-        if (++i >= argc)
-            return ERR_BAD_SYNTAX;
-    } else {
-        args->delimiters = malloc(2 * sizeof(char));
-        if (args->delimiters == NULL)
-            return ERR_MEMORY;
+// opens a listening unix domain socket
+int openServerSocket(char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    // a socket left by a previous server
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, MAX_CLIENTS) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-        strcpy(args->delimiters, " ");
+// loads the table and serves commands until quit (or the end of stdin)
+State serveTable(Arguments *args) {
+    Server server = {.filename=args->filenames[0], .args=args, .unsaved=false, .quit=false};
+    table_ctor(&server.table);
+
+    State s = loadTable(&server.table, server.filename, args);
+    if (s != SUCCESS) {
+        table_dtor(&server.table);
+        return s;
     }
 
-    // reading commands from file
-    if (strcmp("-c", argv[i]) == 0) {
-        if (++i >= argc)
-            return ERR_BAD_SYNTAX;
+    // a client, that disconnects, must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
-        // file with commands
-        FILE *fp = fopen(argv[i], "r");
-        if (!fp)
+    bool useStdin = strcmp(args->serveSocket, "-") == 0;
+    int listenFd = -1;
+    if (!useStdin) {
+        listenFd = openServerSocket(args->serveSocket);
+        if (listenFd < 0) {
+            table_dtor(&server.table);
             return ERR_FILE_ACCESS;
+        }
+    }
 
-        args->commandString = fileToBuffer(fp);
-        if (args->commandString == NULL)
-            return ERR_MEMORY;
+    Client clients[MAX_CLIENTS];
+    for (unsigned i=0; i < MAX_CLIENTS; i++)
+        clients[i] = (Client){.fd=-1, .buffer=NULL, .len=0};
+    if (useStdin)
+        clients[0] = (Client){.fd=STDIN_FILENO, .outFd=STDOUT_FILENO, .buffer=NULL, .len=0};
+
+    while (!server.quit) {
+        // the listening socket is the last one
+        struct pollfd fds[MAX_CLIENTS + 1];
+        unsigned nfds = 0;
+        unsigned owners[MAX_CLIENTS];
+        for (unsigned i=0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd < 0)
+                continue;
+            owners[nfds] = i;
+            fds[nfds++] = (struct pollfd){.fd=clients[i].fd, .events=POLLIN};
+        }
+        // stdin is closed, there is nobody to wait for
+        if (useStdin && nfds == 0)
+            break;
+        if (listenFd >= 0)
+            fds[nfds++] = (struct pollfd){.fd=listenFd, .events=POLLIN};
 
-        if (++i >= argc)
-            return ERR_BAD_SYNTAX;
-    } else {
-        // reading commands from the argument
-        args->commandString = malloc(strlen(argv[i]) + 1);
-        if (args->commandString == NULL)
-            return ERR_MEMORY;
+        int timeout = server.unsaved ? IDLE_FLUSH_SECONDS * 1000 : -1;
+        int ready = poll(fds, nfds, timeout);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0) {
+            s = ERR_GENERIC;
+            break;
+        }
+        // nothing happened for a while, good time to save
+        if (ready == 0) {
+            State flushed = serverFlush(&server);
+            if (flushed != SUCCESS)
+                printErrorMessage(flushed);
+            continue;
+        }
 
-        strcpy(args->commandString, argv[i]);
+        for (unsigned i=0; i < nfds && !server.quit; i++) {
+            if (fds[i].revents == 0)
+                continue;
 
-        if (++i >= argc)
-            return ERR_BAD_SYNTAX;
+            if (fds[i].fd == listenFd) {
+                int fd = accept(listenFd, NULL, NULL);
+                if (fd < 0)
+                    continue;
+                unsigned j = 0;
+                while (j < MAX_CLIENTS && clients[j].fd >= 0)
+                    j++;
+                if (j == MAX_CLIENTS) {
+                    writeAll(fd, "ERR Too many clients\n");
+                    close(fd);
+                    continue;
+                }
+                clients[j] = (Client){.fd=fd, .outFd=fd, .buffer=NULL, .len=0};
+                continue;
+            }
+
+            Client *client = &clients[owners[i]];
+            if (!clientReceive(&server, client))
+                clientClose(client, !useStdin);
+        }
     }
 
-    args->filename = malloc(strlen(argv[i]) + 1);
-    if (args->filename == NULL)
-        return ERR_MEMORY;
+    for (unsigned i=0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0)
+            clientClose(&clients[i], !useStdin);
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(args->serveSocket);
+    }
 
-    strcpy(args->filename, argv[i]);
+    // nothing may be lost when the server stops
+    if (s == SUCCESS && server.unsaved)
+        s = serverFlush(&server);
 
-    // if there are any arguments left at this point,
-    // the syntax must be wrong
-    if (i < argc-1)
-        return ERR_BAD_SYNTAX;
+    table_dtor(&server.table);
+    return s;
+}
 
-    return SUCCESS;
+// ---------- WATCH FUNCTIONS -----------
+// the program runs on the table, and then again whenever the file changes
+// rows appended to the end are processed alone, if the program works with every row alone,
+// the result replaces them in the file and the rows before them are not touched
+// any other change runs the program on the whole file again
+// a full run replaces the file, so a producer, that keeps the file open,
+// goes on writing into the old one and those rows are lost
+
+// how much of the end of the processed part is compared, to tell an append from other changes
+#define WATCH_TAIL_LEN 4096
+
+// the watched file, as the last run left it
+typedef struct {
+    char *filename;
+    Program *program;
+    Arguments *args;
+    // a different file in the same place is not an append
+    dev_t dev;
+    ino_t inode;
+    struct timespec mtime;
+    size_t size;
+    // everything before this is processed, the rest was appended
+    size_t processed;
+    // width of the table, appended rows get at least this many cells
+    unsigned cols;
+    // the end of the processed part
+    char tail[WATCH_TAIL_LEN];
+    size_t tailLen;
+} Watch;
+
+// set by SIGINT and SIGTERM, the watching stops after the current run
+volatile sig_atomic_t watchStopped = 0;
+
+void stopWatching(int sig) {
+    (void)sig;
+    watchStopped = 1;
 }
 
-// prints basic help on how to use the program
-void printUsage() {
-    const char *usageString = "\nUsage:\n"
-        "./sps [-d DELIM] [Commands for editing the table]\n";
+// reads len bytes from the offset, even if it takes more calls
+bool preadAll(int fd, char *buffer, size_t len, size_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buffer, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buffer += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
 
-    fprintf(stderr, "%s", usageString);
+// writes len bytes to the offset, even if it takes more calls
+bool pwriteAll(int fd, const char *buffer, size_t len, size_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buffer, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buffer += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
 }
 
-// prints error message according to the error state
-void printErrorMessage(State err_state) {
-    char *errMsgs[] = {
-        [SUCCESS] = "",
-        [ERR_GENERIC] = "Generic error",
-        [ERR_BAD_SELECTION] = "A command can't be executed for this selection",
-        [ERR_BAD_SYNTAX] = "Bad syntax",
-        [ERR_COMMAND_NOT_FOUND] = "Command not found",
-        [ERR_BAD_INPUT] = "Input table's format is incompatible",
-        [ERR_FILE_ACCESS] = "Could not access the file",
-        [ERR_MEMORY] = "Memory allocation failed",
-        [ERR_INF_CYCLE] = "The program has run into an infinite loop",
-    };
+// counts the cells in the first row of the file, 0 if there is no row
+unsigned firstRowCells(char *filename, char *delimiters) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+        return 0;
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t len = getline(&line, &lineCap, f);
+    unsigned cells = 0;
+    if (len <= 0 || line[len-1] != '\n'
+        || scanRow(line, len, delimiters, isCanonicalRow(line, len, delimiters), &cells) != SUCCESS)
+        cells = 0;
+    free(line);
+    fclose(f);
+    return cells;
+}
 
-    const unsigned NUM_KNOWN_ERRORS = sizeof(errMsgs) / sizeof(char *);
+// checks if the last row of the file is finished
+bool endsWithNewline(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    char last = '\0';
+    bool ends = fstat(fd, &st) == 0 && st.st_size > 0
+        && preadAll(fd, &last, 1, st.st_size - 1) && last == '\n';
+    close(fd);
+    return ends;
+}
 
-    if (err_state < NUM_KNOWN_ERRORS) {
-        fputs(errMsgs[err_state], stderr);
-        fputs("\n", stderr);
-        return;
+// remembers the file after a run, processed is where the unprocessed rest begins
+State watchRemember(Watch *watch, size_t processed) {
+    int fd = open(watch->filename, O_RDONLY);
+    if (fd < 0)
+        return ERR_FILE_ACCESS;
+
+    struct stat st;
+    State s = (fstat(fd, &st) == 0) ? SUCCESS : ERR_FILE_ACCESS;
+    if (s == SUCCESS) {
+        watch->dev = st.st_dev;
+        watch->inode = st.st_ino;
+        watch->mtime = st.st_mtim;
+        watch->size = st.st_size;
+        watch->processed = (processed < watch->size) ? processed : watch->size;
+        watch->tailLen = (watch->processed < WATCH_TAIL_LEN) ? watch->processed : WATCH_TAIL_LEN;
+        if (!preadAll(fd, watch->tail, watch->tailLen, watch->processed - watch->tailLen))
+            s = ERR_FILE_ACCESS;
+    }
+    close(fd);
+    return s;
+}
+
+// runs the program on the whole file
+// rows appended after it was saved are left for the next update
+State watchFullRun(Watch *watch) {
+    size_t saved = 0;
+    State s = processFile(watch->program, watch->filename, watch->args, &saved);
+    if (s != SUCCESS)
+        return s;
+    watch->cols = firstRowCells(watch->filename, watch->args->delimiters);
+    return watchRemember(watch, saved);
+}
+
+// checks if the file only grew since the last run
+bool isAppended(Watch *watch, struct stat *st) {
+    if ((st->st_dev != watch->dev) || (st->st_ino != watch->inode)
+        || ((size_t)st->st_size < watch->processed))
+        return false;
+    // the same size with a different time is an edit
+    if (((size_t)st->st_size == watch->size)
+        && ((st->st_mtim.tv_sec != watch->mtime.tv_sec)
+        || (st->st_mtim.tv_nsec != watch->mtime.tv_nsec)))
+        return false;
+
+    int fd = open(watch->filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    char tail[WATCH_TAIL_LEN];
+    bool same = preadAll(fd, tail, watch->tailLen, watch->processed - watch->tailLen)
+        && memcmp(tail, watch->tail, watch->tailLen) == 0;
+    close(fd);
+    return same;
+}
+
+// processes the rows appended after the processed part
+// the last row is left for later, if it is not finished yet
+// the result overwrites the new rows, only if it is just as long
+// returns ERR_GENERIC, if the program can't run on the new rows alone,
+// the new rows are wider than the table or their result has a different length
+State watchAppend(Watch *watch, size_t size) {
+    long long start = nanoTime();
+    int fd = open(watch->filename, O_RDWR);
+    if (fd < 0)
+        return ERR_FILE_ACCESS;
+
+    size_t len = size - watch->processed;
+    char *data = statMalloc(ALLOC_IO, len + 1);
+    State s = (data != NULL) ? SUCCESS : ERR_MEMORY;
+    if (s == SUCCESS && !preadAll(fd, data, len, watch->processed))
+        s = ERR_FILE_ACCESS;
+
+    char *end = (s == SUCCESS) ? memrchr(data, '\n', len) : NULL;
+    if (end == NULL) {
+        statFree(ALLOC_IO, data);
+        close(fd);
+        // nothing to process, the file is only remembered as it is now
+        return (s == SUCCESS) ? watchRemember(watch, watch->processed) : s;
+    }
+    size_t rowsLen = end - data + 1;
+    data[rowsLen] = '\0';
+    statAdd(&stats.bytesRead, rowsLen);
+
+    // the new rows are a table of their own, as wide as the whole table
+    Table rows;
+    table_ctor(&rows);
+    rows.source.data = data;
+    rows.source.len = rowsLen;
+    s = readTable(&rows, data, watch->args->delimiters, false);
+    // a wider row makes the rows above it wider too, only a full run can do that
+    if (s == SUCCESS && rows.cols > watch->cols)
+        s = ERR_GENERIC;
+    if (s == SUCCESS)
+        s = assureTableSize(&rows, rows.rows, watch->cols);
+    if (s == SUCCESS && !isRowPartitionable(watch->program, &rows))
+        s = ERR_GENERIC;
+    start = addPhaseTime(PHASE_LOAD, start);
+    if (s == SUCCESS)
+        s = executeProgram(watch->program, &rows);
+    start = addPhaseTime(PHASE_EXECUTE, start);
+
+    char *out = NULL;
+    size_t outLen = 0;
+    FILE *f = (s == SUCCESS) ? open_memstream(&out, &outLen) : NULL;
+    if (s == SUCCESS && f == NULL)
+        s = ERR_MEMORY;
+    if (s == SUCCESS)
+        s = writeTable(&rows, rows.cols, f, NULL, watch->args->delimiters);
+    if (f != NULL && fclose(f) != 0 && s == SUCCESS)
+        s = ERR_MEMORY;
+
+    // the producer may be appending right now, so nothing after the new rows may move
+    if (s == SUCCESS && outLen != rowsLen)
+        s = ERR_GENERIC;
+    if (s == SUCCESS) {
+        if (!pwriteAll(fd, out, outLen, watch->processed))
+            s = ERR_FILE_ACCESS;
+        statAdd(&stats.bytesWritten, outLen);
+    }
+    free(out);
+    table_dtor(&rows);
+    close(fd);
+    if (s == SUCCESS)
+        s = watchRemember(watch, watch->processed + rowsLen);
+    addPhaseTime(PHASE_SAVE, start);
+    return s;
+}
+
+// processes the change of the file, the way it needs
+State watchUpdate(Watch *watch) {
+    struct stat st;
+    // the file is gone, it may come back
+    if (stat(watch->filename, &st) != 0)
+        return SUCCESS;
+
+    bool unchanged = (st.st_dev == watch->dev) && (st.st_ino == watch->inode)
+        && ((size_t)st.st_size == watch->size)
+        && (st.st_mtim.tv_sec == watch->mtime.tv_sec)
+        && (st.st_mtim.tv_nsec == watch->mtime.tv_nsec);
+    // usually the result of our own writing
+    // rows appended during the last run are not processed yet, even if nothing changed since
+    if (unchanged && watch->processed == watch->size)
+        return SUCCESS;
+
+    if (isAppended(watch, &st)) {
+        State s = watchAppend(watch, st.st_size);
+        if (s != ERR_GENERIC)
+            return s;
+        // the last row would lose its last cell, it has to be finished first
+        if (!endsWithNewline(watch->filename))
+            return SUCCESS;
+    }
+    return watchFullRun(watch);
+}
+
+// runs the program on the table and then after every change of the file,
+// until SIGINT or SIGTERM comes
+State watchTable(Program *program, Arguments *args) {
+    Watch watch = {.filename=args->filenames[0], .program=program, .args=args};
+
+    // the directory is watched, because saving replaces the file
+    char dir[strlen(watch.filename) + 2];
+    strcpy(dir, watch.filename);
+    char *slash = strrchr(dir, '/');
+    char *name = (slash != NULL) ? &watch.filename[slash - dir + 1] : watch.filename;
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+        return ERR_GENERIC;
+    uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ATTRIB;
+    if (inotify_add_watch(fd, dir, mask) < 0) {
+        close(fd);
+        return ERR_FILE_ACCESS;
+    }
+
+    // without SA_RESTART, so that waiting for the changes stops
+    struct sigaction action = {.sa_handler=stopWatching};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // the changes during the first run are already waiting in fd
+    State s = watchFullRun(&watch);
+    while (s == SUCCESS && !watchStopped) {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = read(fd, events, sizeof(events));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            s = ERR_GENERIC;
+            break;
+        }
+
+        bool changed = false;
+        for (char *p=events; p < events + len; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len > 0 && strcmp(event->name, name) == 0)
+                changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (!changed)
+            continue;
+
+        // a bad change must not stop the watching, the next one can be fine
+        State updated = watchUpdate(&watch);
+        if (updated != SUCCESS)
+            printErrorMessage(updated);
     }
-    fputs("Unknown error\n", stderr);
+    close(fd);
+    return s;
 }
 
 int main(int argc, char **argv) {
-    // the only instance of the table
-    Table table;
-    table_ctor(&table);
     // error codes are stored in this variable
     State s = SUCCESS;
-    FILE *fp = NULL;
     // all arguments are parsed into this structure
     Arguments arguments;
     // all the commands in dynamic array of Command objects
     // this can be directly executed
     Program program;
     program_ctor(&program);
+    // the error was already printed
+    bool reported = false;
+    long long start = nanoTime();
     // firstly load all the arguments from argv
     s = parseArguments(argc, argv, &arguments);
-    // parse the commands, so the memory can be freed
-    if (s == SUCCESS)
-        s = parseCommands(&program, arguments.commandString);
-    free(arguments.commandString);
-    // open file for reading
-    if (s == SUCCESS) {
-        fp = fopen(arguments.filename, "r");
-        if (!fp)
-            s = ERR_FILE_ACCESS;
-    }
-    // reading the table
-    if (s == SUCCESS)
-        s = readTable(&table, fp, arguments.delimiters);
-    // free the memory as soon as we don't need it
-    free(arguments.delimiters);
-    // close the file for reading
-    if (fp) {
-        fclose(fp);
-        fp = NULL;
-    }
-    // execute commands on the table
-    if (s == SUCCESS)
-        s = executeProgram(&program, &table);
-    // open the same file for writing
-    if (s == SUCCESS) {
-        fp = fopen(arguments.filename, "w");
-        if (!fp)
-            s = ERR_FILE_ACCESS;
-    }
-    free(arguments.filename);
-    // remove empty column on the right
-    if (s == SUCCESS)
-        s = deleteExcessCols(&table);
-    // print the table into the file
-    if (s == SUCCESS)
-        printTable(&table, fp);
-    // close the file
-    if (fp) {
-        fclose(fp);
-        fp = NULL;
+    start = addPhaseTime(PHASE_ARGS, start);
+    // the server loads the table and waits for commands
+    if (s == SUCCESS && arguments.serveSocket != NULL) {
+        s = serveTable(&arguments);
+    } else {
+        // parse the commands, so the memory can be freed
+        if (s == SUCCESS)
+            s = parseCommands(&program, arguments.commandString);
+        addPhaseTime(PHASE_COMMANDS, start);
+        // run the program on all the tables
+        if (s == SUCCESS && arguments.watch)
+            s = watchTable(&program, &arguments);
+        else if (s == SUCCESS) {
+            s = processFiles(&program, &arguments);
+            // more files already printed their errors with the filename
+            reported = s != SUCCESS && arguments.numFiles > 1;
+        }
+        if (s == SUCCESS && arguments.time)
+            printTimes(stderr);
     }
+    StatsFormat statsFormat = arguments.stats;
     // deallocate all the variables
+    arguments_dtor(&arguments);
     program_dtor(&program);
-    table_dtor(&table);
-    printErrorMessage(s);
+    // after everything is freed, so the leaks can be seen
+    printStats(stderr, statsFormat);
+    if (!reported)
+        printErrorMessage(s);
     return s;
 }
@@ -9,7 +9,9 @@ export LC_ALL=C
 
 SRC=sps.c
 BIN=${SRC%.c}
-CFLAGS="-std=c99 -Wall -Wextra -g"
+# e.g. CFLAGS="-std=c99 -g -pthread -fsanitize=address" sh spstest.sh
+# (the memory tests fail then, the sanitizer keeps freed memory)
+CFLAGS=${CFLAGS:-"-std=c99 -Wall -Wextra -g -pthread"}
 VALGRIND_CMDLINE="valgrind --leak-check=full --log-file="
 
 valgrind=
@@ -114,8 +116,82 @@ t() {
     return $result
 }
 
+# $1 = test name
+# $2 = awk program, that prints numbers to test (at most 4500 of them)
+# every number is summed into the next column by sps and the result
+# is compared with printf "%g" from the C library
+tformat() {
+    local tname="$1"
+    local numbers="$tname.numbers"
+    awk "$2" >$numbers
+    awk 'NR>1 { printf ";" } { printf "[%d,1];sum [%d,2]", NR, NR }' \
+        <$numbers >$tname.cmd
+    awk '{ printf "%s,%g\n", $1, $1 }' <$numbers >$tname.expected
+    cp $numbers $tname.txt
+    if [ -n "$valgrind" ]; then
+        $valgrind$tname.valgrind.log ./$BIN -d , -c $tname.cmd $tname.txt
+    else
+        ./$BIN -d , -c $tname.cmd $tname.txt
+    fi
+    cmp -s $tname.txt $tname.expected
+    report $tname $tname.txt "$tname: $(wc -l <$numbers) numbers"
+    local result=$?
+    rm $numbers $tname.cmd $tname.expected $tname.txt
+    tests_result=$((tests_result+result))
+    return $result
+}
+
+# $1 = test name
+# $2 = awk program, that generates the table
+# $3 = SPS command
+# $4 = awk program, that makes the expected table out of the generated one
+tbig() {
+    local tname="$1"
+    awk "$2" >$tname.txt
+    awk "$4" <$tname.txt >$tname.expected
+    if [ -n "$valgrind" ]; then
+        $valgrind$tname.valgrind.log ./$BIN -d , "$3" $tname.txt
+    else
+        ./$BIN -d , "$3" $tname.txt
+    fi
+    cmp -s $tname.txt $tname.expected
+    report $tname $tname.txt "$tname: $3"
+    local result=$?
+    rm $tname.txt $tname.expected
+    tests_result=$((tests_result+result))
+    return $result
+}
+
+# prints the resident memory after the program from the statistics in $1
+rss_after() {
+    grep -o '"rss_after_program_kb": [0-9]*' "$1" | grep -o '[0-9]*$'
+}
+
+# $1 = test name
+# $2 = awk program, that generates the table
+# $3 = program of sps, that deletes most of the table
+# $4 = awk program, that makes the expected result from the table
+# the memory after the program must be less than half of what the whole table takes
+# it runs without valgrind, that would measure itself
+tmem() {
+    local tname="$1"
+    awk "$2" >$tname.txt
+    awk "$4" <$tname.txt >$tname.expected
+    ./$BIN --stats=json -d , "[1,1]" $tname.txt 2>$tname.stats
+    local full=$(rss_after $tname.stats)
+    ./$BIN --stats=json -d , "$3" $tname.txt 2>$tname.stats
+    local after=$(rss_after $tname.stats)
+    cmp -s $tname.txt $tname.expected &&
+        [ -n "$full" ] && [ -n "$after" ] && [ $((after * 2)) -lt "$full" ]
+    report $tname $tname.txt "$tname: $3 ($after of $full kB)"
+    local result=$?
+    rm $tname.txt $tname.expected $tname.stats
+    tests_result=$((tests_result+result))
+    return $result
+}
+
 compile() {
-    cc -std=c99 -Wall -Wextra -g sps.c -o sps || exit 1
+    cc $CFLAGS sps.c -o sps || exit 1
 }
 
 test_basic() {
@@ -132,6 +208,9 @@ test_selection() {
     t min "[3,_];[min];set x" t.txt 3 1 x
     t max "[_,_];[max];set x" t.txt 3 3 x
     t find "[_,_];[find orld];set x" t.txt 2 2 x
+    t find2 "[1,1,3,2];[find world];set x" t.txt 2 2 x 1 2 svete
+    t find3 "[_,1];[find ahoj];[2,1];set ahoj;[1,1];set y;[_,1];[find ahoj];set x" t.txt 1 1 y 2 1 x
+    t find4 "[_,1];[find 3];[1,1];irow;[_,1];[find 3];set x" t.txt 4 1 x
 }
 
 test_structure() {
@@ -139,6 +218,13 @@ test_structure() {
     t arow "[1,1];arow" t.txt 1 1 ahoj    2 1 ""
     t icol "[1,2];icol" t.txt 1 1 ahoj    1 2 ""
     t acol "[1,2];acol" t.txt 1 1 ahoj    1 3 ""
+    t sort1 "[_,_];sort 3 desc" t.txt 1 1 3    2 1 hello    3 1 ahoj
+    t sort2 "[_,_];sort 1 str" t.txt 1 1 3    2 1 ahoj    3 1 hello
+    t sort3 "[2,1,3,3];sort 3 desc" t.txt 1 1 ahoj    2 1 3    3 1 hello
+    t transpose1 "[_,_];transpose" t.txt 1 2 hello    2 1 svete    3 1 1    1 3 3
+    t transpose2 "[3,1,3,2];clear;[1,1,2,3];transpose" t.txt 1 2 hello    3 1 1    3 2 2    1 3 ""    3 3 5
+    t transpose3 "[2,1,3,1];clear;[1,1,1,3];transpose" t.txt 2 1 svete    3 1 1    1 2 ""    2 2 world    3 3 5
+    t transpose4 "[1,1,1,3];transpose" t.txt 1 1 ahoj    1 2 svete    2 1 hello    3 1 3
 }
 
 test_change() {
@@ -146,12 +232,303 @@ test_change() {
     t swap "[1,1];swap [2,1]" t.txt 1 1 hello 2 1 ahoj
     t sum "[1,3,2,3];sum [3,3]" t.txt 3 3 "3"
     t avg "[1,3,2,3];avg [3,3]" t.txt 3 3 "1.5"
+    t add "[_,_];add 0.5" t.txt 1 1 ahoj    1 3 1.5    3 1 3.5
+    t mul "[_,3];mul -2" t.txt 1 3 -2    2 3 -4    3 3 -10
+    t add_text "[1,1];set 12abc;[1,2];set 0x10;[2,1];set information;[_,_];add 1" t.txt 1 1 12abc    1 2 0x10    2 1 information    1 3 2
+    t seq "[_,2];seq 10 0.25" t.txt 1 2 10    2 2 10.25    3 2 10.5
+    t fill "[1,1,2,2];fill [3,3]" t.txt 1 1 5    2 2 5    1 3 1    3 3 5
+    t grow "[2,3,4,4];set g;[_,_];count [1,1]" t.txt 1 1 13    4 4 g    2 2 world
+    t groupby "[_,1];set k;[2,1];set j;[_,_];groupby 1 3 sum [1,4]" t.txt 1 4 k    1 5 6    2 4 j    2 5 2
+    t copy "[1,1,2,2];copy [2,2]" t.txt 1 1 ahoj    2 2 ahoj    3 3 world
+    t move "[2,2,3,3];move [1,1]" t.txt 1 1 world    2 2 5    3 2 ""    1 3 1
 }
 
 test_vars() {
     t vars1 "[1,1];def _0;[2,1];def _1;use _0;[1,1];use _1" t.txt 1 1 hello 2 1 ahoj
     t vars2 "[1,3];def _9;inc _9;use _9" t.txt 1 3 2
     t vars3 "[1,1];[set];[2,1];[_];set x" t.txt 1 1 x 2 1 hello
+    t vars4 "[3,3];def _0;inc _1;iszero _0 +4;sub _0 _1;inc _2;goto -3;[1,1];use _2;[1,2];use _0" t.txt 1 1 5 1 2 0 3 3 5
+}
+
+test_format() {
+    # every integer, that can be printed without exponent
+    # and all the integers around rounding boundaries
+    tformat fmt_int1 'BEGIN { for (i=-2250; i<2250; i++) printf "%d\n", i }'
+    tformat fmt_int2 'BEGIN { for (i=997750; i<1002250; i++) printf "%d\n", i }'
+    tformat fmt_int3 'BEGIN { for (i=0; i<4500; i++) printf "%d\n", 1234560 + i * 5 }'
+    # halves are exact ties, these must be rounded half to even
+    tformat fmt_half 'BEGIN { for (i=0; i<4500; i++) printf "%.17g\n", 99990 + i / 2 }'
+    # all the exponents and the numbers just around the powers of ten
+    tformat fmt_exp 'BEGIN { for (e=-30; e<=30; e++) for (i=1; i<=9; i++) {
+        printf "%.17g\n%.17g\n", i * 10^e, -i * 10^e
+        printf "%.17g\n%.17g\n", (i - 0.0000005) * 10^e, 9.999995 * 10^e } }'
+    # random numbers with random exponents
+    tformat fmt_rand1 'BEGIN { srand(42); for (i=0; i<4500; i++)
+        printf "%.17g\n", (rand() - 0.5) * 10^int(rand() * 40 - 20) }'
+    tformat fmt_rand2 'BEGIN { srand(7); for (i=0; i<4500; i++)
+        printf "%.17g\n", int(rand() * 10^7) / 10^int(rand() * 12) }'
+    tformat fmt_rand3 'BEGIN { srand(3); for (i=0; i<4500; i++)
+        printf "%.17g\n", int(rand() * 10^int(rand() * 19)) }'
+    # numbers beyond the table of powers of ten
+    tformat fmt_huge 'BEGIN { for (e=21; e<=307; e+=2) for (i=1; i<=9; i++)
+        printf "%.17g\n%.17g\n", i * 10^e, -(i + 0.25) * 10^e }'
+}
+
+test_big() {
+    tbig max_big 'BEGIN { for (i=0; i<1200; i++) print (i * 7919) % 1200 + 1 }' \
+        "[_,1];[max];clear;[_,1];[max];clear;[_,1];[max];clear" \
+        '{ print ($1 > 1197) ? "" : $1 }'
+    tbig max_ties 'BEGIN { for (i=0; i<1200; i++) print i % 50 }' \
+        "[_,1];[max];clear;[_,1];[max];clear;[_,1];[max];clear" \
+        '{ if ($1 == 49 && n < 3) { n++; print "" } else print }'
+    tbig min_big 'BEGIN { for (i=0; i<1200; i++) print (i * 7919) % 1200 + 1 }' \
+        "[_,1];[min];set x;[_,1];[min];set y" \
+        '{ print ($1 == 1) ? "x" : ($1 == 2) ? "y" : $1 }'
+    tbig write_quotes 'BEGIN { for (i=1; i<=5; i++) printf "\"x,%d\",%d\n", i, i }' \
+        "[2,2];set y" '{ print (NR == 2) ? "\"x,2\",y" : $0 }'
+    tbig write_ragged 'BEGIN { print "a,b,c"; print "d"; print "e,f" }' \
+        "[3,1];set z" '{ print (NR == 1) ? $0 : (NR == 2) ? "d,," : "z,f," }'
+    tbig write_dcol 'BEGIN { for (i=1; i<=5; i++) printf "%d,%d,%d\n", i, i, i }' \
+        "[1,3];dcol;[1,3];set x" '{ print (NR == 1) ? "1,1,x" : substr($0, 1, 4) }'
+    # big enough to be split between threads, even on one processor
+    export SPS_THREADS=4
+    tbig partition 'BEGIN { for (i=0; i<150000; i++) printf "%d,%d\n", i, i % 7 }' \
+        "[_,2];mul 3;inc _1;[_,_];add 1;[_,1];use _1" '{ split($0, a, ","); print "1," (a[2] * 3 + 1) }'
+    # parts of different lengths
+    export SPS_PARTITION_MIN_ROWS=1000
+    tbig partition_small 'BEGIN { for (i=0; i<4321; i++) printf "%d,%d\n", i, i % 7 }' \
+        "[_,2];mul 3;inc _1;[_,_];add 1;[_,1];use _1" '{ split($0, a, ","); print "1," (a[2] * 3 + 1) }'
+    unset SPS_THREADS SPS_PARTITION_MIN_ROWS
+}
+
+# $1 = test name
+# the rest = arguments of sps
+# runs sps on t.txt and tab1.txt at once, both must have x at 1 1
+tbatch() {
+    local tname="$1"
+    shift
+    setup
+    cp t.txt tab1.txt
+    echo t.txt >files.lst
+    echo tab1.txt >>files.lst
+    if [ -n "$valgrind" ]; then
+        $valgrind$tname.valgrind.log ./$BIN "$@"
+    else
+        ./$BIN "$@"
+    fi
+    assert t.txt 1 1 x && assert tab1.txt 1 1 x && assert tab1.txt 2 1 hello
+    report $tname t.txt "$tname: $*"
+    local result=$?
+    rm files.lst
+    teardown
+    tests_result=$((tests_result+result))
+    return $result
+}
+
+test_batch() {
+    tbatch batch1 -d , "[1,1];set x" t.txt tab1.txt
+    tbatch batch2 -j 2 -d , "[1,1];set x" t.txt tab1.txt
+    tbatch batch3 -d , "[1,1];set x" --files-from files.lst
+
+    setup
+    ./$BIN -d , "[1,1];set x" t.txt missing.txt 2>batch.err
+    [ $? -ne 0 ] && assert t.txt 1 1 x &&
+        [ "$(grep -c . batch.err)" = 1 ] && grep -q '^missing.txt: ' batch.err
+    report batch_error t.txt "batch_error: one message for a missing file"
+    tests_result=$((tests_result+$?))
+    rm -f batch.err
+    teardown
+}
+
+test_serve() {
+    setup
+    printf '[1,1];set x\nbad\nflush\n[2,1];set y\n' |
+        ./$BIN -d , --serve - t.txt >serve.out
+    printf 'OK\nERR Command not found\nOK\nOK\n' | cmp -s - serve.out &&
+        assert t.txt 1 1 x && assert t.txt 2 1 y && assert t.txt 3 3 5
+    report serve t.txt "serve: --serve - t.txt"
+    tests_result=$((tests_result+$?))
+    # the file is trimmed, but the table keeps the empty column
+    printf '[1,4];set x\n[1,4];clear\nquit\n' |
+        ./$BIN -d , --serve - t.txt >serve.out
+    [ "$(head -n 1 t.txt)" = x,svete,1 ] &&
+    printf '[1,4];set x\n[1,4];clear\nflush\n[_,_];set z\nquit\n' |
+        ./$BIN -d , --serve - t.txt >serve.out
+    printf 'z,z,z,z\nz,z,z,z\nz,z,z,z\n' | cmp -s - t.txt
+    report serve_trim t.txt "serve_trim: flush keeps the columns of the table"
+    tests_result=$((tests_result+$?))
+    rm serve.out
+    teardown
+}
+
+test_stream() {
+    setup
+    # the front is processed, the rest flows through as it is
+    ./$BIN -d , "[1,1];set x" - <t.txt >out.txt &&
+        printf 'x,svete,1\nhello,world,2\n3,4,5\n' | cmp -s - out.txt
+    report stream1 out.txt "stream1: [1,1];set x - <t.txt"
+    tests_result=$((tests_result+$?))
+    # the whole table is needed
+    ./$BIN -d , "[_,2];set y" - <t.txt >out.txt &&
+        printf 'ahoj,y,1\nhello,y,2\n3,y,5\n' | cmp -s - out.txt
+    report stream2 out.txt "stream2: [_,2];set y - <t.txt"
+    tests_result=$((tests_result+$?))
+    # a formula can refer to rows, that are not selected
+    ./$BIN -d , "[1,2];set =SUM(1,3,3,3)" - <t.txt >out.txt &&
+        printf 'ahoj,8,1\nhello,world,2\n3,4,5\n' | cmp -s - out.txt
+    report stream3 out.txt "stream3: [1,2];set =SUM(1,3,3,3) - <t.txt"
+    tests_result=$((tests_result+$?))
+    # a wider row in the rest makes the front wider too
+    printf 'a\nb,c\n' | ./$BIN -d , "[1,1];set x" - >out.txt &&
+        printf 'x,\nb,c\n' | cmp -s - out.txt
+    report stream_wider out.txt "stream_wider: [1,1];set x - with a wider second row"
+    tests_result=$((tests_result+$?))
+    rm -f out.txt
+    teardown
+}
+
+test_stats() {
+    setup
+    ./$BIN --stats=json -d , "[1,1];set x" t.txt 2>stats.out &&
+        grep -q '"peak_rows": 3, "peak_cols": 3' stats.out &&
+        grep -q '"bytes_read": 33' stats.out &&
+        assert t.txt 1 1 x
+    report stats t.txt "stats: --stats=json [1,1];set x"
+    tests_result=$((tests_result+$?))
+    rm -f stats.out
+    teardown
+}
+
+test_join() {
+    setup
+    printf 'x,hello,H\ny,3,three\nz,hello,other\n' >join.txt
+    ./$BIN -d , "[_,1];join join.txt 2 3" t.txt &&
+        assert t.txt 1 2 "" && assert t.txt 2 2 H && assert t.txt 3 2 three &&
+        assert t.txt 3 3 4
+    report join t.txt "join: [_,1];join join.txt 2 3"
+    tests_result=$((tests_result+$?))
+    rm -f join.txt
+    teardown
+}
+
+test_uniq() {
+    setup
+    ./$BIN -d , "[3,1];set hello;[_,1];uniq" t.txt &&
+        printf 'ahoj,svete,1\nhello,world,2\n' | cmp -s - t.txt
+    report uniq t.txt "uniq: [3,1];set hello;[_,1];uniq"
+    tests_result=$((tests_result+$?))
+    ./$BIN -d , "[_,2];set w;[_,_];distinct 2 [1,3]" t.txt &&
+        printf 'ahoj,w,w\nhello,w,2\n' | cmp -s - t.txt
+    report distinct t.txt "distinct: [_,2];set w;[_,_];distinct 2 [1,3]"
+    tests_result=$((tests_result+$?))
+    teardown
+}
+
+test_lazy() {
+    setup
+    # only the second row is parsed, the others are copied as they are
+    ./$BIN --lazy -d , "[2,2];set x" t.txt &&
+        assert t.txt 1 2 svete && assert t.txt 2 2 x && assert t.txt 3 3 5
+    report lazy1 t.txt "lazy1: --lazy [2,2];set x"
+    tests_result=$((tests_result+$?))
+    ./$BIN --lazy -d , "[1,2];dcol" t.txt &&
+        printf 'ahoj,1\nhello,2\n3,5\n' | cmp -s - t.txt
+    report lazy2 t.txt "lazy2: --lazy [1,2];dcol"
+    tests_result=$((tests_result+$?))
+    teardown
+}
+
+test_cache() {
+    setup
+    # the second run reads the snapshot, the third one a changed table
+    ./$BIN --cache -d , "[1,1];set x" t.txt &&
+        [ -f t.txt.spsc ] &&
+        ./$BIN --cache -d , "[2,1];set y" t.txt &&
+        printf 'z,4,5\n' >>t.txt &&
+        ./$BIN --cache -d , "[4,1];set w" t.txt &&
+        assert t.txt 1 1 x && assert t.txt 2 1 y && assert t.txt 3 3 5 &&
+        assert t.txt 4 1 w && assert t.txt 4 2 4
+    report cache t.txt "cache: --cache t.txt"
+    local result=$?
+    rm -f t.txt.spsc
+    teardown
+    tests_result=$((tests_result+result))
+}
+
+test_cache_edit() {
+    awk 'BEGIN { for (i=0; i<20000; i++) printf "r%d,%d\n", i, i }' >cache.txt
+    # an edit in the middle, that keeps the size and the mtime
+    ./$BIN --cache -d , "[1,1]" cache.txt &&
+        cp -p cache.txt cache.ref &&
+        sed 's/^r10000,/R10000,/' cache.ref >cache.txt &&
+        touch -r cache.ref cache.txt &&
+        ./$BIN --cache -d , "[10001,2];set x" cache.txt &&
+        grep -q '^R10000,x$' cache.txt
+    report cache_edit cache.txt "cache_edit: --cache, same size and mtime"
+    local result=$?
+    rm -f cache.txt cache.txt.spsc cache.ref
+    tests_result=$((tests_result+result))
+}
+
+test_formula() {
+    t formula1 "[3,1];set =SUM(1,3,3,3)*2;[2,3];set 10" t.txt 3 1 32    2 3 10
+    t formula2 "[1,1];set =[3,2]+1;[2,1];set =[1,1]*[3,3];[3,2];set 9" t.txt 1 1 10    2 1 50
+    # the formula follows its cell, references stay where they were
+    t formula3 "[1,4];set =COUNT(1,1,3,3);[1,1];irow" t.txt 2 4 6    3 3 2
+    t formula_text "[1,1];set ==x;[1,2];set ==1+2" t.txt 1 1 =x    1 2 =1+2
+    setup
+    ! ./$BIN -d , "[1,1];set =[2,1];[2,1];set =[1,1]" t.txt 2>/dev/null &&
+        assert t.txt 1 1 ahoj && assert t.txt 2 1 hello
+    report formula_cycle t.txt "formula_cycle: [1,1];set =[2,1];[2,1];set =[1,1]"
+    tests_result=$((tests_result+$?))
+    teardown
+}
+
+# $1 = file
+# $2 = expected contents in the format of printf
+# waits until the file has the contents, at most 5 seconds
+wait_for() {
+    for i in $(seq 50); do
+        printf "$2" | cmp -s - "$1" && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+test_watch() {
+    setup
+    ./$BIN -d , --watch "[_,1];add 1" t.txt &
+    local pid=$!
+    # only the appended row is processed, the others stay as they are
+    wait_for t.txt 'ahoj,svete,1\nhello,world,2\n4,4,5\n' &&
+        printf '7,8,9\n' >>t.txt &&
+        wait_for t.txt 'ahoj,svete,1\nhello,world,2\n4,4,5\n8,8,9\n'
+    report watch1 t.txt "watch1: --watch [_,1];add 1, append"
+    tests_result=$((tests_result+$?))
+    # a new file is processed whole
+    printf '1,2\n3\n' >t.txt.new && mv t.txt.new t.txt &&
+        wait_for t.txt '2,2\n4,\n'
+    report watch2 t.txt "watch2: --watch [_,1];add 1, replace"
+    tests_result=$((tests_result+$?))
+    # a wider row makes the rows above it wider, that needs a full run
+    # so does a result longer than the row, the file can't move under the producer
+    printf '5,6,7\n' >>t.txt &&
+        wait_for t.txt '3,2,\n5,,\n6,6,7\n' &&
+        printf '1\n' >>t.txt &&
+        wait_for t.txt '4,2,\n6,,\n7,6,7\n2,,\n'
+    report watch3 t.txt "watch3: --watch [_,1];add 1, wider row"
+    tests_result=$((tests_result+$?))
+    kill $pid
+    wait $pid
+    teardown
+}
+
+test_memory() {
+    # most of the table is deleted, the memory goes back to the system
+    tmem memory_drow 'BEGIN { for (i=0; i<150000; i++) printf "r%d,%d,x%d,%d,y%d,%d\n", i, i, i, i % 9, i, i }' \
+        "[1,1,135000,1];drow" 'NR > 135000'
+    tmem memory_dcol 'BEGIN { for (i=0; i<150000; i++) printf "r%d,%d,x%d,%d,y%d,%d\n", i, i, i, i % 9, i, i }' \
+        "[1,2,1,6];dcol" '{ split($0, a, ","); print a[1] }'
 }
 
 run_tests() {
@@ -160,6 +537,20 @@ run_tests() {
     test_structure
     test_change
     test_vars
+    test_format
+    test_big
+    test_batch
+    test_serve
+    test_cache
+    test_cache_edit
+    test_stream
+    test_stats
+    test_lazy
+    test_join
+    test_uniq
+    test_formula
+    test_watch
+    test_memory
 }
 
 if [ "x$1" = x-h ]; then